@@ -180,6 +180,56 @@ static bool extract_dom_max_size(struct boot_media *boot_media, const char *para
     return true;
 }
 
+/**
+ * Extracts serving SMART of sleeping disks from memory (smart_sleep=<idle sec>[,<max age sec>]) from kernel cmd line
+ */
+static bool extract_smart_sleep(struct smart_sleep_cache *smart_sleep, const char *param_pointer)
+{
+    ensure_cmdline_param(CMDLINE_CT_SMART_SLEEP);
+
+    const char *value = param_pointer + strlen_static(CMDLINE_CT_SMART_SLEEP);
+    char *end;
+    unsigned long idle_sec = simple_strtoul(value, &end, 10);
+    unsigned long max_age_sec = 0;
+    if (*end == ',')
+        max_age_sec = simple_strtoul(end + 1, &end, 10);
+
+    if (end == value || *end != '\0' || idle_sec > UINT_MAX / HZ || max_age_sec > UINT_MAX / HZ) {
+        pr_loc_err("Invalid SMART sleep cache config (\"%s\")", param_pointer);
+        return true;
+    }
+
+    smart_sleep->configured = true;
+    smart_sleep->idle_sec = idle_sec;
+    smart_sleep->max_age_sec = max_age_sec;
+    pr_loc_dbg("SMART sleep cache set to idle=%lus max_age=%lus", idle_sec, max_age_sec);
+
+    return true;
+}
+
+/**
+ * Extracts vUART interrupts delivery mode (vuart_irq=<thread|poll>) from kernel cmd line
+ */
+static bool extract_vuart_irq(struct vuart_irq_config *vuart_irq, const char *param_pointer)
+{
+    ensure_cmdline_param(CMDLINE_CT_VUART_IRQ);
+
+    const char *value = param_pointer + strlen_static(CMDLINE_CT_VUART_IRQ);
+    if (strcmp(value, "thread") == 0) {
+        vuart_irq->mode = VUART_IRQ_THREAD;
+    } else if (strcmp(value, "poll") == 0) {
+        vuart_irq->mode = VUART_IRQ_POLL;
+    } else {
+        pr_loc_err("Invalid vUART IRQ mode (\"%s\") - expected \"thread\" or \"poll\"", param_pointer);
+        return true;
+    }
+
+    vuart_irq->configured = true;
+    pr_loc_dbg("vUART IRQ mode set to %s", value);
+
+    return true;
+}
+
 /**
  * Extracts MFG mode enable switch (syno_port_thaw=<1|0>) from kernel cmd line
  *
@@ -394,9 +444,11 @@ int populate_cmdline_blacklist(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_
     ADD_BLACKLIST_ENTRY(6, CMDLINE_KT_PK_BUFFER);
     ADD_BLACKLIST_ENTRY(7, CMDLINE_KT_EARLY_PK);
     ADD_BLACKLIST_ENTRY(8, CMDLINE_KT_THAW);
+    ADD_BLACKLIST_ENTRY(9, CMDLINE_CT_SMART_SLEEP);
+    ADD_BLACKLIST_ENTRY(10, CMDLINE_CT_VUART_IRQ);
 
 #ifndef NATIVE_SATA_DOM_SUPPORTED //on kernels without SATA DOM support we shouldn't reveal that it's a SATA DOM-boot
-    ADD_BLACKLIST_ENTRY(9, CMDLINE_KT_SATADOM);
+    ADD_BLACKLIST_ENTRY(11, CMDLINE_KT_SATADOM);
 #endif
 
     return 0;
@@ -437,6 +489,8 @@ int extract_config_from_cmdline(struct runtime_config *config)
         extract_dom_max_size(&config->boot_media, single_param_chunk)    ||
         extract_mfg(&config->boot_media.mfg_mode, single_param_chunk)    ||
         extract_port_thaw(&config->port_thaw, single_param_chunk)        ||
+        extract_smart_sleep(&config->smart_sleep, single_param_chunk)    ||
+        extract_vuart_irq(&config->vuart_irq, single_param_chunk)        ||
         extract_netif_num(&config->netif_num, single_param_chunk)        ||
         extract_netif_macs(config->macs, single_param_chunk)             ||
         report_unrecognized_option(single_param_chunk)                   ;
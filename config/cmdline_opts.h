@@ -15,6 +15,8 @@
 #define CMDLINE_CT_PID "pid=" //Boot media Product ID override
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
 #define CMDLINE_CT_DOM_SZMAX "dom_szmax=" //Max size of SATA device (MiB) to be considered a DOM (usually you should NOT use this)
+#define CMDLINE_CT_SMART_SLEEP "smart_sleep=" //<idle sec>[,<max age sec>] - serve SMART of idle disks from memory (0=off)
+#define CMDLINE_CT_VUART_IRQ "vuart_irq=" //thread|poll - how interrupts of virtual UARTs (e.g. PMU) are delivered
 
 //Standard Linux cmdline tokens
 #define CMDLINE_KT_ELEVATOR  "elevator=" //Sets I/O scheduler (we use it to load RP LKM earlier than normally possible)
@@ -15,6 +15,15 @@ struct runtime_config current_config = {
         .dom_size_mib = 1024, //usually the image will be used with ESXi and thus it will be ~100MB anyway
     },
     .port_thaw = true,
+    .smart_sleep = {
+        .configured = false,
+        .idle_sec = 0,
+        .max_age_sec = 0,
+    },
+    .vuart_irq = {
+        .configured = false,
+        .mode = VUART_IRQ_THREAD,
+    },
     .netif_num = 0,
     .macs = { '\0' },
     .cmdline_blacklist = { '\0' },
@@ -2,12 +2,13 @@
 #define REDPILLLKM_RUNTIME_CONFIG_H
 
 #include "uart_defs.h" //UART config values
+#include "../internal/uart/virtual_uart.h" //vuart_irq_mode
 #include <linux/types.h> //bool
 
 //These below are currently known runtime limitations
 #define MAX_NET_IFACES 8
 #define MAC_ADDR_LEN 12
-#define MAX_BLACKLISTED_CMDLINE_TOKENS 10
+#define MAX_BLACKLISTED_CMDLINE_TOKENS 12
 
 #ifdef CONFIG_SYNO_BOOT_SATA_DOM
 #define NATIVE_SATA_DOM_SUPPORTED //whether SCSI sd.c driver supports native SATA DOM
@@ -44,12 +45,27 @@ struct boot_media {
     unsigned long dom_size_mib; //Max size of SATA DOM            Default: 1024 <valid, READ native_sata_boot_shim.c!!!>
 };
 
+//See smart_shim_set_sleep_cache() for details
+struct smart_sleep_cache {
+    bool configured; //whether it was set at all (if not defaults from smart_shim.c are used)  Default: false <valid>
+    unsigned int idle_sec; //time w/o I/O after which disk is considered asleep; 0 = disabled  Default: 0 <valid>
+    unsigned int max_age_sec; //max age of SMART served from memory; 0 = default               Default: 0 <valid>
+};
+
+//See vuart_set_irq_mode() for details
+struct vuart_irq_config {
+    bool configured; //whether it was set at all (if not VUART_DEFAULT_IRQ_MODE is used)   Default: false <valid>
+    vuart_irq_mode mode; //how vUARTs deliver interrupts to the 8250 driver               Default: thread <valid>
+};
+
 struct hw_config;
 struct runtime_config {
     syno_hw hw; //used to determine quirks.                                Default: empty <invalid>
     serial_no sn; //Used to validate it and warn the user.                 Default: empty <invalid>
     struct boot_media boot_media;
     bool port_thaw; //Currently unknown.                                   Default: true  <valid>
+    struct smart_sleep_cache smart_sleep;
+    struct vuart_irq_config vuart_irq;
     unsigned short netif_num; //Number of eth interfaces.                  Default: 0     <invalid>
     mac_address *macs[MAX_NET_IFACES]; //MAC addresses of eth interfaces.  Default: []    <invalid>
     cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS];//    Default: []
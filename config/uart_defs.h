@@ -30,8 +30,9 @@
 #define STD_COMX_DEV_NAME "ttyS"
 #define SRD_COMX_BAUD_OPTS "115200n8"
 
-#define UART_NR CONFIG_SERIAL_8250_NR_UARTS
-#define SERIAL8250_LAST_ISA_LINE (UART_NR-1) //max valid index of ttyS
+#define UART_NR CONFIG_SERIAL_8250_NR_UARTS //max number of ttyS the 8250 driver supports
+#define SERIAL8250_ISA_LINES 4 //legacy IBM/PC COM1-4 ports (see STD_COM* above); lines above are non-ISA ports
+#define SERIAL8250_LAST_ISA_LINE (SERIAL8250_ISA_LINES-1) //max index of ttyS which is a legacy COM port
 #define SERIAL8250_SOFT_IRQ 0 //a special IRQ value which, if set on a port, will force 8250 driver to use timers
 
 
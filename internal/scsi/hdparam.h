@@ -58,6 +58,9 @@
 #define WIN_FT_SMART_STATUS 0xda
 #define WIN_FT_SMART_AUTOSAVE 0xd2 //this is not a typo (AUTOSAVE and AUTO_OFFLINE are spelled differently in ATA spec)
 #define WIN_FT_SMART_AUTO_OFFLINE 0xdb
+#ifndef ATA_SMART_DISABLE //ATA_SMART_ENABLE is defined in ata.h but its counterpart is not
+#define ATA_SMART_DISABLE 0xd9
+#endif
 
 /*************************************** Params related to ATA IDENTIFY command ***************************************/
 //Word numbers for the ATA IDENTIFY command response fields & bits in them (described in "struct hd_driveid")
@@ -98,6 +101,7 @@
 
 /*********************************************** Miscellaneous constants **********************************************/
 #define ATA_SMART_RECORD_LEN 12 //length of the SMART snapshot data row in bytes, defined
+#define ATA_SMART_MAX_RECORDS 30 //number of SMART snapshot data rows in the sector ("Table 59" in ATA/ATAPI-6 PDF)
 
 //Modified for kernel use - it's the "hd_driveid" struct from Linux include/uapi/linux/hdreg.h which represents a
 // response to HDIO_GET_IDENTITY. See "Table 26 − IDENTIFY DEVICE information" in ATA/ATAPI-6 spec for details.
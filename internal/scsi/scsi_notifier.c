@@ -5,8 +5,8 @@
  * pub/sub model. As many subsystems predate existence of the so-called Notification Chains these subsystems usually
  * lack any pub/sub functionality. SCSI is no exception. SCSI layer/driver is ancient and huge. It does not have any way
  * of delivering events to other parts of the system. This submodule retrofits notification chains to the SCSI layer to
- * notify about new devices being added to the system. It can be easily extended to notify about removed devices as
- * well.
+ * notify about new devices being added to the system (by shimming sd_probe()) and about devices being removed (by
+ * shimming sd_remove()).
  *
  * Before using this submodule you should read the notice below + the gitbooks article if you have never worked with
  * Linux notification chains.
@@ -23,19 +23,22 @@
  *      scsi_event=SCSI_EVT_DEV_PROBING: stop sd_probe() with EBUSY error; subscribers with lower priority will not exec
  *      scsi_event=SCSI_EVT_DEV_PROBED_OK: subscribers with lower priority will not exec
  *      scsi_event=SCSI_EVT_DEV_PROBED_ERR: subscribers with lower priority will not exec
+ *      scsi_event=SCSI_EVT_DEV_REMOVING: subscribers with lower priority will not exec (removal cannot be vetoed)
  *   - NOTIFY_STOP:
  *      scsi_event=SCSI_EVT_DEV_PROBING: stop sd_probe() with 0 err-code; subscribers with lower priority will not exec
  *      scsi_event=SCSI_EVT_DEV_PROBED_OK: subscribers with lower priority will not exec
  *      scsi_event=SCSI_EVT_DEV_PROBED_ERR: subscribers with lower priority will not exec
+ *      scsi_event=SCSI_EVT_DEV_REMOVING: subscribers with lower priority will not exec
  *
  * SUPPORTED DEVICES
  * Currently only SCSI disks are supported. This isn't a technical limitation but rather a practical one - we don't want
  * to trigger notifications for all-all SCSI devices (which include hosts, buses, etc). If needed a new set of functions
  * subscribe_.../ubsubscribe_... can easily be added which don't filter by type.
  *
- * TODO
- * This notifier does not support notifying about disconnection of the device. It should as we need to know if device
- * disappeared (e.g. while processing shimming of boot devices).
+ * REMOVAL
+ * SCSI_EVT_DEV_REMOVING is delivered before the original sd_remove() runs, so the scsi_device as well as the gendisk
+ * attached to it are still valid (and their addresses aren't reused yet). This makes it a good place to drop any
+ * per-device state. Devices which were probed before the notifier was registered will still deliver removal events.
  *
  * ADDITIONAL TOOLS
  * It is highly recommended to use scsi_toolbox when subscribing to notifications from the SCSI subsystem.
@@ -57,6 +60,7 @@
 /*********************************** Interacting with an active/loaded SCSI driver ************************************/
 static driver_watcher_instance *driver_watcher = NULL;
 static int (*org_sd_probe) (struct device *dev) = NULL; //set during register
+static int (*org_sd_remove) (struct device *dev) = NULL; //set during register
 
 /**
  * Main notification routine hooking sd_probe()
@@ -104,7 +108,20 @@ static int sd_probe_shim(struct device *dev)
 }
 
 /**
- * Overrides sd_probe() to provide notifications via sd_probe_shim()
+ * Notifies about a device going away via sd_remove()
+ */
+static int sd_remove_shim(struct device *dev)
+{
+    if (is_scsi_leaf(dev) && is_scsi_disk(to_scsi_device(dev))) {
+        pr_loc_dbg("Triggering SCSI_EVT_DEV_REMOVING notifications");
+        blocking_notifier_call_chain(&rp_scsi_notify_list, SCSI_EVT_DEV_REMOVING, to_scsi_device(dev));
+    }
+
+    return org_sd_remove(dev);
+}
+
+/**
+ * Overrides sd_probe() & sd_remove() to provide notifications via sd_probe_shim() & sd_remove_shim()
  *
  * @param drv "sd" driver instance
  */
@@ -113,10 +130,16 @@ static inline void install_sd_probe_shim(struct device_driver *drv)
     pr_loc_dbg("Overriding %pf()<%p> with %pf()<%p>", drv->probe, drv->probe, sd_probe_shim, sd_probe_shim);
     org_sd_probe = drv->probe;
     drv->probe = sd_probe_shim;
+
+    if (likely(drv->remove)) {
+        pr_loc_dbg("Overriding %pf()<%p> with %pf()<%p>", drv->remove, drv->remove, sd_remove_shim, sd_remove_shim);
+        org_sd_remove = drv->remove;
+        drv->remove = sd_remove_shim;
+    }
 }
 
 /**
- * Removes override of sd_probe(), installed by install_sd_probe_shim()
+ * Removes override of sd_probe() & sd_remove(), installed by install_sd_probe_shim()
  *
  * @param drv "sd" driver instance
  */
@@ -133,6 +156,12 @@ static inline void uninstall_sd_probe_shim(struct device_driver *drv)
     pr_loc_dbg("Restoring %pf()<%p> to %pf()<%p>", drv->probe, drv->probe, org_sd_probe, org_sd_probe);
     drv->probe = org_sd_probe;
     org_sd_probe = NULL;
+
+    if (likely(org_sd_remove)) {
+        pr_loc_dbg("Restoring %pf()<%p> to %pf()<%p>", drv->remove, drv->remove, org_sd_remove, org_sd_remove);
+        drv->remove = org_sd_remove;
+        org_sd_remove = NULL;
+    }
 }
 
 /**
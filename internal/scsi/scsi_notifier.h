@@ -7,6 +7,7 @@ typedef enum {
     SCSI_EVT_DEV_PROBING, //device is being probed; it can be modified or outright ignored
     SCSI_EVT_DEV_PROBED_OK, //device is probed and ready
     SCSI_EVT_DEV_PROBED_ERR, //device was probed but it failed
+    SCSI_EVT_DEV_REMOVING, //device is being removed (it's still valid during the notification); return value is ignored
 } scsi_event;
 
 /**
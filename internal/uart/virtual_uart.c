@@ -26,9 +26,12 @@
  * LIMITATIONS
  * -----------
  *  - For obvious reasons (as we are not working with a real hw) the DMA portion of the chip is not emulated
- *  - On most system the maximum number of UARTs emulated is 4 (driver's limitation, see CONFIG_SERIAL_8250_NR_UARTS)
- *  - FIFOs, true to the original 16550A, are limited to 16 bytes each. In theory, if needed, they can be enlarge up to
- *    even 256 bytes each with chip model change (as 8250 driver actually tests how big a FIFO is on setup)
+ *  - The maximum number of UARTs emulated is CONFIG_SERIAL_8250_NR_UARTS (driver's limitation), which on most systems
+ *    is 4. Lines above COM1-4 also need free slots in the driver at runtime (8250.nr_uarts=)
+ *  - FIFOs, true to the original 16550A, are limited to 16 bytes each by default. Deeper FIFOs are available by choosing
+ *    a different chip model (see vuart_add_device_model()): 16750 (64 bytes) or 16C950 (128 bytes). Only the parts of
+ *    these chips which the 8250 driver uses are emulated (e.g. 16C950 ICR registers other than ACR are ignored). Models
+ *    other than 16550A are registered with a fixed type, so the driver doesn't probe them.
  *  - FIFO mode is always enabled. There are some not-fully-accurate pieces which don't handle non-FIFO operation. There
  *    is (at least to our knowledge) no reason to use it adn kernel always asks for FIFO to save CPU anyway.
  *
@@ -46,9 +49,30 @@
  *    pretty catastrophic as you will be flooded with messages about IIR being read as long as the port stays open in 
  *    the userland. This consciously does not use kernel's dynamic debug facilities are some (e.g. 918+) kernels are
  *    compiled without it.
- *  - To change name of the vIRQ thread define VUART_THREAD_FMT which gets a real port IRQ # and ttyS# as its params.
+ *  - vIRQs of all ports are delivered by a single shared thread (see vuart_virtual_irq.c). To change its name define
+ *    VUART_THREAD_FMT which gets a real IRQ # and ttyS# of the first port using vIRQ as its params. The thread can be
+ *    replaced at runtime by an adaptive hrtimer polling (see vuart_set_irq_mode(), set from "vuart_irq=" cmdline by the
+ *    module init); VUART_DEFAULT_IRQ_MODE selects the mode used when nothing else was requested.
  *  - UART_BUG_SWAPPED (defined in uart_defs.h) is used to detect swapped ports and make sure numbers used here are real
  *    ttyS* values and not swapped bs (as 8250 matches ports by iobase and not line#)
+ *  - RX data is reported to the driver when the FCR-selected trigger level is reached or, if it stays below it, after a
+ *    character timeout (VUART_RX_TIMEOUT_CHARS character-times, calculated from the divisor & LCR) on a hrtimer. This
+ *    way bulk injections are picked up by the driver in one interrupt rather than one per byte.
+ *  - Injected RX data which doesn't fit in the RX FIFO is held in a staging queue (VUART_RX_QUEUE_LEN bytes) and moved
+ *    to the FIFO whenever the driver empties it. Injecting more than that returns a short count instead of an overrun.
+ *  - FIFOs are lock-free single-producer/single-consumer rings (see vuart_ring.h). The vdev lock only protects registers
+ *    so e.g. vuart_inject_rx() copies data without it and only takes it once to update LSR/IIR. Multiple injectors (e.g.
+ *    the PMU shim & /dev/vuartN) are serialized with a separate, per-vdev rx_producer_lock instead.
+ *  - Devices are allocated on the first use of a line so lines which are never used cost only a pointer. Accessors
+ *    find the device by the port iobase (the driver matches ports by iobase, not line), so lines above COM4 use
+ *    synthetic iobases (see VUART_EXTRA_IOBASE_START) which must not collide with anything in the system.
+ *  - Any number of TX subscribers can be attached to a line (see vuart_subscribe_tx()), each with its own threshold
+ *    and position in the TX FIFO. The list is RCU-protected so flushing doesn't take any locks besides the vdev one.
+ *  - Every line gets a /dev/vuartN character device letting the userspace act as the other end of the line (see
+ *    vuart_chardev.h). It's not available above STEALTH_MODE_BASIC and can be disabled by VUART_DISABLE_CHARDEV.
+ *  - Traffic (TX, RX & IIR changes) of all lines can be recorded at full speed into per-CPU relay buffers in debugfs
+ *    without a debug build (see vuart_recorder.h). Like the character device it can be disabled with
+ *    VUART_DISABLE_RECORDER.
  *
  * References:
  *  - https://github.com/clearlinux/kvmtool/blob/b5891a4337eb6744c8ac22cc02df3257961ae23e/hw/serial.c (inspiration)
@@ -61,6 +85,8 @@
 //Keep in mind you may need to set the debug in vuart_virtual_irq separatedly (or in common.h)
 //#define VUART_DEBUG_LOG
 //#define VUART_USE_TIMER_FALLBACK
+//#define VUART_DISABLE_CHARDEV
+//#define VUART_DISABLE_RECORDER
 
 #include "virtual_uart.h"
 #include "vuart_internal.h"
@@ -69,10 +95,15 @@
 #include "../../config/uart_defs.h" //COM defs & struct uart_port
 #include "../../internal/intercept_driver_register.h" //is_driver_registered, watch_driver_register, unwatch_driver_register
 #include "vuart_virtual_irq.h" //vIRQ handling & shimming; CHECKS VUART_USE_TIMER_FALLBACK
+#include "vuart_chardev.h" //vuart_chardev_add(), vuart_chardev_remove(); CHECKS STEALTH_MODE
+#include "vuart_recorder.h" //vuart_record(), vuart_recorder_add(), vuart_recorder_remove(); CHECKS STEALTH_MODE
 #include <linux/serial_8250.h> //serial8250_unregister_port, uart_8250_port
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/spinlock.h> //locking devices (vdev->lock)
-#include <linux/kfifo.h> //kfifo_*
+#include <linux/hrtimer.h> //character timeout timer
+#include <linux/math64.h> //div_u64()
+#include <linux/rculist.h> //hlist_*_rcu() for TX subscribers
+#include <linux/mutex.h> //DEFINE_MUTEX
 
 /************************************************* Static definitions *************************************************/
 /*
@@ -82,13 +113,61 @@
 #define UART_IIR_FIFOEN 0xc0
 #define UART_IIR_FIFEN_B6 0x40
 #define UART_IIR_FIFEN_B7 0x80
+#ifndef UART_IIR_64BYTE_FIFO //not all kernels define it
+#define UART_IIR_64BYTE_FIFO 0x20 //16750 reports 64 bytes FIFO mode in IIR bit 5
+#endif
 #define UART_DRIVER_NAME "serial8250" //see drivers/tty/serial/8250/8250_core.c in "serial8250_isa_driver"
 
+//Number of character-times after which data sitting below RX trigger level is reported (4 as per 16550A datasheet)
+#ifndef VUART_RX_TIMEOUT_CHARS
+#define VUART_RX_TIMEOUT_CHARS 4
+#endif
+
+//Size of the RX staging queue which holds injected data not fitting in the RX FIFO (0 disables it); MUST be a power of 2
+#ifndef VUART_RX_QUEUE_LEN
+#define VUART_RX_QUEUE_LEN 4096
+#endif
+
+//Lines above COM1-4 are registered as additional ports with a synthetic iobase (8 registers each) starting here. Nothing
+// ever does real I/O there (all accesses go through serial_remote_read/write) but the driver reserves the region, so it
+// must not collide with anything else in the system.
+#ifndef VUART_EXTRA_IOBASE_START
+#define VUART_EXTRA_IOBASE_START 0x7f00
+#endif
+#define VUART_EXTRA_IOBASE(line) (VUART_EXTRA_IOBASE_START + ((line) - SERIAL8250_ISA_LINES) * 8)
+#define VUART_EXTRA_IRQ(line) (((line) & 1) ? STD_COM2_IRQ : STD_COM1_IRQ) //they alternate like COM1-4 IRQs
+
+/**
+ * Properties of emulated chip models (see vuart_chip_model)
+ *
+ * Both 16750 and 16C950 start in a 16550A-compatible mode with 16 bytes FIFOs. The 16750 switches to 64 bytes FIFOs
+ * when FCR bit 5 is set (which can only be done with DLAB=1) while 16C950 switches to 128 bytes FIFOs in the "enhanced
+ * mode" (EFR bit 4 set). The 8250 driver enables both of these during port startup. See get_active_chip().
+ */
+struct vuart_chip_def {
+    const char *name;
+    unsigned int port_type; //PORT_* constant used by the 8250 driver
+    unsigned int fifo_len; //FIFOs depth in the deepest mode supported; MUST be a power of 2 and <= VUART_FIFO_LEN_MAX
+    unsigned int rx_triggers[4]; //RX trigger levels selected by FCR bits 6-7
+};
+
+static const struct vuart_chip_def chip_defs[] = {
+    [VUART_CHIP_16550A] = { .name = "16550A", .port_type = PORT_16550A, .fifo_len = 16, .rx_triggers = {1, 4, 8, 14} },
+    [VUART_CHIP_16750] = { .name = "16750", .port_type = PORT_16750, .fifo_len = 64, .rx_triggers = {1, 16, 32, 56} },
+    [VUART_CHIP_16950] = { .name = "16C950", .port_type = PORT_16C950, .fifo_len = 128,
+                           .rx_triggers = {16, 32, 112, 120} },
+};
+
 /**
- * Static definition of all possible UARTs in the system supported by 8250 driver
+ * Static definition of legacy COM1-4 UARTs supported by 8250 driver
  * These definitions are exactly the same as in arch/x86/include/asm/serial.h
  */
-static struct serial8250_16550A_vdev ttySs[] = {
+struct vuart_isa_port {
+    u16 iobase;
+    u8 irq;
+};
+
+static const struct vuart_isa_port isa_ports[SERIAL8250_ISA_LINES] = {
 //we're crying too... the issue is normally operate on port lines (=ttyS#) but during port registration ports the driver
 // performs matching based on its internal iobase mapping, so we can ask for the port to be line=0 but if the driver
 // finds a port with iobase specified under line=1 it will just register is as line=1 instead of line=0. This causes all
@@ -102,30 +181,37 @@ static struct serial8250_16550A_vdev ttySs[] = {
 // TODO: this whole code should switch to relying on iobases instead o lines. This way when we do reads or writes we
 //       don't care if something is swapped - we call for registration on line 0, we lookup what's the expected iobase
 //       for that ttyS and we register for it. If the driver decides to use a different line# we shouldn't care.
+//       Reads & writes already do that (see get_port_vdev()), only the swap handling below still relies on lines.
 #if defined(UART_BUG_SWAPPED) && defined(DBG_DISABLE_UART_SWAP_FIX)
-    [0]	= { .line = 0, .iobase = STD_COM2_IOBASE, .irq = STD_COM2_IRQ, .baud = STD_COMX_BAUD }, //COM1 aka ttyS1
-    [1]	= { .line = 1, .iobase = STD_COM1_IOBASE, .irq = STD_COM1_IRQ, .baud = STD_COMX_BAUD }, //COM2 aka ttyS0
+    [0]	= { .iobase = STD_COM2_IOBASE, .irq = STD_COM2_IRQ }, //COM1 aka ttyS1
+    [1]	= { .iobase = STD_COM1_IOBASE, .irq = STD_COM1_IRQ }, //COM2 aka ttyS0
 #else
-    [0]	= { .line = 0, .iobase = STD_COM1_IOBASE, .irq = STD_COM1_IRQ, .baud = STD_COMX_BAUD }, //COM1 aka ttyS0
-    [1]	= { .line = 1, .iobase = STD_COM2_IOBASE, .irq = STD_COM2_IRQ, .baud = STD_COMX_BAUD }, //COM2 aka ttyS1
+    [0]	= { .iobase = STD_COM1_IOBASE, .irq = STD_COM1_IRQ }, //COM1 aka ttyS0
+    [1]	= { .iobase = STD_COM2_IOBASE, .irq = STD_COM2_IRQ }, //COM2 aka ttyS1
 #endif
-    [2]	= { .line = 2, .iobase = STD_COM3_IOBASE, .irq = STD_COM3_IRQ, .baud = STD_COMX_BAUD }, //COM3 aka ttyS2
-    [3]	= { .line = 3, .iobase = STD_COM4_IOBASE, .irq = STD_COM4_IRQ, .baud = STD_COMX_BAUD }, //COM4 aka ttyS3
+    [2]	= { .iobase = STD_COM3_IOBASE, .irq = STD_COM3_IRQ }, //COM3 aka ttyS2
+    [3]	= { .iobase = STD_COM4_IOBASE, .irq = STD_COM4_IRQ }, //COM4 aka ttyS3
 };
 
-//Internal type for callbacks; see vuart_set_tx_callback() for details
-struct flush_callback {
-    vuart_callback_t *fn;
-    void *buffer;
-    int threshold;
-};
-//Storage for all TX callbacks, see vuart_set_tx_callback()
-static struct flush_callback *flush_cbs[SERIAL8250_LAST_ISA_LINE] = { NULL };
+//Devices are allocated on first use of a line (i.e. when it's added or subscribed to), see get_alloc_line_vdev(). They're
+// never freed (only their FIFOs are, when removed) as other parts of the kernel may keep using line numbers after the
+// removal (e.g. sleeping in vuart_inject_rx_wait()). Slots & subscriber lists are guarded by vdevs_lock, but slots are
+// also read without it (e.g. by 8250 serial_in/out of other lines) so a device is published with release semantics.
+static struct serial8250_16550A_vdev *ttySs[UART_NR] = { NULL };
+static DEFINE_MUTEX(vdevs_lock);
 static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver is ready
 
 /**************************************** Internal helper function-like macros ****************************************/
-//Get vDEV from line/ttyS number (created for consistency)
-#define get_line_vdev(line) (&ttySs[(line)])
+//Get vDEV from line/ttyS number (created for consistency); it's NULL if the line was never used. Readers without
+// vdevs_lock see a fully initialized device thanks to acquire/release pairing with publish_line_vdev().
+//smp_load_acquire()/smp_store_release() were only added in v3.14
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
+#define get_line_vdev(line) ({ struct serial8250_16550A_vdev *__vdev = ACCESS_ONCE(ttySs[(line)]); smp_rmb(); __vdev; })
+#define publish_line_vdev(line, vdev) do { smp_wmb(); ACCESS_ONCE(ttySs[(line)]) = (vdev); } while(0)
+#else
+#define get_line_vdev(line) smp_load_acquire(&ttySs[(line)])
+#define publish_line_vdev(line, vdev) smp_store_release(&ttySs[(line)], (vdev))
+#endif
 
 //8250 driver doesn't give access to the real uart_port upon adding but does it on first read/write
 #define capture_uart_port(vdev, port) if (unlikely(!(vdev)->up)) (vdev)->up = port;
@@ -136,23 +222,82 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
     if ((line) < 2) { \
         pr_loc_inf( \
                 "Requested ttyS%d vUART - this kernel has UART SWAP => modifying what physically is ttyS%d (io=0x%x)", \
-                line, !line, get_line_vdev(line)->iobase); \
+                line, !line, isa_ports[line].iobase); \
     }
 #else
 #define warn_bug_swapped(line) //noop
 #endif
 
-#define for_each_vdev() for (int line=0; line < ARRAY_SIZE(ttySs); ++line)
+//Iterates over all allocated devices (vdev must be a struct serial8250_16550A_vdev pointer)
+#define for_each_vdev(vdev) for (int line=0; line < UART_NR; ++line) if (((vdev) = get_line_vdev(line)) != NULL)
 
-//Before v3.13 the kfifo_put() accepted a pointer, since then it accepts a value
-//ffs... https://github.com/torvalds/linux/commit/498d319bb512992ef0784c278fa03679f2f5649d
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
-#define kfifo_put_val(fifo, val) kfifo_put(fifo, &val)
-#else
-#define kfifo_put_val(fifo, val) kfifo_put(fifo, val)
-#endif
+//Wakes up anybody waiting in vuart_inject_rx_wait() (if anybody's there); it's cheap when nobody waits
+#define wake_up_rx_space(vdev) if (waitqueue_active(&(vdev)->rx_space_wait)) { wake_up_interruptible(&(vdev)->rx_space_wait); }
+
+//16C950 "enhanced mode" registers (EFR & XON/XOFF) replace the standard ones when LCR has a magic value written to it
+#define is_16950_conf_mode(vdev) ((vdev)->model == VUART_CHIP_16950 && (vdev)->lcr == UART_LCR_CONF_MODE_B)
+
+/**
+ * Finds the device a port passed to serial_remote_read()/serial_remote_write() belongs to
+ *
+ * The 8250 driver matches ports by iobase and not by line (see update_serial8250_isa_port()), so the port line is only a
+ * hint. It's correct for COM1-4 but additional ports land on whatever slot the driver had free. The driver also calls
+ * us while the port is being registered, i.e. before we know which line it got.
+ */
+static inline struct serial8250_16550A_vdev *get_port_vdev(const struct uart_port *port)
+{
+    struct serial8250_16550A_vdev *vdev = likely(port->line < UART_NR) ? get_line_vdev(port->line) : NULL;
+    if (likely(vdev && vdev->iobase == port->iobase))
+        return vdev;
+
+    for_each_vdev(vdev) {
+        if (vdev->iobase == port->iobase)
+            return vdev;
+    }
+
+    return NULL;
+}
 
 /****************************************** Internal chip emulation functions ******************************************/
+/**
+ * Gets definition of the chip which is currently emulated, taking into account the mode set by the driver
+ *
+ * Deeper FIFOs of 16750 and 16C950 are only active when the driver enabled them - otherwise these chips behave like a
+ * 16550A (see chip_defs).
+ */
+static const struct vuart_chip_def *get_active_chip(const struct serial8250_16550A_vdev *vdev)
+{
+    switch (vdev->model) {
+        case VUART_CHIP_16750:
+            if (!(vdev->fcr & UART_FCR7_64BYTE))
+                return &chip_defs[VUART_CHIP_16550A];
+            break;
+        case VUART_CHIP_16950:
+            if (!(vdev->efr & UART_EFR_ECB))
+                return &chip_defs[VUART_CHIP_16550A];
+            break;
+        default:
+            break;
+    }
+
+    return &chip_defs[vdev->model];
+}
+
+/**
+ * Recalculates effective FIFOs depth & RX trigger level; it should be called after FCR or EFR changes
+ *
+ * This function assumes you have vdev lock (or the device isn't initialized yet).
+ */
+static void update_fifo_config(struct serial8250_16550A_vdev *vdev)
+{
+    const struct vuart_chip_def *chip = get_active_chip(vdev);
+
+    vdev->fifo_len = chip->fifo_len;
+    vdev->rx_trigger = chip->rx_triggers[(vdev->fcr & UART_FCR_TRIGGER_MASK) >> 6];
+    uart_prdbg("ttyS%d is now a %s with %u bytes FIFOs (RX trigger at %u)", vdev->line, chip->name, vdev->fifo_len,
+               vdev->rx_trigger);
+}
+
 /**
  * Updates state of the IIR register
  *
@@ -173,6 +318,7 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
 static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
 {
     uart_prdbg("Recomputing IIR state");
+    u8 old_iir = vdev->iir;
     //Order of these if/elseifs is CRUCIAL - interrupts have priorities and they're masked
     u8 new_iir_int_state = 0;
     if ((vdev->ier & UART_IER_RLSI) &&
@@ -181,13 +327,19 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
         //Kernel enabled OE/PE/FE/BI interrupts and there's one of them
         uart_prdbg("IIR: setting RLS (errors) interrupt");
         new_iir_int_state |= UART_IIR_RLSI;
-    } else if ((vdev->ier & UART_IER_RDI) && (vdev->lsr & UART_LSR_DR)) {
-        //We don't distinguish between FIFO and non-FIFO mode and just set interrupt if there's some data to be read
-        //We also don't support the receiver time-out (kernel should pick up the data in time as it's a virtual port)
+    } else if ((vdev->ier & UART_IER_RDI) && (vdev->lsr & UART_LSR_DR) &&
+               (vuart_ring_len(&vdev->rx_fifo) >= vdev->rx_trigger || !(vdev->fcr & UART_FCR_ENABLE_FIFO))) {
+        //In FIFO mode data is reported when RX trigger level is reached, in non-FIFO mode on every character
         uart_prdbg("IIR: setting RD (data-ready) interrupt");
         new_iir_int_state |= UART_IIR_RDI;
-    } else if ((vdev->ier & UART_IER_THRI) && ((vdev->lsr & UART_LSR_TEMT) || kfifo_is_empty(vdev->tx_fifo))) {
-        //When THR is empty or FIFO is empty (for us it's the same thing) kernel wants to know about that
+    } else if ((vdev->ier & UART_IER_RDI) && (vdev->lsr & UART_LSR_DR) && vdev->rx_timeout) {
+        //Data below the trigger level was waiting for too long (see rx_timer_fired())
+        uart_prdbg("IIR: setting RX timeout interrupt");
+        new_iir_int_state |= UART_IIR_RX_TIMEOUT;
+    } else if ((vdev->ier & UART_IER_THRI) && vdev->thri_latched &&
+               ((vdev->lsr & UART_LSR_TEMT) || vuart_ring_is_empty(&vdev->tx_fifo))) {
+        //When THR is empty or FIFO is empty (for us it's the same thing) kernel wants to know about that - but only once
+        // per becoming empty (otherwise every register access would re-trigger the interrupt)
         uart_prdbg("IIR: setting THR (transmitter empty) interrupt");
         new_iir_int_state |= UART_IIR_THRI;
     }
@@ -195,7 +347,11 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
     //If any interrupts are triggered (or not) we need to set IPEND accordingly
     if (new_iir_int_state) {
         new_iir_int_state &= ~UART_IIR_NO_INT; //since there were some interrupts we clear IPEND (=interrupts pending)
-        vuart_virq_wake_up(vdev);
+
+        //Like a real (edge-triggered) IRQ line only the transition to pending raises the vIRQ; an interrupt which stays
+        // pending after the handler returns is re-raised by the dispatcher
+        if (old_iir & UART_IIR_NO_INT)
+            vuart_virq_wake_up(vdev);
     } else {
         new_iir_int_state |= UART_IIR_NO_INT; //since there were no interrupts we set IPEND (=no interrupts pending)
     }
@@ -204,11 +360,64 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
     vdev->iir = new_iir_int_state;
     if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO))
         vdev->iir |= UART_IIR_FIFOEN;
+    if (vdev->model == VUART_CHIP_16750 && (vdev->fcr & UART_FCR7_64BYTE)) //16750 reports the FIFO mode in IIR too
+        vdev->iir |= UART_IIR_64BYTE_FIFO;
+
+    if (vdev->iir != old_iir)
+        vuart_record(vdev->line, VUART_REC_IIR, old_iir, &vdev->iir, 1);
 
     dump_iir(vdev);
     uart_prdbg("Finished IIR state");
 }
 
+/**
+ * Calculates the character timeout based on the currently set divisor and word format
+ */
+static u64 get_rx_timeout_ns(const struct serial8250_16550A_vdev *vdev)
+{
+    unsigned int divisor = (vdev->dlm << 8) | vdev->dll;
+    if (unlikely(divisor == 0))
+        divisor = 1;
+
+    //Start bit + 5-8 data bits + optional parity bit + 1-2 stop bits
+    unsigned int char_bits = 1 + 5 + (vdev->lcr & UART_LCR_WLEN8) + ((vdev->lcr & UART_LCR_PARITY) ? 1 : 0) +
+                             ((vdev->lcr & UART_LCR_STOP) ? 2 : 1);
+
+    return div_u64((u64)VUART_RX_TIMEOUT_CHARS * char_bits * divisor * NSEC_PER_SEC, vdev->baud);
+}
+
+/**
+ * (Re)starts measuring the character timeout; it should be called whenever new data arrives into the RX FIFO
+ *
+ * Restarting a pending hrtimer is cheap and it doesn't wait for the callback, so it's safe to call with the vdev lock.
+ */
+static void update_rx_timer(struct serial8250_16550A_vdev *vdev)
+{
+    vdev->rx_timeout = false;
+    hrtimer_start(&vdev->rx_timer, ns_to_ktime(get_rx_timeout_ns(vdev)), HRTIMER_MODE_REL);
+}
+
+/**
+ * Called when no data moved in/out of RX FIFO for VUART_RX_TIMEOUT_CHARS character times
+ *
+ * If there's still data in the FIFO it's most likely below the trigger level, so the driver wasn't notified about it.
+ * This is exactly what the character timeout interrupt is for on the real chip.
+ */
+static enum hrtimer_restart rx_timer_fired(struct hrtimer *timer)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(timer, struct serial8250_16550A_vdev, rx_timer);
+
+    lock_vuart(vdev);
+    if (vdev->lsr & UART_LSR_DR) {
+        uart_prdbg("RX character timeout @ ttyS%d", vdev->line);
+        vdev->rx_timeout = true;
+        update_interrupts_state(vdev);
+    }
+    unlock_vuart(vdev);
+
+    return HRTIMER_NORESTART;
+}
+
 /**
  * Put registries into the "chip reset" state as described by the datasheet (see Tables 3-* in Ti doc)
  * You should NOT modify these values under any circumstances as they're meant to represent the real chip RESET state
@@ -218,11 +427,10 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     uart_prdbg("Resetting virtual chip @ ttyS%d", vdev->line);
     lock_vuart_oppr(vdev);
 
-    //Upon reset both FIFOs must be erased
-    if (vdev->tx_fifo)
-        kfifo_reset(vdev->tx_fifo);
-    if (vdev->rx_fifo)
-        kfifo_reset(vdev->rx_fifo);
+    //Upon reset both FIFOs must be erased (and whatever was waiting to get into them)
+    vuart_ring_reset(&vdev->tx_fifo);
+    vuart_ring_reset(&vdev->rx_fifo);
+    vuart_ring_reset(&vdev->rx_queue);
 
     //Registries for when DLAB=0
     vdev->rhr = 0x00; //no data in receiving channel
@@ -240,6 +448,16 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     vdev->dll = 0x00; //undefined divisor LSB latch
     vdev->dlm = 0x00; //undefined divisor MSB latch
 
+    //16C950 additional registries (ignored by other models)
+    vdev->efr = 0x00; //enhanced mode disabled (=16550A-compatible with 16 bytes FIFOs)
+    vdev->acr = 0x00; //ICR reads disabled, transmitter & receiver enabled
+
+    //Edge-triggered interrupts which have no registries
+    vdev->rx_timeout = false;
+    vdev->thri_latched = false;
+
+    update_fifo_config(vdev); //FCR & EFR changed
+
     unlock_vuart_oppr(vdev);
     uart_prdbg("Virtual chip @ ttyS%d reset done", vdev->line);
 }
@@ -251,52 +469,103 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
  */
 static int alloc_fifos(struct serial8250_16550A_vdev *vdev)
 {
-    if (unlikely(vdev->rx_fifo)) { //this shouldn't happen on non-initialized port
+    BUILD_BUG_ON_NOT_POWER_OF_2(VUART_FIFO_LEN_MAX); //vuart_ring requirement
+
+    if (unlikely(vdev->rx_fifo.data)) { //this shouldn't happen on non-initialized port
         pr_loc_bug("RX FIFO @ %d already alloc'd", vdev->line);
         return -EINVAL;
     }
 
-    if (unlikely(vdev->tx_fifo)) { //this shouldn't happen on non-initialized port
+    if (unlikely(vdev->tx_fifo.data)) { //this shouldn't happen on non-initialized port
         pr_loc_bug("TX FIFO @ %d already alloc'd", vdev->line);
         return -EINVAL;
     }
 
-    kzalloc_or_exit_int(vdev->rx_fifo, sizeof(struct kfifo));
-    kzalloc_or_exit_int(vdev->tx_fifo, sizeof(struct kfifo));
-
-    if (unlikely(kfifo_alloc(vdev->rx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
-        pr_loc_crt("kfifo_alloc for RX FIFO elements @ %d failed", vdev->line);
-        return -EFAULT;
-    }
-
-    if (unlikely(kfifo_alloc(vdev->tx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
-        pr_loc_crt("kfifo_alloc for TX FIFO elements @ %d failed", vdev->line);
-        return -EFAULT;
-    }
+    //FIFOs are always allocated for the deepest mode of a given chip - the effective depth is controlled by fifo_len
+    unsigned int size = chip_defs[vdev->model].fifo_len;
+    kmalloc_or_exit_int(vdev->rx_fifo.data, size);
+    kmalloc_or_exit_int(vdev->tx_fifo.data, size);
+    vdev->rx_fifo.mask = size - 1;
+    vdev->tx_fifo.mask = size - 1;
+    vuart_ring_reset(&vdev->rx_fifo);
+    vuart_ring_reset(&vdev->tx_fifo);
+
+#if VUART_RX_QUEUE_LEN > 0
+    BUILD_BUG_ON_NOT_POWER_OF_2(VUART_RX_QUEUE_LEN); //vuart_ring requirement
+    kmalloc_or_exit_int(vdev->rx_queue.data, VUART_RX_QUEUE_LEN);
+    vdev->rx_queue.mask = VUART_RX_QUEUE_LEN - 1;
+    vuart_ring_reset(&vdev->rx_queue);
+#endif
 
     return 0;
 }
 
 /**
- * Reverses what alloc_fifos() did
+ * Reverses what alloc_fifos() did; the port is marked as not initialized as FIFOs are gone
  */
 static int free_fifos(struct serial8250_16550A_vdev *vdev)
 {
     //This should be called when the vIRQ thread is killed so nothing call the IRQ handler without FIFOs
-    if (unlikely(!vdev->rx_fifo || !vdev->tx_fifo)) { //this shouldn't happen on initialized port
+    if (unlikely(!vdev->rx_fifo.data || !vdev->tx_fifo.data)) { //this shouldn't happen on initialized port
         pr_loc_bug("RX and/or TX FIFO @ %d are not alloc'd (nothing to free)", vdev->line);
         return -EINVAL;
     }
 
-    kfifo_free(vdev->rx_fifo);
-    kfifo_free(vdev->tx_fifo);
+    //Injectors check the state & use FIFOs only with the producer lock held (see vuart_inject_rx()), so once FIFOs are
+    // detached under it nobody can be using them anymore
+    unsigned long flags;
+    spin_lock_irqsave(&vdev->rx_producer_lock, flags);
+    vdev->initialized = false;
+    u8 *rx_fifo = vdev->rx_fifo.data;
+    u8 *tx_fifo = vdev->tx_fifo.data;
+    u8 *rx_queue = vdev->rx_queue.data;
+    vdev->rx_fifo.data = NULL;
+    vdev->tx_fifo.data = NULL;
+    vdev->rx_queue.data = NULL;
+    spin_unlock_irqrestore(&vdev->rx_producer_lock, flags);
+
+    kfree(rx_fifo);
+    kfree(tx_fifo);
+    kfree(rx_queue); //it's optional (so it may be NULL)
 
     return 0;
 }
 
 /**
- * Deposits the TX queue contents into callbacks set using vuart_set_tx_callback() and clears the FIFO itself
- * If no callbacks were defined it will simply clear.
+ * Hands the TX FIFO contents a subscriber didn't see yet to it and moves its cursor past what it consumed
+ *
+ * Drain subscribers get a view of the FIFO itself (so with multiple subscribers the data is shared, not copied) while
+ * classic ones get a copy in their buffer.
+ */
+static void flush_tx_subscriber(struct serial8250_16550A_vdev *vdev, struct vuart_tx_subscriber *sub,
+                                vuart_flush_reason reason)
+{
+    struct vuart_tx_view view;
+    unsigned int head = vdev->tx_fifo.head; //we're the producer too (we're under the lock)
+    view.len = vuart_ring_peek_from(&vdev->tx_fifo, sub->cursor, (const u8 **)&view.seg[0].buffer, &view.seg[0].len,
+                                    (const u8 **)&view.seg[1].buffer, &view.seg[1].len);
+
+    if (sub->drain_fn) {
+        unsigned int consumed = sub->drain_fn(vdev->line, &view, reason);
+        if (consumed > view.len)
+            consumed = view.len;
+
+        sub->cursor = head - view.len + consumed;
+        uart_prdbg("Drain callback consumed %u of %u bytes @ ttyS%d", consumed, view.len, vdev->line);
+        return;
+    }
+
+    memcpy(sub->buffer, view.seg[0].buffer, view.seg[0].len);
+    memcpy(sub->buffer + view.seg[0].len, view.seg[1].buffer, view.seg[1].len);
+    sub->cursor = head;
+    sub->fn(vdev->line, sub->buffer, view.len, reason);
+}
+
+/**
+ * Delivers data from TX FIFO to subscribers (if any)
+ *
+ * With VUART_FLUSH_THRESHOLD only subscribers which reached their threshold are flushed; with other reasons all of them
+ * are. Afterwards the FIFO is released up to the slowest subscriber. If there are no subscribers it will simply clear.
  *
  * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
  */
@@ -304,16 +573,88 @@ static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reaso
 {
     uart_prdbg("Flushing TX FIFO now! reason=%d", reason);
 
-    if (likely(flush_cbs[vdev->line])) {
-        unsigned int flushed_bytes = 0;
-        flushed_bytes = kfifo_out(vdev->tx_fifo, flush_cbs[vdev->line]->buffer, VUART_FIFO_LEN);
-        flush_cbs[vdev->line]->fn(vdev->line, flush_cbs[vdev->line]->buffer, flushed_bytes, reason);
+    struct vuart_tx_subscriber *sub;
+    unsigned int head = vdev->tx_fifo.head;
+    unsigned int used = head - vdev->tx_fifo.tail;
+    unsigned int lag = 0; //how much the slowest subscriber is behind the head
+    bool any_sub = false;
+
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(sub, &vdev->tx_subscribers, node) {
+        any_sub = true;
+        unsigned int pending = min(head - sub->cursor, used); //see vuart_ring_peek_from() for why it's capped
+        if (pending != 0 && (reason != VUART_FLUSH_THRESHOLD || pending >= sub->threshold)) {
+            flush_tx_subscriber(vdev, sub, reason);
+            pending = head - sub->cursor;
+        }
+
+        if (pending > lag)
+            lag = pending;
+    }
+    rcu_read_unlock();
+
+    if (likely(any_sub)) {
+        vuart_ring_skip(&vdev->tx_fifo, used - lag);
     } else {
         uart_prdbg("No callback for TX FIFO @ %d - discarding", vdev->line);
-        kfifo_reset(vdev->tx_fifo);
+        vuart_ring_discard(&vdev->tx_fifo);
     }
 
-    vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE; //nothing should be in the buffer
+    //Drain callbacks are allowed to leave some data behind - the transmitter is only empty if they didn't
+    if (likely(vuart_ring_is_empty(&vdev->tx_fifo))) {
+        vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+        vdev->thri_latched = true;
+    }
+    else if (vuart_ring_len(&vdev->tx_fifo) < vdev->fifo_len)
+        vdev->lsr |= UART_LSR_THRE;
+}
+
+/**
+ * Copies as much data as fits into the RX FIFO in one go (i.e. the bulk alternative to handle_receive_char())
+ *
+ * This function can be called without the vdev lock as long as the caller is the only RX FIFO producer (which is only
+ * true when there's no RX staging queue, see refill_rx_fifo()). It does NOT
+ * update any registers - the caller should set UART_LSR_DR & recalculate IIRs (see update_interrupts_state()) once
+ * after the whole batch.
+ *
+ * @return number of bytes copied
+ */
+static unsigned int fill_rx_fifo(struct serial8250_16550A_vdev *vdev, const void *buffer, unsigned int len)
+{
+    //The ring is sized for the deepest mode of the chip - we cannot put more than the current mode allows
+    unsigned int rx_len = vuart_ring_len(&vdev->rx_fifo);
+    unsigned int rx_space = (rx_len < vdev->fifo_len) ? vdev->fifo_len - rx_len : 0;
+    if (len > rx_space)
+        len = rx_space;
+
+    return vuart_ring_in(&vdev->rx_fifo, buffer, len);
+}
+
+/**
+ * Moves as much data as possible from the RX staging queue into the RX FIFO (see VUART_RX_QUEUE_LEN)
+ *
+ * The queue emulates the remote end of the line which keeps sending data as the driver reads it. This function MUST be
+ * called with the vdev lock as it's what guarantees a single RX FIFO producer when the queue is in use. It does NOT
+ * update any registers.
+ *
+ * @return number of bytes moved
+ */
+static unsigned int refill_rx_fifo(struct serial8250_16550A_vdev *vdev)
+{
+    if (!vdev->rx_queue.data)
+        return 0;
+
+    const u8 *seg1, *seg2;
+    unsigned int seg1_len, seg2_len;
+    if (vuart_ring_peek(&vdev->rx_queue, &seg1, &seg1_len, &seg2, &seg2_len) == 0)
+        return 0;
+
+    unsigned int moved = fill_rx_fifo(vdev, seg1, seg1_len);
+    if (moved == seg1_len && seg2_len)
+        moved += fill_rx_fifo(vdev, seg2, seg2_len);
+    vuart_ring_skip(&vdev->rx_queue, moved);
+
+    return moved;
 }
 
 /**
@@ -329,11 +670,21 @@ static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reaso
 static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
 {
     //Before this function is called UART_LSR_DR should be verified - it wasn't or it was wrong if this exploded
-    if(unlikely(kfifo_get(vdev->rx_fifo, &vdev->rhr) == 0))
+    if(unlikely(vuart_ring_get(&vdev->rx_fifo, &vdev->rhr) == 0))
         pr_loc_bug("Attempted to %s with empty FIFO - that shouldn't happen if the DR flag was checked", __FUNCTION__);
 
-    if (kfifo_is_empty(vdev->rx_fifo))
-        vdev->lsr &= ~UART_LSR_DR;
+    //Once the driver emptied the FIFO the next chunk from the staging queue "arrives" (if there's any)
+    if (vuart_ring_is_empty(&vdev->rx_fifo)) {
+        if (refill_rx_fifo(vdev) == 0) {
+            vdev->lsr &= ~UART_LSR_DR;
+            vdev->rx_timeout = false;
+        } else {
+            update_rx_timer(vdev);
+        }
+        wake_up_rx_space(vdev); //either the FIFO or the queue got some space
+    } else if (unlikely(vdev->rx_timeout)) { //reading a character clears the timeout, but leftovers need another one
+        update_rx_timer(vdev);
+    }
 
     //See descriptions of these fields in Table 3-12 from TI doc - these flags are cleared on character read
     vdev->lsr &= ~UART_LSR_BI;
@@ -356,7 +707,8 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
     vdev->rhr = value; //RHR is always populated with the value no matter the FIFO or non-FIFO mode
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
-    if (kfifo_put_val(vdev->rx_fifo, value) == 0) {
+    //The ring may be bigger than the FIFO in the current chip mode, so the effective depth must be checked too
+    if (vuart_ring_len(&vdev->rx_fifo) >= vdev->fifo_len || vuart_ring_put(&vdev->rx_fifo, value) == 0) {
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
 
         //During TEST/LOOP mode many overflows are caused on purpose - we don't want to hear about them really
@@ -367,6 +719,7 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
     }
 
     vdev->lsr |= UART_LSR_DR; //receiver has something for the kernel to pickup
+    update_rx_timer(vdev);
 }
 
 /**
@@ -384,24 +737,28 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
     //@todo this only handle non-FIFO properly: doesn't detect OE, and doesn't reset THRE
     vdev->thr = value; //THR is always populated with the value no matter the FIFO or non-FIFO mode
     vdev->lsr &= ~UART_LSR_THRE;
+    vdev->thri_latched = false; //writing THR clears THRI (see Table 3-6 in Ti doc)
 
-    int fifo_len = kfifo_len(vdev->tx_fifo);
+    int fifo_len = vuart_ring_len(&vdev->tx_fifo);
     uart_prdbg("%s got new char ascii=%c hex=%02x on ttyS%d (FIFO#=%d)", __FUNCTION__, value, value, vdev->line,
                fifo_len);
 
     //FIFO is full - try to flush it; if we got here it means the threshold is for sure >VUART_FIFO_LEN as this is
     // checked after we put data into the FIFO (to make sure we trigger THRESHOLD event and not FULL)
     //The reason why we check this at the beginning of new char and not after adding to FIFO is that if the transmitting
-    // party sends exactly VUART_FIFO_LEN bytes and then ends the transmission we don't want to flush with FULL but with
+    // party sends exactly fifo_len bytes and then ends the transmission we don't want to flush with FULL but with
     // IDLE to give a better sense of what's going on to the caller. FULL implies "we got too much data, there may be
     // more coming" while IDLE implies that the unit of transmission ended.
-    if (unlikely(fifo_len == VUART_FIFO_LEN))
+    //It's >= and not == since the effective FIFO depth can shrink (e.g. when the driver disables 16750 64-byte mode)
+    if (unlikely(fifo_len >= vdev->fifo_len)) {
         flush_tx_fifo(vdev, VUART_FLUSH_FULL);
+        fifo_len = vuart_ring_len(&vdev->tx_fifo); //drain callbacks can leave some data behind
+    }
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
     //This, if we are correct, cannot happen if the flush_tx_fifo() is functioning correctly as we try to flush above
-    int fifo_add = kfifo_put_val(vdev->tx_fifo, value);
-    fifo_len += fifo_add; //we can call kfifo_ API for this but why if we have both pieces of info anyway? ;)
+    int fifo_add = (fifo_len < vdev->fifo_len) ? vuart_ring_put(&vdev->tx_fifo, value) : 0;
+    fifo_len += fifo_add; //we can call vuart_ring_len() for this but why if we have both pieces of info anyway? ;)
     if (unlikely(fifo_add == 0)) {
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
         pr_loc_wrn("TX FIFO overflow detected");
@@ -413,13 +770,61 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
 
     //@todo THRE should be reset immediately in non-FIFO mode (i.e. at the same time as TEMT)
     //This is to prevent kernel from freaking out about "blackhole" UART (see https://unix.stackexchange.com/a/387650)
-    if (fifo_len >= VUART_FIFO_LEN / 2)
+    if (fifo_len >= vdev->fifo_len / 2)
         vdev->lsr &= ~UART_LSR_THRE;
 
-    if (likely(flush_cbs[vdev->line]) && fifo_len >= flush_cbs[vdev->line]->threshold)
+    //The threshold is checked per subscriber while flushing; this just avoids going through them for every character
+    if (fifo_len >= vdev->tx_min_threshold && !hlist_empty(&vdev->tx_subscribers))
         flush_tx_fifo(vdev, VUART_FLUSH_THRESHOLD);
 }
 
+/**
+ * Reads 16C950 indexed control register (ICR) selected by the SCR
+ *
+ * The driver does it only while probing the chip (which we skip by registering a fixed port type), so only ACR and the
+ * chip identification registers are supported.
+ */
+static unsigned int read_icr(struct serial8250_16550A_vdev *vdev)
+{
+    switch (vdev->scr) {
+        case UART_ACR:
+            reg_read("ICR/ACR");
+            return vdev->acr;
+        case UART_ID1:
+            return 0x16;
+        case UART_ID2:
+            return 0xC9;
+        case UART_ID3:
+            return 0x50;
+        default:
+            uart_prdbg("Read of unsupported ICR 0x%02x on ttyS%d", vdev->scr, vdev->line);
+            return 0;
+    }
+}
+
+/**
+ * Writes 16C950 indexed control register (ICR) selected by the SCR
+ *
+ * Only the ACR is stored. Other registers (clock prescalers, flow control levels etc.) have no meaning for a virtual
+ * port. The soft reset via CSR, which driver requests on startup, is ignored too: the driver reprograms everything right
+ * after it anyway.
+ */
+static void write_icr(struct serial8250_16550A_vdev *vdev, u8 value)
+{
+    switch (vdev->scr) {
+        case UART_ACR:
+            vdev->acr = value;
+            reg_write("ICR/ACR");
+            break;
+        case UART_CSR:
+            uart_prdbg("Ignoring 16C950 soft reset request on ttyS%d", vdev->line);
+            break;
+        default:
+            uart_prdbg("Ignoring write of %x to ICR 0x%02x on ttyS%d", value, vdev->scr, vdev->line);
+            break;
+    }
+}
+
 /**
  * The main READ routing passed to the 8250 driver. It should be as fast as possible and MUST be multithread-safe
  *
@@ -431,9 +836,13 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
  */
 static unsigned int serial_remote_read(struct uart_port *port, int offset)
 {
-    uart_prdbg("Serial READ for line=%d/%d", port->line, ttySs[port->line].line);
+    struct serial8250_16550A_vdev *vdev = get_port_vdev(port);
+    if (unlikely(!vdev)) {
+        pr_loc_bug("Serial READ for unknown port line=%d io=0x%lx", port->line, (unsigned long)port->iobase);
+        return 0;
+    }
 
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
+    uart_prdbg("Serial READ for line=%d/%d", port->line, vdev->line);
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
     unsigned int out;
@@ -471,9 +880,17 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
                 reg_read_dump(vdev, ier, "IER");
             }
             break;
-        case UART_IIR:
+        case UART_IIR: //same as UART_EFR
+            if (unlikely(is_16950_conf_mode(vdev))) {
+                out = vdev->efr;
+                reg_read("EFR");
+                break;
+            }
+
             out = vdev->iir;
             reg_read_dump(vdev, iir, "IIR/ISR");
+            if ((vdev->iir & UART_IIR_ID) == UART_IIR_THRI) //reading IIR reporting THRI clears it (Table 3-6 in Ti doc)
+                vdev->thri_latched = false;
             break;
 	    //case UART_FCR not present - write only register
         case UART_LCR:
@@ -484,7 +901,13 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
             out = vdev->mcr;
             reg_read_dump(vdev, mcr, "MCR");
             break;
-        case UART_LSR:
+        case UART_LSR: //same as UART_ICR
+            //16C950 lets the driver read indexed control registers (ICR) instead of LSR (see read_icr())
+            if (unlikely(vdev->model == VUART_CHIP_16950 && (vdev->acr & UART_ACR_ICRRD))) {
+                out = read_icr(vdev);
+                break;
+            }
+
             out = vdev->lsr;
             reg_read_dump(vdev, lsr, "LSR");
             vdev->lsr &= ~UART_LSR_OE; //See "OE" Table 3-12 or Table 3-6 - it needs to be cleared on LSR read
@@ -530,9 +953,13 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
  */
 static void serial_remote_write(struct uart_port *port, int offset, int value)
 {
-    //uart_prdbg("Serial WRITE for line=%d/%d", port->line, ttySs[port->line].line);
+    struct serial8250_16550A_vdev *vdev = get_port_vdev(port);
+    if (unlikely(!vdev)) {
+        pr_loc_bug("Serial WRITE for unknown port line=%d io=0x%lx", port->line, (unsigned long)port->iobase);
+        return;
+    }
 
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
+    //uart_prdbg("Serial WRITE for line=%d/%d", port->line, vdev->line);
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
 
@@ -567,33 +994,59 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
              * kernel wrote everything what was there to write and [presumably] nothing else is coming anytime soon
              * So in short: if THReINT was enabled and it JUST got disabled flush the FIFO if it isn't empty
              */
-            if ((vdev->ier & UART_IER_THRI) && !(value & UART_IER_THRI) && !kfifo_is_empty(vdev->tx_fifo)) {
+            if ((vdev->ier & UART_IER_THRI) && !(value & UART_IER_THRI) && !vuart_ring_is_empty(&vdev->tx_fifo)) {
                 uart_prdbg("Kernel driver disabled THRe interrupt and fifo isn't empty - triggering IDLE flush");
                 flush_tx_fifo(vdev, VUART_FLUSH_IDLE);
             }
+
+            //Enabling THRI while the transmitter is empty raises the interrupt right away (kernel relies on that)
+            if (!(vdev->ier & UART_IER_THRI) && (value & UART_IER_THRI) && (vdev->lsr & UART_LSR_THRE))
+                vdev->thri_latched = true;
+
             vdev->ier = value & 0x0f; //we're not letting kernel set DMA registers since we don't support DMA
             reg_write_dump(vdev, ier, "IER");
             break;
         //case UART_IIR not present - read only register
-        case UART_FCR:
+        case UART_FCR: //same as UART_EFR
+            if (unlikely(is_16950_conf_mode(vdev))) {
+                vdev->efr = value;
+                reg_write("EFR");
+                update_fifo_config(vdev);
+                break;
+            }
+
             //FIFO registers are guarded by the FIFOEN - if it's not set only FIFOEN can be modified, see p27 of Ti doc
             if (!(vdev->fcr & UART_FCR_ENABLE_FIFO) && !(value & UART_FCR_ENABLE_FIFO))
                 value &= UART_FCR_ENABLE_FIFO;
 
+            //16750 64-byte FIFO mode bit can only be changed when DLAB=1; otherwise it retains its previous value
+            if (vdev->model == VUART_CHIP_16750 && !(vdev->lcr & UART_LCR_DLAB))
+                value = (value & ~UART_FCR7_64BYTE) | (vdev->fcr & UART_FCR7_64BYTE);
+
             vdev->fcr = value;
             reg_write_dump(vdev, fcr, "FCR");
+            update_fifo_config(vdev);
 
             //If the new FCR value called for flush of TX and/or RX do that right away
             if (vdev->fcr & UART_FCR_CLEAR_XMIT) {
-                kfifo_reset(vdev->tx_fifo);
+                vuart_ring_discard(&vdev->tx_fifo); //we're the consumer as well (see flush_tx_fifo())
                 vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+                vdev->thri_latched = true;
                 uart_prdbg("TX FIFO flushed on FCR request");
                 dump_lsr(vdev);
             }
 
             if (vdev->fcr & UART_FCR_CLEAR_RCVR) {
-                kfifo_reset(vdev->rx_fifo);
+                vuart_ring_discard(&vdev->rx_fifo); //driver reading RHR is the consumer of RX
                 vdev->lsr &= ~UART_LSR_DR;
+                vdev->rx_timeout = false;
+
+                //Only the chip FIFO is cleared - data still "on the line" (staging queue) arrives right away
+                if (refill_rx_fifo(vdev) != 0) {
+                    vdev->lsr |= UART_LSR_DR;
+                    update_rx_timer(vdev);
+                }
+                wake_up_rx_space(vdev);
                 uart_prdbg("RX FIFO flushed on FCR request");
                 dump_lsr(vdev);
             }
@@ -606,7 +1059,12 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
             vdev->mcr = value;
             reg_write_dump(vdev, mcr, "MCR");
             break;
-        case UART_LSR:
+        case UART_LSR: //same as UART_ICR
+            if (vdev->model == VUART_CHIP_16950) { //16C950 uses LSR offset to write indexed control registers
+                write_icr(vdev, value);
+                break;
+            }
+
             vdev->lsr = value;
             pr_loc_bug("Bogus LSR write attempt on ttyS%d - why?", vdev->line);
             dump_lsr(vdev);
@@ -652,10 +1110,14 @@ static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
     if ((out = alloc_fifos(vdev) != 0))
         return out;
 
-    kmalloc_or_exit_int(vdev->lock, sizeof(spinlock_t));
-    spin_lock_init(vdev->lock);
+    spin_lock_init(&vdev->lock);
+    init_waitqueue_head(&vdev->rx_space_wait);
+    spin_lock_init(&vdev->rx_producer_lock);
 
-    //virq_* stuff is allocated/freed by enable_/disable_interrupts()
+    hrtimer_init(&vdev->rx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vdev->rx_timer.function = rx_timer_fired;
+
+    //virq_* stuff is managed by vuart_virq_prepare()/vuart_virq_release()
 
     vdev->initialized = true;
     pr_loc_dbg("Initialized ttyS%d vUART", vdev->line);
@@ -676,11 +1138,12 @@ static int deinitialize_ttyS(struct serial8250_16550A_vdev *vdev)
         return -ENODEV;
     }
 
+    hrtimer_cancel(&vdev->rx_timer); //it must be done before FIFOs are gone as it may be running (and it uses them)
     if ((out = free_fifos(vdev) != 0))
         return out;
 
-    kfree(vdev->lock);
-    vdev->initialized = false;
+    //Nobody should be waiting anymore, but if they are let them go - they will see the port isn't initialized now
+    wake_up_interruptible_all(&vdev->rx_space_wait);
     pr_loc_dbg("Deinitialized ttyS%d vUART", vdev->line);
 
     return 0;
@@ -698,13 +1161,14 @@ static driver_watch_notify_result serial8250_ready_watcher(struct device_driver
     kernel_driver_ready = true;
 
     int out;
-    for_each_vdev() {
-        //non-initialized ports are these which were never added as vUARTs
-        if (!ttySs[line].initialized || ttySs[line].registered)
+    struct serial8250_16550A_vdev *vdev;
+    for_each_vdev(vdev) {
+        //non-initialized ports are these which were never added as vUARTs (but e.g. have subscribers)
+        if (!vdev->initialized || vdev->registered)
             continue;
 
         pr_loc_dbg("Processing enqueued port %d", line);
-        if ((out = update_serial8250_isa_port(&ttySs[line])) != 0) {
+        if ((out = update_serial8250_isa_port(vdev)) != 0) {
             //This is critical as ports were promised to be registered to other parts of the application but we cannot
             // fulfill that promise now
             pr_loc_crt("Failed to process port %d - error=%d", line, out);
@@ -771,8 +1235,9 @@ static int try_leave_serial8250_driver(void)
     if (!driver_watcher) //we're only concerned about watching the driver
         return 0;
 
-    for_each_vdev() {
-        if (ttySs[line].initialized && !ttySs[line].registered) {
+    struct serial8250_16550A_vdev *vdev;
+    for_each_vdev(vdev) {
+        if (vdev->initialized && !vdev->registered) {
             pr_loc_dbg("Cannot leave %s driver yet - port %d is still awaiting registration", UART_DRIVER_NAME, line);
             return 0;
         }
@@ -790,8 +1255,9 @@ static int try_leave_serial8250_driver(void)
  * Asks the Linux 8250 driver to UPDATE properties of a given serial device which matches line & iobase
  *
  * The reason why this function is called update_ rather than add_ is that we're NOT adding anything new to the driver.
- * Rather we're registering a port which is already there (as vUART only deals with COM1-4, i.e. legacy IBM/PC ports)
- * and matches our spec.
+ * Rather we're registering a port which is already there (COM1-4, i.e. legacy IBM/PC ports) and matches our spec.
+ * Lines above COM4 are an exception: they have a synthetic iobase (see VUART_EXTRA_IOBASE) so the driver puts them in
+ * the first unused slot. Such slots exist only if the driver was told to have more than 4 ports (8250.nr_uarts=).
  */
 static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
 {
@@ -836,9 +1302,14 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     port->regshift = 0;
     port->serial_in = serial_remote_read;
     port->serial_out = serial_remote_write;
-    port->type = PORT_16550A;
+    port->type = chip_defs[vdev->model].port_type;
     up->cur_iotype = 0xFF;
 
+    //16550A is the only model the driver can reliably detect (it's what the probing was designed around). Others would
+    // require emulating chip-specific probing quirks so we simply tell the driver what it's dealing with.
+    if (vdev->model != VUART_CHIP_16550A)
+        port->flags |= UPF_FIXED_TYPE;
+
     //DO NOT EVEN THINK about assigning "port" top vdev->port!!! serial8250_register_8250_port() uses our passed port to
     // match internally reserved (during boot) port structure. Our structure misses a lot of stuff like handlers and so
     //YOU CANNOT ASSIGN IT HERE!
@@ -847,9 +1318,14 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     uart_prdbg("Calling serial8250_register_8250_port to register port");
     if ((out = serial8250_register_8250_port(up)) < 0) { //it returns port # on success or -E on error
         pr_loc_err("Failed to register ttyS%d - driver failure (error=%d)", vdev->line, out);
+        if (vdev->line > SERIAL8250_LAST_ISA_LINE)
+            pr_loc_err("Ports above ttyS%d require 8250.nr_uarts=%d or more", SERIAL8250_LAST_ISA_LINE, vdev->line + 1);
         goto out_free;
     }
     pr_loc_dbg("ttyS%d registered with driver (line=%d)", vdev->line, out);
+    if (unlikely(out != vdev->line))
+        pr_loc_wrn("vUART line %d was registered by the driver as ttyS%d", vdev->line, out);
+    vdev->port_line = out;
     out = 0; //serial8250_register_8250_port return serial port line # or -E code
     vdev->registered = true;
 
@@ -877,6 +1353,15 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
         return 0; //not an error as technically the port is NOT in the driver
     }
 
+    //There's no original port to restore for lines above COM4 - the slot is simply given back to the driver
+    if (vdev->line > SERIAL8250_LAST_ISA_LINE) {
+        pr_loc_dbg("Calling serial8250_unregister_port to remove port");
+        serial8250_unregister_port(vdev->port_line);
+        pr_loc_dbg("ttyS%d finished unregistraton from driver (line=%d)", vdev->line, vdev->port_line);
+        vdev->registered = false;
+        return try_leave_serial8250_driver();
+    }
+
     struct uart_8250_port *up;
     kzalloc_or_exit_int(up, sizeof(struct uart_8250_port));
     struct uart_port *port = &up->port;
@@ -908,122 +1393,428 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     return out;
 }
 
-int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+/**
+ * Gets the device of a line allocating it if this is its first use; it must be called with vdevs_lock held
+ *
+ * The device is just a blank (non-initialized) structure describing the port - see initialize_ttyS().
+ *
+ * @return vdev or ERR_PTR() on error
+ */
+static struct serial8250_16550A_vdev *get_alloc_line_vdev(int line)
 {
-    validate_isa_line(line);
-
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if (!cb) {
-        pr_loc_dbg("Removing TX callback for ttyS%d (line=%d)", line, vdev->line);
-        if (unlikely(!flush_cbs[line])) {
+    if (vdev)
+        return vdev;
+
+    kzalloc_or_exit_ptr(vdev, sizeof(struct serial8250_16550A_vdev));
+    vdev->line = line;
+    vdev->port_line = line;
+    vdev->baud = STD_COMX_BAUD;
+    if (line <= SERIAL8250_LAST_ISA_LINE) {
+        vdev->iobase = isa_ports[line].iobase;
+        vdev->irq = isa_ports[line].irq;
+    } else {
+        vdev->iobase = VUART_EXTRA_IOBASE(line);
+        vdev->irq = VUART_EXTRA_IRQ(line);
+    }
+    INIT_HLIST_HEAD(&vdev->tx_subscribers);
+    vdev->tx_min_threshold = VUART_THRESHOLD_MAX;
+
+    publish_line_vdev(line, vdev);
+    pr_loc_dbg("Allocated vUART ttyS%d (io=0x%x)", line, vdev->iobase);
+
+    return vdev;
+}
+
+/**
+ * Recalculates tx_min_threshold of a device; it must be called with vdevs_lock held (and the vdev lock if the
+ * device is initialized)
+ */
+static void update_tx_min_threshold(struct serial8250_16550A_vdev *vdev)
+{
+    struct vuart_tx_subscriber *sub;
+    int threshold = VUART_THRESHOLD_MAX;
+
+    hlist_for_each_entry(sub, &vdev->tx_subscribers, node) {
+        if (sub->threshold < threshold)
+            threshold = sub->threshold;
+    }
+
+    vdev->tx_min_threshold = threshold;
+}
+
+/**
+ * Attaches a subscriber to a line; it must be called with vdevs_lock held
+ */
+static void add_tx_subscriber(struct serial8250_16550A_vdev *vdev, struct vuart_tx_subscriber *sub)
+{
+    //The lock (if there's one) is needed as the cursor must be set atomically with the FIFO state (subscribers only get
+    // data sent from now on)
+    lock_vuart_oppr(vdev);
+    sub->cursor = vdev->tx_fifo.head;
+    hlist_add_head_rcu(&sub->node, &vdev->tx_subscribers);
+    update_tx_min_threshold(vdev);
+    unlock_vuart_oppr(vdev);
+}
+
+/**
+ * Detaches a subscriber from a line; it must be called with vdevs_lock held
+ *
+ * The subscriber may still be in use by a flush running right now - wait for RCU grace period before freeing it.
+ */
+static void del_tx_subscriber(struct serial8250_16550A_vdev *vdev, struct vuart_tx_subscriber *sub)
+{
+    lock_vuart_oppr(vdev);
+    hlist_del_init_rcu(&sub->node);
+    update_tx_min_threshold(vdev);
+    unlock_vuart_oppr(vdev);
+}
+
+/**
+ * Common implementation for vuart_set_tx_callback() and vuart_set_tx_drain_callback()
+ *
+ * Only one of fn/drain_fn should be set; if both are NULL the callback is removed. The callback is kept as a default
+ * subscriber of the line (see tx_default_sub) so it can coexist with other subscribers.
+ */
+static int set_flush_callback(int line, vuart_callback_t *fn, vuart_drain_callback_t *drain_fn, char *buffer,
+                              int threshold)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev;
+    struct vuart_tx_subscriber *sub;
+
+    mutex_lock(&vdevs_lock);
+    if (!fn && !drain_fn) {
+        pr_loc_dbg("Removing TX callback for ttyS%d", line);
+        vdev = get_line_vdev(line);
+        if (unlikely(!vdev || hlist_unhashed(&vdev->tx_default_sub.node))) {
             pr_loc_dbg("Nothing to do - no TX callback set");
+            mutex_unlock(&vdevs_lock);
             return 0;
         }
 
-        //We don't really need to lock for that
-        kfree(flush_cbs[line]);
-        flush_cbs[line] = NULL;
+        del_tx_subscriber(vdev, &vdev->tx_default_sub);
+        mutex_unlock(&vdevs_lock);
+        synchronize_rcu(); //the caller may free the buffer as soon as we return
 
-        pr_loc_dbg("Removed TX callback for ttyS%d (line=%d)", line, vdev->line);
+        pr_loc_dbg("Removed TX callback for ttyS%d", line);
         return 0;
     }
 
-    pr_loc_dbg("Setting TX callback for for ttyS%d (line=%d)", line, vdev->line);
-    line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
-    if (likely(!flush_cbs[line])) { //if there was already a cb there we don't need to reserve memory
-        kmalloc_or_exit_int(flush_cbs[line], sizeof(struct flush_callback));
+    pr_loc_dbg("Setting TX callback for for ttyS%d", line);
+    vdev = get_alloc_line_vdev(line); //callbacks can be set before the device is added
+    if (unlikely(IS_ERR(vdev))) {
+        mutex_unlock(&vdevs_lock);
+        return PTR_ERR(vdev);
     }
 
     //This can technically be called during serial port operation so we need to get a lock before we change these or
     // we risk sending a buffer to a wrong function. That lock may not exist when device is not added yet.
+    sub = &vdev->tx_default_sub;
     lock_vuart_oppr(vdev);
-    flush_cbs[line]->fn = cb;
-    flush_cbs[line]->buffer = buffer;
-    flush_cbs[line]->threshold = threshold;
+    sub->fn = fn;
+    sub->drain_fn = drain_fn;
+    sub->buffer = buffer;
+    sub->threshold = threshold;
+    if (!hlist_unhashed(&sub->node)) //replacing an existing callback
+        update_tx_min_threshold(vdev);
     unlock_vuart_oppr(vdev);
 
-    pr_loc_dbg("Added TX callback for ttyS%d (line=%d)", line, vdev->line);
+    if (hlist_unhashed(&sub->node))
+        add_tx_subscriber(vdev, sub);
+    mutex_unlock(&vdevs_lock);
+
+    pr_loc_dbg("Added TX callback for ttyS%d", line);
 
     return 0;
 }
 
-int vuart_inject_rx(int line, const char *buffer, int length)
+int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold)
+{
+    return set_flush_callback(line, cb, NULL, buffer, threshold);
+}
+
+int vuart_set_tx_drain_callback(int line, vuart_drain_callback_t *cb, int threshold)
 {
-    validate_isa_line(line);
-    
-    if (unlikely(length > VUART_FIFO_LEN)) {
-        pr_loc_bug("Attempted to inject buffer of %d bytes - it's larger than FIFO size (%d bytes)", length, VUART_FIFO_LEN);
-        return -E2BIG;
+    return set_flush_callback(line, NULL, cb, NULL, threshold);
+}
+
+int vuart_subscribe_tx(int line, struct vuart_tx_subscriber *sub)
+{
+    validate_line(line);
+
+    if (unlikely(!sub->fn == !sub->drain_fn)) {
+        pr_loc_bug("TX subscriber for ttyS%d must have exactly one of fn or drain_fn set", line);
+        return -EINVAL;
     }
-    
+
+    if (unlikely(sub->fn && !sub->buffer)) {
+        pr_loc_bug("TX subscriber for ttyS%d has no buffer", line);
+        return -EINVAL;
+    }
+
+    mutex_lock(&vdevs_lock);
+    if (unlikely(!hlist_unhashed(&sub->node))) {
+        pr_loc_bug("TX subscriber %p is already subscribed", sub);
+        mutex_unlock(&vdevs_lock);
+        return -EBUSY;
+    }
+
+    struct serial8250_16550A_vdev *vdev = get_alloc_line_vdev(line); //subscribers can be attached before the device
+    if (unlikely(IS_ERR(vdev))) {
+        mutex_unlock(&vdevs_lock);
+        return PTR_ERR(vdev);
+    }
+
+    add_tx_subscriber(vdev, sub);
+    mutex_unlock(&vdevs_lock);
+    pr_loc_dbg("Added TX subscriber %p for ttyS%d", sub, line);
+
+    return 0;
+}
+
+int vuart_unsubscribe_tx(int line, struct vuart_tx_subscriber *sub)
+{
+    validate_line(line);
+
+    mutex_lock(&vdevs_lock);
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if (unlikely(!vdev->initialized)) {
+    if (unlikely(!vdev || hlist_unhashed(&sub->node))) {
+        pr_loc_dbg("TX subscriber %p is not subscribed to ttyS%d - nothing to do", sub, line);
+        mutex_unlock(&vdevs_lock);
+        return 0;
+    }
+
+    del_tx_subscriber(vdev, sub);
+    mutex_unlock(&vdevs_lock);
+    synchronize_rcu(); //a flush may be still using the subscriber
+
+    pr_loc_dbg("Removed TX subscriber %p from ttyS%d", sub, line);
+    return 0;
+}
+
+/**
+ * Detaches all subscribers from a line (see vuart_remove_device() for why)
+ */
+static void unsubscribe_all_tx(struct serial8250_16550A_vdev *vdev)
+{
+    struct vuart_tx_subscriber *sub;
+    struct hlist_node *tmp;
+
+    mutex_lock(&vdevs_lock);
+    hlist_for_each_entry_safe(sub, tmp, &vdev->tx_subscribers, node) {
+        del_tx_subscriber(vdev, sub);
+    }
+    mutex_unlock(&vdevs_lock);
+    synchronize_rcu();
+}
+
+int vuart_set_irq_mode(vuart_irq_mode mode)
+{
+    return vuart_virq_set_mode(mode);
+}
+
+int vuart_inject_rx(int line, const char *buffer, int length)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(!vdev || !vdev->initialized)) {
         pr_loc_bug("Cannot inject data into non-initialized or non-registered device");
         return -ENXIO;
     }
 
+    if (unlikely(length < 0)) {
+        pr_loc_bug("Attempted to inject buffer of negative length %d", length);
+        return -EINVAL;
+    }
+
     if (unlikely(!vdev->registered)) {
         pr_loc_wrn("Cannot inject data into unregistered device"); //...as it will be removed by the driver on reg
         return 0;
     }
 
-    //No space to put data - not an error per-sen as this can be re-run again
-    if ((vdev->lsr & UART_LSR_DR) && unlikely(kfifo_is_full(vdev->rx_fifo) || unlikely(vdev->mcr & UART_MCR_LOOP)))
+    //In TEST/LOOP mode the driver itself is the producer for RX FIFO (see handle_receive_char()) so we cannot be one
+    if (unlikely(vdev->mcr & UART_MCR_LOOP))
         return 0;
-    
-    
-    int put_bytes = kfifo_in(vdev->rx_fifo, buffer, VUART_FIFO_LEN);
-    if (likely(put_bytes > 0))
-        vdev->lsr |= UART_LSR_DR;
 
-    uart_prdbg("Injected %d bytes into ttyS%d RX", put_bytes, line);
+    //Copying data doesn't need the vdev lock as long as we're the only producer of the RX FIFO (or the staging queue if
+    // it's used; then the FIFO is filled from it under the vdev lock below). There can be multiple callers injecting
+    // data into the same line, so they're serialized with the producer lock. Only registers update below needs the
+    // vdev lock. The producer lock is held until the end as it also keeps FIFOs from being freed (see free_fifos()).
+    int put_bytes;
+    unsigned long flags;
+    spin_lock_irqsave(&vdev->rx_producer_lock, flags);
+    if (unlikely(!vdev->initialized)) { //the device was removed after the check above
+        spin_unlock_irqrestore(&vdev->rx_producer_lock, flags);
+        pr_loc_dbg("Cannot inject data into ttyS%d - it was just removed", line);
+        return -ENXIO;
+    }
+
+    if (likely(vdev->rx_queue.data))
+        put_bytes = vuart_ring_in(&vdev->rx_queue, buffer, length);
+    else
+        put_bytes = fill_rx_fifo(vdev, buffer, length);
+
+    if (unlikely(put_bytes == 0)) {
+        spin_unlock_irqrestore(&vdev->rx_producer_lock, flags);
+        return 0; //No space to put data - not an error per-se as this can be re-run again
+    }
+
+    vuart_record(vdev->line, VUART_REC_RX, 0, buffer, put_bytes); //under the lock to keep the order of batches
+
+    //Regardless of how many bytes were copied the registers are updated & the vIRQ is raised once per batch
+    lock_vuart(vdev);
+    refill_rx_fifo(vdev);
+    if (likely(!vuart_ring_is_empty(&vdev->rx_fifo))) {
+        vdev->lsr |= UART_LSR_DR;
+        update_rx_timer(vdev); //the data may be below trigger level
+    }
+    uart_prdbg("Injected %d of %d bytes into ttyS%d RX", put_bytes, length, line);
     update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+    spin_unlock_irqrestore(&vdev->rx_producer_lock, flags);
 
     return put_bytes;
 }
 
-int vuart_add_device(int line)
+bool vuart_can_inject_rx(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(!vdev->initialized || !vdev->registered))
+        return true; //vuart_inject_rx() will not accept anything ever, but it will tell that to the caller
+
+    if (vdev->rx_queue.data)
+        return vuart_ring_avail(&vdev->rx_queue) > 0;
+
+    return vuart_ring_len(&vdev->rx_fifo) < vdev->fifo_len;
+}
+
+int vuart_inject_rx_wait(int line, const char *buffer, int length, unsigned int timeout_ms)
+{
+    validate_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(!vdev))
+        return vuart_inject_rx(line, buffer, length); //it will report the error
+
+    long timeout = msecs_to_jiffies(timeout_ms);
+    int done = 0;
+    int out;
+
+    while (true) {
+        if ((out = vuart_inject_rx(line, buffer + done, length - done)) < 0)
+            return done ? done : out;
+
+        done += out;
+        if (done >= length || unlikely(!vdev->registered))
+            break;
+
+        timeout = wait_event_interruptible_timeout(vdev->rx_space_wait, vuart_can_inject_rx(vdev), timeout);
+        if (timeout < 0) //signal
+            return done ? done : timeout;
+        if (timeout == 0) {
+            uart_prdbg("Timed out injecting into ttyS%d RX - %d of %d bytes injected", line, done, length);
+            break;
+        }
+    }
+
+    return done;
+}
+
+int vuart_add_device_model(int line, vuart_chip_model model)
 {
     pr_loc_dbg("Adding vUART ttyS%d", line);
 
-    validate_isa_line(line);
+    validate_line(line);
     warn_bug_swapped(line);
 
+    if (unlikely(model < 0 || model >= ARRAY_SIZE(chip_defs))) {
+        pr_loc_bug("Invalid chip model %d requested for ttyS%d", model, line);
+        return -EINVAL;
+    }
+
     int out;
-    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    mutex_lock(&vdevs_lock);
+    struct serial8250_16550A_vdev *vdev = get_alloc_line_vdev(line);
+    if (unlikely(IS_ERR(vdev))) {
+        mutex_unlock(&vdevs_lock);
+        return PTR_ERR(vdev);
+    }
 
-    if ((out = initialize_ttyS(vdev)) != 0)
+    if (unlikely(vdev->initialized)) { //initialize_ttyS() will complain but model cannot change under a live device
+        pr_loc_bug("ttyS%d is already initialized", vdev->line);
+        mutex_unlock(&vdevs_lock);
+        return -EBUSY;
+    }
+
+    vdev->model = model;
+    out = initialize_ttyS(vdev); //under the lock so that subscribers see either an initialized device or not
+    mutex_unlock(&vdevs_lock);
+    if (out != 0)
         return out;
 
-    if ((out = update_serial8250_isa_port(vdev)) != 0)
+    //Everything which may need to allocate for vIRQ is done upfront, so that enabling interrupts is allocation-free
+    if ((out = vuart_virq_prepare(vdev)) != 0)
         goto error_deinit;
 
+    if ((out = update_serial8250_isa_port(vdev)) != 0)
+        goto error_release;
+
     if ((out = vuart_enable_interrupts(vdev)) != 0)
         goto error_restore;
 
-    pr_loc_inf("Added vUART at ttyS%d", line);
+    //The device node is just a convenience frontend - the vUART is perfectly usable without it
+    if ((out = vuart_chardev_add(vdev)) != 0)
+        pr_loc_wrn("Failed to add character device for ttyS%d - error=%d", line, out);
+
+    if ((out = vuart_recorder_add(vdev)) != 0) //same as above - it's an optional debugging facility
+        pr_loc_wrn("Failed to add traffic recorder for ttyS%d - error=%d", line, out);
+
+    pr_loc_inf("Added vUART (%s) at ttyS%d", chip_defs[model].name, line);
     return 0;
 
     error_restore:
     restore_serial8250_isa_port(vdev);
 
+    error_release:
+    vuart_virq_release(vdev);
+
     error_deinit:
     deinitialize_ttyS(vdev);
 
     return out;
 }
 
+int vuart_add_device(int line)
+{
+    return vuart_add_device_model(line, VUART_DEFAULT_CHIP);
+}
+
 int vuart_remove_device(int line)
 {
     pr_loc_dbg("Removing vUART ttyS%d", line);
 
-    validate_isa_line(line);
+    validate_line(line);
     warn_bug_swapped(line);
 
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if ((out = vuart_disable_interrupts(vdev)) != 0 || (out = deinitialize_ttyS(vdev)) != 0 ||
-        (out = restore_serial8250_isa_port(vdev)) != 0 || (out = vuart_set_tx_callback(line, NULL, NULL, 0)) != 0)
+    if (unlikely(!vdev)) {
+        pr_loc_bug("ttyS%d was never added", line);
+        return -ENODEV;
+    }
+
+    //Recorder & subscribers are detached first, so that they don't stay attached to the line even if restoring the
+    // original port fails below. The chardev is a subscriber too but it has to unsubscribe itself (it may stay open).
+    vuart_recorder_remove(vdev);
+    out = vuart_chardev_remove(vdev);
+    unsubscribe_all_tx(vdev);
+
+    if (out != 0 || (out = vuart_disable_interrupts(vdev)) != 0 ||
+        (out = vuart_virq_release(vdev)) != 0 ||
+        (out = deinitialize_ttyS(vdev)) != 0 ||
+        (out = restore_serial8250_isa_port(vdev)) != 0)
         return out;
 
     pr_loc_inf("Removed vUART & restored original UART at ttyS%d", line);
@@ -2,13 +2,45 @@
 #define REDPILL_VIRTUAL_UART_H
 
 #include <linux/types.h> //bool
+#include <linux/list.h> //struct hlist_node
 
 /**
- * Length of the RX/TX FIFO in bytes
- * Do NOT change this value just because you want to inject more data at once - it's a hardware-defined property
+ * Length of the RX/TX FIFO in bytes of the default chip (16550A)
+ * Do NOT change this value just because you want to inject more data at once - it's a hardware-defined property. If you
+ * need bigger FIFOs use a different chip model (see vuart_chip_model).
  */
 #define VUART_FIFO_LEN 16
 
+/**
+ * Length of the largest RX/TX FIFO of all supported chip models (see vuart_chip_model)
+ */
+#define VUART_FIFO_LEN_MAX 128
+
+/**
+ * Chip models which can be emulated
+ *
+ * They're all 16550A-compatible but differ in FIFOs depth (and RX trigger levels). Larger FIFOs let the 8250 driver move
+ * data in bigger bursts and thus get interrupted less often.
+ */
+typedef enum {
+    VUART_CHIP_16550A, //the classic: 16 bytes FIFOs
+    VUART_CHIP_16750,  //TI 16750: 64 bytes FIFOs (when enabled with FCR bit 5; driver does that), 16 bytes otherwise
+    VUART_CHIP_16950,  //Oxford 16C950: 128 bytes FIFOs
+} vuart_chip_model;
+
+//Chip model used by vuart_add_device()
+#ifndef VUART_DEFAULT_CHIP
+#define VUART_DEFAULT_CHIP VUART_CHIP_16550A
+#endif
+
+/**
+ * Ways of delivering (emulated) interrupts to the 8250 driver, see vuart_set_irq_mode()
+ */
+typedef enum {
+    VUART_IRQ_THREAD, //a kernel thread woken up whenever a port has an interrupt pending (lowest latency)
+    VUART_IRQ_POLL, //a high resolution timer polling ports with an interval adapting to the traffic (no thread needed)
+} vuart_irq_mode;
+
 /**
  * Defines maximum threshold possible; in practice this means you will never get any THRESHOLD events but only ID:E and
  * FULL ones.
@@ -44,6 +76,37 @@ typedef enum {
  */
 typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len, vuart_flush_reason reason);
 
+/**
+ * Read-only view of the data waiting in the TX FIFO, passed to vuart_drain_callback_t
+ *
+ * The FIFO is a ring buffer so its contents can wrap around the end of the memory. In such case the data is split into
+ * two segments which should be read in order: seg[0] and then seg[1]. If the data didn't wrap seg[1].len is 0.
+ * Pointers are valid only for the duration of the callback call.
+ */
+struct vuart_tx_view {
+    struct {
+        const char *buffer;
+        unsigned int len;
+    } seg[2];
+    unsigned int len; //total number of bytes in both segments
+};
+
+/**
+ * Represents a zero-copy drain callback signature
+ *
+ * Unlike vuart_callback_t this one doesn't get a copy of the data but a view of the TX FIFO itself. The callback
+ * decides how much of it was consumed - whatever wasn't consumed stays in the FIFO and will be delivered again with the
+ * next flush (but keep in mind that the FIFO is small and the application writing to the port will be stalled until
+ * there's space).
+ *
+ * @param line UART# where the data arrived; you can ignore it if you registered only one UART
+ * @param view Data available to read, see struct vuart_tx_view
+ * @param reason Denotes why the vUART decided to flush the buffer to the callback
+ *
+ * @return number of bytes consumed from the beginning of the view (anything above view->len is treated as view->len)
+ */
+typedef unsigned int (vuart_drain_callback_t)(int line, const struct vuart_tx_view *view, vuart_flush_reason reason);
+
 /**
  * Adds a virtual UART device
  *
@@ -51,6 +114,10 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  * data will leave through the real one. However, by itself the data will not be delivered anywhere until you call
  * vuart_set_tx_callback(), which you can do before or after calling vuart_add_device().
  *
+ * Lines 0-3 replace legacy COM1-4 ports. Lines above (up to CONFIG_SERIAL_8250_NR_UARTS-1) don't replace anything but
+ * are registered as additional 8250 ports. These need the driver to have free slots (8250.nr_uarts= above 4) and, as
+ * the driver assigns them to the first free slot, the ttyS# may differ from the line (it's logged when it happens).
+ *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  *
@@ -58,13 +125,26 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  */
 int vuart_add_device(int line);
 
+/**
+ * Adds a virtual UART device emulating a specific chip model
+ *
+ * This works exactly like vuart_add_device() (which uses VUART_DEFAULT_CHIP) but lets you select a model with deeper
+ * FIFOs. Keep in mind that buffers passed to vuart_set_tx_callback() must accommodate the FIFO of the chosen model.
+ *
+ * @param line see vuart_add_device()
+ * @param model one of vuart_chip_model
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_add_device_model(int line, vuart_chip_model model);
+
 /**
  * Removes a virtual UART device
  *
  * Calling this function restores previously replaced port. Unlike vuart_add_device() this function WILL alter TX
- * callbacks by removing all of them. The reasoning behind this is that adding a device and later on adding/changing
- * callbacks makes sense while removing the device and potentially leaving broken pointers can lead to nasty and hard to
- * trace bugs.
+ * callbacks by removing all of them (including all subscribers, see vuart_subscribe_tx()). The reasoning behind this is
+ * that adding a device and later on adding/changing callbacks makes sense while removing the device and potentially
+ * leaving broken pointers can lead to nasty and hard to trace bugs.
  *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
@@ -73,6 +153,19 @@ int vuart_add_device(int line);
  */
 int vuart_remove_device(int line);
 
+/**
+ * Changes the way interrupts are delivered to the 8250 driver for all vUART ports
+ *
+ * It can be called at any time (from a context which can sleep) - ports which are already added will be switched
+ * without losing any interrupts. The default mode is VUART_IRQ_THREAD (unless VUART_DEFAULT_IRQ_MODE was changed). The
+ * module applies the "vuart_irq=" cmdline option (see CMDLINE_CT_VUART_IRQ) with it before any vUART is added.
+ *
+ * @param mode one of vuart_irq_mode
+ *
+ * @return 0 on success, -EOPNOTSUPP when vIRQ is disabled (VUART_USE_TIMER_FALLBACK), or other -E on error
+ */
+int vuart_set_irq_mode(vuart_irq_mode mode);
+
 /**
  * Injects data into RX stream of the port
  *
@@ -85,12 +178,33 @@ int vuart_remove_device(int line);
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param buffer Pointer to a buffer where we will read from. There's no assumption as to what the buffer contains.
- * @param length Length to read from the buffer up to VUART_FIFO_LEN
+ * @param length Length to read from the buffer. It can be of any size, but only as much as currently fits in the RX FIFO
+ *               and the RX staging queue behind it (see VUART_RX_QUEUE_LEN in virtual_uart.c) will be injected. The
+ *               queue is drained into the FIFO as the driver reads data, so nothing is lost on overflow - instead you
+ *               get a short count and should retry the rest later (or use vuart_inject_rx_wait()).
  *
- * @return 0 on success or -E on error
+ * It's safe to call it concurrently for the same line (e.g. from the PMU shim and /dev/vuartN) - callers are serialized
+ * with a per-line producer lock, so each call's data arrives contiguously. It doesn't sleep.
+ *
+ * @return number of bytes injected (which may be less than length if there wasn't enough space) or -E on error
  */
 int vuart_inject_rx(int line, const char *buffer, int length);
 
+/**
+ * Injects data into RX stream of the port waiting for space if needed
+ *
+ * This is a blocking version of vuart_inject_rx() which paces the caller according to how fast the driver (and thus
+ * the application which opened the port) picks up the data. It must be called from a context which can sleep.
+ *
+ * @param line see vuart_inject_rx()
+ * @param buffer see vuart_inject_rx()
+ * @param length see vuart_inject_rx()
+ * @param timeout_ms maximum time to wait in total (if nobody reads the port it will never have space)
+ *
+ * @return number of bytes injected (which will be less than length on timeout/signal) or -E on error
+ */
+int vuart_inject_rx_wait(int line, const char *buffer, int length, unsigned int timeout_ms);
+
 /**
  * Set a function which will be called upon data transmission by the port opener
  *
@@ -113,9 +227,11 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
- * @param cb Function to be called; call it with a NULL ptr to remove callback, see docblock for vuart_callback_t
+ * @param cb Function to be called; call it with a NULL ptr to remove callback (which must be done from a context which
+ *           can sleep), see docblock for vuart_callback_t
  * @param buffer A pointer to a buffer where data will be placed. The buffer should be able to accommodate
- *               VUART_FIFO_LEN number of bytes. The buffer you pass will be the same one as passed back during a call
+ *               VUART_FIFO_LEN number of bytes (or more if you use a chip model with deeper FIFOs; VUART_FIFO_LEN_MAX is
+ *               always safe). The buffer you pass will be the same one as passed back during a call
  * @param threshold a *HINT* how many bytes at minimum should be deposited in the FIFO before callback is called. Keep
  *                  in mind that this is just a hint and you callback may be called sooner (e.g. when a client program
  *                  wrote only a single byte using e.g. echo -n X > /dev/ttyS0).
@@ -123,4 +239,73 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  */
 int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold);
 
+/**
+ * Set a zero-copy function which will be called upon data transmission by the port opener
+ *
+ * This is an alternative to vuart_set_tx_callback() which avoids copying the data into an intermediate buffer: the
+ * callback gets a read-only view of the TX FIFO and reports back how many bytes it consumed. Only a single callback
+ * (either a normal or a drain one) can be set for a given line - setting one replaces the other. If you need more than
+ * one consumer of the same line use vuart_subscribe_tx(). All warnings regarding multithreading from
+ * vuart_set_tx_callback() apply here too.
+ *
+ * Example of the callback usage:
+ *     unsigned int dummy_drain_callback(int line, const struct vuart_tx_view *view, vuart_flush_reason reason) {
+ *         pr_loc_inf("TX @ ttyS%d: |%.*s%.*s|", line, view->seg[0].len, view->seg[0].buffer, view->seg[1].len,
+ *                    view->seg[1].buffer);
+ *         return view->len;
+ *     }
+ *     //....
+ *     vuart_set_tx_drain_callback(TRY_PORT, dummy_drain_callback, VUART_FIFO_LEN);
+ *
+ * @param line UART number, see vuart_set_tx_callback()
+ * @param cb Function to be called; call it with a NULL ptr to remove callback, see docblock for vuart_drain_callback_t
+ * @param threshold see vuart_set_tx_callback()
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_tx_drain_callback(int line, vuart_drain_callback_t *cb, int threshold);
+
+/**
+ * TX subscriber which can be attached to a line along with others, see vuart_subscribe_tx()
+ *
+ * Exactly one of fn/drain_fn should be set; they work exactly like callbacks passed to vuart_set_tx_callback() and
+ * vuart_set_tx_drain_callback() respectively. The structure is owned by the caller but it MUST be zeroed (e.g. static
+ * or kzalloc'ed) before it's subscribed for the first time and it cannot be freed until vuart_unsubscribe_tx() returns.
+ */
+struct vuart_tx_subscriber {
+    vuart_callback_t *fn;
+    vuart_drain_callback_t *drain_fn;
+    char *buffer; //only used with fn, see vuart_set_tx_callback()
+    int threshold; //see vuart_set_tx_callback()
+
+    //Private fields managed by the vUART
+    struct hlist_node node;
+    unsigned int cursor; //position in the TX FIFO up to which the subscriber consumed data
+};
+
+/**
+ * Attaches a subscriber to data transmitted on a line
+ *
+ * Unlike vuart_set_tx_callback() this doesn't replace anything - every subscriber gets all data sent after it was
+ * subscribed (callbacks set with vuart_set_tx_callback()/vuart_set_tx_drain_callback() are subscribers too). Every
+ * subscriber is flushed according to its own threshold. Drain subscribers get a view of the TX FIFO itself, so adding
+ * them doesn't copy any data. Keep in mind that the FIFO is released only as fast as the slowest subscriber consumes it.
+ *
+ * @param line UART number, see vuart_set_tx_callback()
+ * @param sub subscriber to attach, see struct vuart_tx_subscriber
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_subscribe_tx(int line, struct vuart_tx_subscriber *sub);
+
+/**
+ * Detaches a subscriber attached with vuart_subscribe_tx()
+ *
+ * Once this function returns the subscriber will not be called anymore and can be freed. It must be called from a
+ * context which can sleep.
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_unsubscribe_tx(int line, struct vuart_tx_subscriber *sub);
+
 #endif //REDPILL_VIRTUAL_UART_H
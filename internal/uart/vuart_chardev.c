@@ -0,0 +1,360 @@
+#include "vuart_chardev.h"
+#ifdef VUART_CHARDEV_SUPPORTED
+
+#include "virtual_uart.h"
+#include "vuart_internal.h"
+#include "../../common.h"
+#include "../../config/uart_defs.h" //UART_NR
+#include "../../debug/debug_vuart.h"
+#include <linux/miscdevice.h> //misc_register(), misc_deregister()
+#include <linux/fs.h> //struct file_operations
+#include <linux/poll.h> //poll_wait(), POLL* consts
+#include <linux/mm.h> //struct vm_area_struct
+#include <linux/vmalloc.h> //vmalloc_user(), vfree(), remap_vmalloc_range()
+#include <linux/uaccess.h> //copy_to_user(), copy_from_user()
+#include <linux/mutex.h> //struct mutex
+
+//Name of the device in /dev; it gets the ttyS# as its param
+#ifndef VUART_CHARDEV_FMT
+#define VUART_CHARDEV_FMT "vuart%d"
+#endif
+
+//Size of the TX ring shared with the userspace; MUST be a power of 2
+#ifndef VUART_CHARDEV_TX_LEN
+#define VUART_CHARDEV_TX_LEN (16 * 1024)
+#endif
+
+#define WRITE_CHUNK_LEN 256 //write() copies data from the userspace in chunks of that size
+#define RING_DATA_OFFSET PAGE_SIZE //data area starts on the 2nd page (as the 1st one is the struct vuart_mmap_ring)
+
+struct vuart_chardev {
+    struct miscdevice misc;
+    char name[16];
+    struct serial8250_16550A_vdev *vdev;
+    struct vuart_tx_subscriber tx_sub; //subscribed only while the device is open
+
+    struct vuart_mmap_ring *ring; //beginning of the memory shared with the userspace
+    u8 *ring_data;
+    wait_queue_head_t read_wait;
+    struct mutex read_lock; //serializes read()s as they're all consumers of the same ring
+
+    struct mutex open_lock; //protects two fields below
+    bool open;
+    bool removed; //device was removed while open; the last close will free it
+};
+
+static struct vuart_chardev *chardevs[UART_NR] = { NULL };
+
+/*********************************************** TX ring (kernel side) ************************************************/
+//This mirrors vuart_ring.h operations but indexes live in memory shared with the userspace, see vuart_chardev.h
+#define ring_used(ring) (vuart_ring_load((ring)->head) - vuart_ring_load((ring)->tail))
+
+/**
+ * Drain callback of the vUART; it copies data from the TX FIFO to the ring shared with the userspace
+ *
+ * It always consumes everything as the 8250 driver will not wait for the TX FIFO to have space (and the application
+ * writing to the port shouldn't stall because nobody reads the other end - just like with a real disconnected line).
+ */
+static unsigned int chardev_tx_drain(int line, const struct vuart_tx_view *view, vuart_flush_reason reason)
+{
+    struct vuart_chardev *cdev = chardevs[line];
+    if (unlikely(!cdev))
+        return view->len;
+
+    struct vuart_mmap_ring *ring = cdev->ring;
+    unsigned int head = ring->head;
+    unsigned int used = head - vuart_ring_load(ring->tail);
+    //tail is writable by the userspace - a bogus one is treated as a full ring
+    unsigned int space = (used > VUART_CHARDEV_TX_LEN) ? 0 : VUART_CHARDEV_TX_LEN - used;
+    unsigned int copied = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(view->seg) && copied < space; ++i) {
+        unsigned int len = min_t(unsigned int, view->seg[i].len, space - copied);
+        unsigned int off = (head + copied) & (VUART_CHARDEV_TX_LEN - 1);
+        unsigned int first = min_t(unsigned int, len, VUART_CHARDEV_TX_LEN - off);
+
+        memcpy(cdev->ring_data + off, view->seg[i].buffer, first);
+        memcpy(cdev->ring_data, view->seg[i].buffer + first, len - first);
+        copied += len;
+    }
+
+    if (unlikely(copied < view->len)) {
+        vuart_ring_store(ring->dropped, ring->dropped + (view->len - copied));
+        uart_prdbg("Dropped %u bytes from ttyS%d as /dev/" VUART_CHARDEV_FMT " reader isn't keeping up",
+                   view->len - copied, line, line);
+    }
+
+    smp_wmb(); //see vuart_ring_put()
+    vuart_ring_store(ring->head, head + copied);
+    wake_up_interruptible(&cdev->read_wait);
+
+    return view->len;
+}
+
+/************************************************** File operations ***************************************************/
+#define file_to_chardev(file) container_of((file)->private_data, struct vuart_chardev, misc)
+
+static int chardev_open(struct inode *inode, struct file *file)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+    int out = 0;
+
+    mutex_lock(&cdev->open_lock);
+    if (cdev->open || cdev->removed) {
+        out = -EBUSY;
+        goto out_unlock;
+    }
+
+    //Nothing can be drained into the ring now so it's safe to reset it
+    cdev->ring->head = 0;
+    cdev->ring->tail = 0;
+    cdev->ring->dropped = 0;
+
+    //We're just another subscriber so e.g. the PMU shim consuming the same line will not notice us
+    if ((out = vuart_subscribe_tx(cdev->vdev->line, &cdev->tx_sub)) != 0)
+        goto out_unlock;
+
+    cdev->open = true;
+    nonseekable_open(inode, file);
+
+    out_unlock:
+    mutex_unlock(&cdev->open_lock);
+    return out;
+}
+
+static void free_chardev(struct vuart_chardev *cdev)
+{
+    vfree(cdev->ring);
+    kfree(cdev);
+}
+
+static int chardev_release(struct inode *inode, struct file *file)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+
+    mutex_lock(&cdev->open_lock);
+    cdev->open = false;
+    if (cdev->removed) { //vuart_chardev_remove() left it for us (it's already unsubscribed)
+        mutex_unlock(&cdev->open_lock);
+        free_chardev(cdev);
+        return 0;
+    }
+
+    vuart_unsubscribe_tx(cdev->vdev->line, &cdev->tx_sub);
+    mutex_unlock(&cdev->open_lock);
+
+    return 0;
+}
+
+static ssize_t chardev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+    struct vuart_mmap_ring *ring = cdev->ring;
+    ssize_t out;
+
+    if (mutex_lock_interruptible(&cdev->read_lock))
+        return -ERESTARTSYS;
+
+    if (ring_used(ring) == 0) {
+        if (cdev->removed) {
+            out = 0; //EOF
+            goto out_unlock;
+        }
+
+        if (file->f_flags & O_NONBLOCK) {
+            out = -EAGAIN;
+            goto out_unlock;
+        }
+
+        if (wait_event_interruptible(cdev->read_wait, ring_used(ring) != 0 || cdev->removed)) {
+            out = -ERESTARTSYS;
+            goto out_unlock;
+        }
+    }
+
+    //tail lives in memory mapped writable by the userspace, so it cannot be trusted
+    unsigned int tail = vuart_ring_load(ring->tail);
+    unsigned int used = vuart_ring_load(ring->head) - tail;
+    if (unlikely(used > VUART_CHARDEV_TX_LEN)) {
+        pr_loc_err("/dev/" VUART_CHARDEV_FMT " ring is corrupted (head=%u tail=%u)", cdev->vdev->line, ring->head,
+                   tail);
+        out = -EIO;
+        goto out_unlock;
+    }
+
+    unsigned int len = min_t(size_t, used, count);
+    smp_rmb(); //see vuart_ring_get()
+
+    unsigned int off = tail & (VUART_CHARDEV_TX_LEN - 1);
+    unsigned int first = min_t(unsigned int, len, VUART_CHARDEV_TX_LEN - off);
+    if (copy_to_user(buf, cdev->ring_data + off, first) || copy_to_user(buf + first, cdev->ring_data, len - first)) {
+        out = -EFAULT;
+        goto out_unlock;
+    }
+
+    smp_mb(); //see vuart_ring_get()
+    vuart_ring_store(ring->tail, tail + len);
+    out = len;
+
+    out_unlock:
+    mutex_unlock(&cdev->read_lock);
+    return out;
+}
+
+static ssize_t chardev_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+    char chunk[WRITE_CHUNK_LEN];
+    ssize_t done = 0;
+
+    while (done < count) {
+        if (unlikely(cdev->removed))
+            return done ? done : -ENODEV;
+
+        int len = min_t(size_t, count - done, WRITE_CHUNK_LEN);
+        if (copy_from_user(chunk, buf + done, len))
+            return done ? done : -EFAULT;
+
+        int out = vuart_inject_rx(cdev->vdev->line, chunk, len);
+        if (out < 0)
+            return done ? done : out;
+
+        done += out;
+        if (out == len)
+            continue;
+
+        if ((file->f_flags & O_NONBLOCK) || unlikely(!cdev->vdev->registered))
+            break;
+
+        //This isn't vuart_inject_rx_wait() as removal must end the wait too - the port stays initialized (and thus never
+        // gets any space) for a while after the chardev is removed
+        if (wait_event_interruptible(cdev->vdev->rx_space_wait, cdev->removed || vuart_can_inject_rx(cdev->vdev)))
+            break; //signal
+    }
+
+    if (done == 0 && count != 0)
+        return (file->f_flags & O_NONBLOCK) ? -EAGAIN : -ERESTARTSYS;
+
+    return done;
+}
+
+static unsigned int chardev_poll(struct file *file, poll_table *wait)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+    unsigned int mask = 0;
+
+    poll_wait(file, &cdev->read_wait, wait);
+    poll_wait(file, &cdev->vdev->rx_space_wait, wait);
+
+    if (cdev->removed)
+        return POLLHUP;
+
+    if (ring_used(cdev->ring) != 0)
+        mask |= POLLIN | POLLRDNORM;
+
+    if (vuart_can_inject_rx(cdev->vdev))
+        mask |= POLLOUT | POLLWRNORM;
+
+    return mask;
+}
+
+static int chardev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vuart_chardev *cdev = file_to_chardev(file);
+
+    if (vma->vm_end - vma->vm_start > RING_DATA_OFFSET + VUART_CHARDEV_TX_LEN)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, cdev->ring, vma->vm_pgoff);
+}
+
+static const struct file_operations chardev_fops = {
+    .owner = THIS_MODULE,
+    .open = chardev_open,
+    .release = chardev_release,
+    .read = chardev_read,
+    .write = chardev_write,
+    .poll = chardev_poll,
+    .mmap = chardev_mmap,
+    .llseek = no_llseek,
+};
+
+/************************************************** Public interface **************************************************/
+int vuart_chardev_add(struct serial8250_16550A_vdev *vdev)
+{
+    BUILD_BUG_ON_NOT_POWER_OF_2(VUART_CHARDEV_TX_LEN); //ring requirement
+    int out;
+
+    if (unlikely(chardevs[vdev->line])) {
+        pr_loc_bug("Character device for ttyS%d already exists", vdev->line);
+        return -EEXIST;
+    }
+
+    struct vuart_chardev *cdev;
+    kzalloc_or_exit_int(cdev, sizeof(struct vuart_chardev));
+
+    //It's mapped to the userspace so it must be page-aligned & zeroed (which vmalloc_user() does)
+    cdev->ring = vmalloc_user(RING_DATA_OFFSET + VUART_CHARDEV_TX_LEN);
+    if (unlikely(!cdev->ring)) {
+        kfree(cdev);
+        kalloc_error_int(cdev->ring, RING_DATA_OFFSET + VUART_CHARDEV_TX_LEN);
+    }
+    cdev->ring->size = VUART_CHARDEV_TX_LEN;
+    cdev->ring->data_offset = RING_DATA_OFFSET;
+    cdev->ring_data = (u8 *)cdev->ring + RING_DATA_OFFSET;
+
+    cdev->vdev = vdev;
+    cdev->tx_sub.drain_fn = chardev_tx_drain;
+    cdev->tx_sub.threshold = VUART_THRESHOLD_MAX; //we're only interested in full/idle flushes (see handle_transmit_char())
+    init_waitqueue_head(&cdev->read_wait);
+    mutex_init(&cdev->open_lock);
+    mutex_init(&cdev->read_lock);
+    snprintf(cdev->name, sizeof(cdev->name), VUART_CHARDEV_FMT, vdev->line);
+    cdev->misc.minor = MISC_DYNAMIC_MINOR;
+    cdev->misc.name = cdev->name;
+    cdev->misc.fops = &chardev_fops;
+    cdev->misc.mode = 0600;
+
+    chardevs[vdev->line] = cdev; //it must be there before the device is visible
+    if ((out = misc_register(&cdev->misc)) != 0) {
+        pr_loc_err("Failed to register /dev/%s - error=%d", cdev->name, out);
+        chardevs[vdev->line] = NULL;
+        free_chardev(cdev);
+        return out;
+    }
+
+    pr_loc_dbg("Registered /dev/%s for ttyS%d", cdev->name, vdev->line);
+    return 0;
+}
+
+int vuart_chardev_remove(struct serial8250_16550A_vdev *vdev)
+{
+    struct vuart_chardev *cdev = chardevs[vdev->line];
+    if (unlikely(!cdev)) {
+        pr_loc_dbg("No character device for ttyS%d - nothing to remove", vdev->line);
+        return 0;
+    }
+
+    misc_deregister(&cdev->misc); //no new opens from now on
+
+    mutex_lock(&cdev->open_lock);
+    if (cdev->open)
+        vuart_unsubscribe_tx(vdev->line, &cdev->tx_sub); //once it returns the drain callback isn't running
+    chardevs[vdev->line] = NULL;
+
+    if (cdev->open) { //the last close will free it
+        cdev->removed = true;
+        wake_up_interruptible_all(&cdev->read_wait);
+        wake_up_interruptible_all(&vdev->rx_space_wait);
+        mutex_unlock(&cdev->open_lock);
+        return 0;
+    }
+    mutex_unlock(&cdev->open_lock);
+
+    free_chardev(cdev);
+    pr_loc_dbg("Removed character device for ttyS%d", vdev->line);
+
+    return 0;
+}
+
+#endif //VUART_CHARDEV_SUPPORTED
@@ -0,0 +1,47 @@
+/**
+ * Character device frontend (/dev/vuartN) for vUART lines
+ *
+ * Every vUART line gets a misc device which lets a userspace process act as the "other end" of the emulated serial
+ * line: whatever the application talking to /dev/ttySN sends can be read() from /dev/vuartN, and whatever is written
+ * to /dev/vuartN arrives at /dev/ttySN (see vuart_inject_rx()). poll() is supported for both directions.
+ *
+ * The TX direction (ttySN => vuartN) is additionally available as a ring buffer shared with the userspace via mmap().
+ * The first page of the mapping contains struct vuart_mmap_ring and the data starts at data_offset. The kernel only
+ * moves the head and the userspace consumes data by moving the tail (both are free-running, i.e. the position in data
+ * is index & (size-1)). Don't mix read() with consuming data from the mapping. A tail further than size bytes behind
+ * the head is treated as a full ring by the kernel and makes read() fail with EIO.
+ *
+ * Only one process can open a given device at a time (others will get EBUSY). It can be opened even if something else
+ * in the kernel consumes the TX data of that line (e.g. the PMU shim) as the device is just another TX subscriber (see
+ * vuart_subscribe_tx()).
+ *
+ * The device is only available in the stealth mode of STEALTH_MODE_BASIC or lower; it can also be disabled by defining
+ * VUART_DISABLE_CHARDEV.
+ */
+#ifndef REDPILL_VUART_CHARDEV_H
+#define REDPILL_VUART_CHARDEV_H
+
+#include "../stealth.h" //STEALTH_MODE
+#include <linux/types.h> //__u32
+
+struct vuart_mmap_ring {
+    __u32 head; //index of the next byte to be written by the kernel
+    __u32 tail; //index of the next byte to be read by the userspace
+    __u32 size; //size of the data area (always a power of 2)
+    __u32 data_offset; //offset of the data area from the beginning of the mapping
+    __u32 dropped; //number of bytes which were lost as the userspace didn't keep up
+};
+
+#if STEALTH_MODE <= STEALTH_MODE_BASIC && !defined(VUART_DISABLE_CHARDEV)
+#define VUART_CHARDEV_SUPPORTED
+
+struct serial8250_16550A_vdev;
+int vuart_chardev_add(struct serial8250_16550A_vdev *vdev);
+int vuart_chardev_remove(struct serial8250_16550A_vdev *vdev);
+
+#else //STEALTH_MODE <= STEALTH_MODE_BASIC && !defined(VUART_DISABLE_CHARDEV)
+#define vuart_chardev_add(dummy) (0)
+#define vuart_chardev_remove(dummy) (0)
+#endif
+
+#endif //REDPILL_VUART_CHARDEV_H
@@ -1,32 +1,34 @@
 #ifndef REDPILL_VUART_INTERNAL_H
 #define REDPILL_VUART_INTERNAL_H
 
+#include "virtual_uart.h" //vuart_chip_model
+#include "vuart_ring.h"
 #include <linux/spinlock.h>
-#ifndef VUART_USE_TIMER_FALLBACK
-#include <linux/wait.h>
-#endif
+#include <linux/hrtimer.h> //struct hrtimer
+#include <linux/wait.h> //wait_queue_head_t
 
 
 //Lock/unlock vdev for registries operations
-#define lock_vuart(vdev) spin_lock_irqsave((vdev)->lock, (vdev)->lock_flags);
-#define unlock_vuart(vdev) spin_unlock_irqrestore((vdev)->lock, (vdev)->lock_flags);
+#define lock_vuart(vdev) spin_lock_irqsave(&(vdev)->lock, (vdev)->lock_flags);
+#define unlock_vuart(vdev) spin_unlock_irqrestore(&(vdev)->lock, (vdev)->lock_flags);
 
 //In some circumstances operations may be performed on the chip before or after the chip is initialized. If it is
 // initialized we need a lock first; otherwise we do not. This is a shortcut for this opportunistic/conditional locking.
 #define lock_vuart_oppr(vdev) if ((vdev)->initialized) { lock_vuart(vdev); }
 #define unlock_vuart_oppr(vdev) if ((vdev)->initialized) { unlock_vuart(vdev); }
 
-#define validate_isa_line(line) \
-    if (unlikely((line) > SERIAL8250_LAST_ISA_LINE)) { \
-        pr_loc_bug("%s failed - requested line %d but kernel supports only %d", __FUNCTION__, line, \
-                   SERIAL8250_LAST_ISA_LINE); \
+//Lines 0-3 are legacy COM1-4 ports, anything above (up to UART_NR) is an additional port (see vuart_add_device())
+#define validate_line(line) \
+    if (unlikely((line) < 0 || (line) >= UART_NR)) { \
+        pr_loc_bug("%s failed - requested line %d but kernel supports only %d", __FUNCTION__, line, UART_NR); \
         return -EINVAL; \
     }
 
 /**
  * An emulated 16550A chips internal state
  *
- * See http://caro.su/msx/ocm_de1/16550.pdf for details; registers are on page 9 (Table 2)
+ * See http://caro.su/msx/ocm_de1/16550.pdf for details; registers are on page 9 (Table 2). Despite the name the
+ * structure is used for all emulated chip models, as they're all 16550A supersets (see vuart_chip_model).
  */
 struct serial8250_16550A_vdev {
     //Port properties
@@ -34,13 +36,22 @@ struct serial8250_16550A_vdev {
     u16			iobase;
     u8			irq;
     unsigned int         baud;
+    int port_line; //line assigned by the 8250 driver; it matches the line for COM1-4 but may not for additional ports
 
     //The 8250 driver port structure - it will be populated as soon as 8250 gives us the real pointer
     struct uart_port *up;
 
-    //Chip emulated FIFOs
-    struct kfifo *tx_fifo; //character to be sent (aka what we've got from the OS)
-    struct kfifo *rx_fifo; //characters received (aka what we want the OS to get from us)
+    //Emulated chip properties (see chip definitions in virtual_uart.c)
+    vuart_chip_model model;
+    unsigned int fifo_len; //currently effective FIFOs depth (some chips change it based on FCR)
+    unsigned int rx_trigger; //RX FIFO trigger level in bytes as selected in FCR
+
+    //Chip emulated FIFOs; they're lock-free SPSC rings (see vuart_ring.h) so only registers need the lock below
+    struct vuart_ring tx_fifo; //character to be sent (aka what we've got from the OS)
+    struct vuart_ring rx_fifo; //characters received (aka what we want the OS to get from us)
+    struct vuart_ring rx_queue; //injected characters which didn't fit in rx_fifo yet (optional, see VUART_RX_QUEUE_LEN)
+    wait_queue_head_t rx_space_wait; //woken up when RX FIFO/queue gets some space, see vuart_inject_rx_wait()
+    spinlock_t rx_producer_lock; //serializes vuart_inject_rx() callers (the rings above allow one producer) & teardown
 
     //Chip registries (they're considered volatile but there's a spinlock protecting them)
     u8 rhr; //Receiver Holding Register (characters received)
@@ -56,18 +67,38 @@ struct serial8250_16550A_vdev {
     u8 dll; //Divisor Lat Least significant byte (not really used but holds values written to it)
     u8 dlm; //Divisor Lat Most significant byte (not really used but holds values written to it; also called DLH)
     u8 psd; //Prescaler Division (not really used but holds values written to it)
+    u8 efr; //Enhanced Feature Register (16C950 only; not really used but holds values written to it)
+    u8 acr; //Additional Control Register (16C950 only, accessed via ICR; not really used but holds values written to it)
+
+    //TX subscribers (see vuart_subscribe_tx()). The list is traversed under RCU (flushes happen with the vdev lock held
+    // too) and modified with vdevs_lock held. Callbacks set by vuart_set_tx_callback() & vuart_set_tx_drain_callback()
+    // are just a default subscriber of a line.
+    struct hlist_head tx_subscribers;
+    int tx_min_threshold; //lowest threshold of all subscribers, see handle_transmit_char()
+    struct vuart_tx_subscriber tx_default_sub;
+
+    //Interrupt sources which aren't level-based (i.e. they cannot be derived from registers alone)
+    bool rx_timeout; //character timeout indication (data below RX trigger level sat in FIFO for too long)
+    bool thri_latched; //THR empty interrupt pending; set when TX FIFO becomes empty, cleared on IIR read or THR write
+    struct hrtimer rx_timer; //measures character timeout, see update_rx_timer()
 
-    //Some operations (e.g. FIFO access) must be locked
+    //Registers access must be locked (FIFOs data don't need it as long as there's a single producer & consumer)
     bool initialized:1;
     bool registered:1; //whether the vdev is actually registered with 8250 subsystem
-    spinlock_t *lock;
+    spinlock_t lock;
     unsigned long lock_flags;
 
 #ifndef VUART_USE_TIMER_FALLBACK
-    //We emulate (i.e. self-trigger) interrupts on threads
-    struct task_struct *virq_thread; //where fake interrupt code is executed
-    wait_queue_head_t *virq_queue; //wait queue used to put thread to sleep
+    //We emulate (i.e. self-trigger) interrupts on a thread shared by all ports (see vuart_virtual_irq.c)
+    bool virq_active; //modified under the lock above (not a bitfield as flags above are modified without it)
 #endif
 };
 
+/**
+ * Checks whether vuart_inject_rx() would accept at least one byte (or if waiting for that is pointless)
+ *
+ * It can be used as a wait condition on vdev->rx_space_wait.
+ */
+bool vuart_can_inject_rx(struct serial8250_16550A_vdev *vdev);
+
 #endif //REDPILL_VUART_INTERNAL_H
@@ -0,0 +1,284 @@
+#include "vuart_recorder.h"
+#ifdef VUART_RECORDER_SUPPORTED
+
+#include "virtual_uart.h"
+#include "vuart_internal.h"
+#include "../../common.h"
+#include "../../config/uart_defs.h" //UART_NR
+#include "../../debug/debug_vuart.h"
+#include <linux/relay.h> //relay_open(), relay_write() etc.
+#include <linux/debugfs.h> //debugfs_create_dir(), debugfs_create_file()
+#include <linux/fs.h> //struct file_operations, simple_read_from_buffer()
+#include <linux/sched.h> //local_clock()
+#include <linux/mutex.h> //DEFINE_MUTEX
+
+//Size of a single relay sub-buffer; there are VUART_RECORDER_SUBBUF_NUM of them per CPU
+#ifndef VUART_RECORDER_SUBBUF_LEN
+#define VUART_RECORDER_SUBBUF_LEN (64 * 1024)
+#endif
+
+#ifndef VUART_RECORDER_SUBBUF_NUM
+#define VUART_RECORDER_SUBBUF_NUM 8
+#endif
+
+#define RECORDER_DIR_NAME "vuart"
+#define RECORDER_TRACE_NAME "trace" //relay adds CPU# to it
+
+bool vuart_recording = false;
+
+/*
+ * The debugfs directory & relay channel exist as long as there's at least one vUART added. All state below is protected
+ * by rec_lock. TX subscribers are attached only while recording so the recorder costs nothing on TX when it's disabled.
+ */
+static struct dentry *rec_dir = NULL;
+static struct rchan *rec_chan = NULL;
+static struct serial8250_16550A_vdev *rec_vdevs[UART_NR] = { NULL };
+static struct vuart_tx_subscriber rec_subs[UART_NR] = { };
+static bool rec_subscribed[UART_NR] = { false }; //whether rec_subs of a line is actually subscribed
+static unsigned int rec_users = 0;
+static DEFINE_MUTEX(rec_lock);
+
+/************************************************** Events recording **************************************************/
+void __vuart_record(int line, vuart_rec_type type, u8 aux, const void *data, unsigned int len)
+{
+    struct vuart_rec_event ev;
+    struct rchan *chan = rec_chan;
+    if (unlikely(!chan))
+        return;
+
+    ev.ts_ns = local_clock();
+    ev.line = line;
+    ev.type = type;
+    ev.aux = aux;
+
+    //Events are fixed-size so they're trivial to parse - longer data is simply split into multiple events
+    do {
+        ev.len = min_t(unsigned int, len, VUART_REC_DATA_LEN);
+        memcpy(ev.data, data, ev.len);
+        memset(ev.data + ev.len, 0, VUART_REC_DATA_LEN - ev.len); //this goes to the userspace as-is
+
+        relay_write(chan, &ev, sizeof(ev)); //it's per-CPU and safe in any context
+        data += ev.len;
+        len -= ev.len;
+    } while (len > 0);
+}
+
+/**
+ * TX subscriber of the recorder (see vuart_subscribe_tx())
+ *
+ * It's subscribed with the lowest threshold possible and always consumes everything, so it never holds data in the TX
+ * FIFO for longer than other subscribers would.
+ */
+static unsigned int rec_tx_drain(int line, const struct vuart_tx_view *view, vuart_flush_reason reason)
+{
+    for (int i = 0; i < ARRAY_SIZE(view->seg); ++i) {
+        if (view->seg[i].len)
+            vuart_record(line, VUART_REC_TX, reason, view->seg[i].buffer, view->seg[i].len);
+    }
+
+    return view->len;
+}
+
+/**
+ * Attaches the recorder to TX of a line; it must be called with rec_lock held
+ */
+static int subscribe_line(int line)
+{
+    int out = vuart_subscribe_tx(line, &rec_subs[line]);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to subscribe to TX of ttyS%d - it will not be recorded (error=%d)", line, out);
+        return out;
+    }
+
+    rec_subscribed[line] = true;
+    return 0;
+}
+
+/**
+ * Reverses what subscribe_line() did (if it succeeded); it must be called with rec_lock held
+ */
+static void unsubscribe_line(int line)
+{
+    if (!rec_subscribed[line])
+        return;
+
+    vuart_unsubscribe_tx(line, &rec_subs[line]);
+    rec_subscribed[line] = false;
+}
+
+/**
+ * Starts/stops recording on all lines; it must be called with rec_lock held
+ *
+ * @return 0 on success, -E if the recording couldn't be started on any line
+ */
+static int set_recording(bool enable)
+{
+    if (enable == vuart_recording)
+        return 0;
+
+    if (!enable) {
+        vuart_recording = false;
+        for (int line = 0; line < UART_NR; ++line)
+            unsubscribe_line(line);
+        relay_flush(rec_chan); //makes the last, partially filled, sub-buffer available to readers
+        pr_loc_dbg("vUART recording stopped");
+        return 0;
+    }
+
+    //Lines which failed are simply not recorded; it's only an error when none of them can be
+    int out = -ENODEV;
+    for (int line = 0; line < UART_NR; ++line) {
+        if (rec_vdevs[line] && subscribe_line(line) == 0)
+            out = 0;
+    }
+
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to start vUART recording on any line");
+        return out;
+    }
+
+    vuart_recording = true;
+    pr_loc_dbg("vUART recording started");
+    return 0;
+}
+
+/************************************************* debugfs interface **************************************************/
+static ssize_t enabled_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    char val[2] = { vuart_recording ? '1' : '0', '\n' };
+
+    return simple_read_from_buffer(buf, count, ppos, val, sizeof(val));
+}
+
+static ssize_t enabled_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned int val;
+    int out;
+
+    if ((out = kstrtouint_from_user(buf, count, 0, &val)) != 0)
+        return out;
+
+    mutex_lock(&rec_lock);
+    if (likely(rec_chan)) //the last vUART may have been removed while the file was open
+        out = set_recording(val != 0);
+    mutex_unlock(&rec_lock);
+
+    return (out != 0) ? out : count;
+}
+
+static const struct file_operations enabled_fops = {
+    .owner = THIS_MODULE,
+    .read = enabled_read,
+    .write = enabled_write,
+    .llseek = default_llseek,
+};
+
+static struct dentry *rec_create_buf_file(const char *filename, struct dentry *parent, umode_t mode,
+                                          struct rchan_buf *buf, int *is_global)
+{
+    return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int rec_remove_buf_file(struct dentry *dentry)
+{
+    debugfs_remove(dentry);
+    return 0;
+}
+
+static struct rchan_callbacks rec_relay_callbacks = {
+    .create_buf_file = rec_create_buf_file,
+    .remove_buf_file = rec_remove_buf_file,
+};
+
+/**
+ * Creates debugfs directory & relay channel; it must be called with rec_lock held
+ */
+static int create_recorder(void)
+{
+    rec_dir = debugfs_create_dir(RECORDER_DIR_NAME, NULL);
+    if (IS_ERR_OR_NULL(rec_dir)) {
+        pr_loc_err("Failed to create debugfs directory " RECORDER_DIR_NAME);
+        rec_dir = NULL;
+        return -ENOENT;
+    }
+
+    if (IS_ERR_OR_NULL(debugfs_create_file("enabled", 0600, rec_dir, NULL, &enabled_fops))) {
+        pr_loc_err("Failed to create debugfs file " RECORDER_DIR_NAME "/enabled");
+        goto error_dir;
+    }
+
+    rec_chan = relay_open(RECORDER_TRACE_NAME, rec_dir, VUART_RECORDER_SUBBUF_LEN, VUART_RECORDER_SUBBUF_NUM,
+                          &rec_relay_callbacks, NULL);
+    if (!rec_chan) {
+        pr_loc_err("Failed to open relay channel for vUART recorder");
+        goto error_dir;
+    }
+
+    pr_loc_dbg("vUART recorder available in debugfs under " RECORDER_DIR_NAME);
+    return 0;
+
+    error_dir:
+    debugfs_remove_recursive(rec_dir);
+    rec_dir = NULL;
+    return -ENOENT;
+}
+
+/**
+ * Reverses what create_recorder() did; it must be called with rec_lock held and no lines attached
+ */
+static void destroy_recorder(void)
+{
+    vuart_recording = false;
+    relay_close(rec_chan);
+    rec_chan = NULL;
+    debugfs_remove_recursive(rec_dir);
+    rec_dir = NULL;
+    pr_loc_dbg("vUART recorder removed");
+}
+
+/************************************************** Public interface **************************************************/
+int vuart_recorder_add(struct serial8250_16550A_vdev *vdev)
+{
+    int out = 0;
+
+    mutex_lock(&rec_lock);
+    if (unlikely(rec_vdevs[vdev->line])) {
+        pr_loc_bug("Recorder for ttyS%d is already added", vdev->line);
+        out = -EEXIST;
+        goto out_unlock;
+    }
+
+    if (rec_users == 0 && (out = create_recorder()) != 0)
+        goto out_unlock;
+
+    rec_vdevs[vdev->line] = vdev;
+    rec_subs[vdev->line].drain_fn = rec_tx_drain;
+    rec_subs[vdev->line].threshold = 1;
+    if (vuart_recording)
+        subscribe_line(vdev->line); //not fatal - only this line will not be recorded (it will log what's wrong)
+    ++rec_users;
+
+    out_unlock:
+    mutex_unlock(&rec_lock);
+    return out;
+}
+
+int vuart_recorder_remove(struct serial8250_16550A_vdev *vdev)
+{
+    mutex_lock(&rec_lock);
+    if (unlikely(!rec_vdevs[vdev->line])) {
+        pr_loc_dbg("No recorder for ttyS%d - nothing to remove", vdev->line);
+        mutex_unlock(&rec_lock);
+        return 0;
+    }
+
+    unsubscribe_line(vdev->line);
+    rec_vdevs[vdev->line] = NULL;
+    if (--rec_users == 0)
+        destroy_recorder();
+    mutex_unlock(&rec_lock);
+
+    return 0;
+}
+
+#endif //VUART_RECORDER_SUPPORTED
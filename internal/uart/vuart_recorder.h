@@ -0,0 +1,64 @@
+/**
+ * Binary traffic recorder for vUART lines
+ *
+ * Debugging conversations on a vUART (e.g. with the PMU) with VUART_DEBUG_LOG is only viable on a debug build as it
+ * printk()s every register access. The recorder is meant to be always available and cheap enough to be left on: it
+ * stores fixed-size timestamped events (see struct vuart_rec_event) in per-CPU relay buffers exported via debugfs:
+ *
+ *   /sys/kernel/debug/vuart/enabled  - write 1/0 to start/stop recording (all lines are recorded)
+ *   /sys/kernel/debug/vuart/traceN   - events recorded on CPU N; read them with e.g. cat traceN > file
+ *
+ * Events from different CPUs should be merged by their timestamp (which comes from local_clock()). TX data is captured
+ * as a TX subscriber (see vuart_subscribe_tx()) which is attached only while the recording is enabled, RX data is
+ * captured as it's injected, and IIR events are emitted every time the interrupt state of a line changes. When the
+ * userspace doesn't keep up with reading the buffers new events are dropped.
+ *
+ * The recorder is only available in the stealth mode of STEALTH_MODE_BASIC or lower, on kernels with relay & debugfs.
+ * It can also be disabled by defining VUART_DISABLE_RECORDER.
+ */
+#ifndef REDPILL_VUART_RECORDER_H
+#define REDPILL_VUART_RECORDER_H
+
+#include "../stealth.h" //STEALTH_MODE
+#include <linux/types.h> //__u8, __u64
+#include <linux/compiler.h> //unlikely()
+
+#define VUART_REC_DATA_LEN 20 //max bytes of data in a single event; longer chunks are split into multiple events
+
+typedef enum {
+    VUART_REC_TX = 1, //data sent by the application (aux = vuart_flush_reason)
+    VUART_REC_RX = 2, //data injected into the RX (aux = 0)
+    VUART_REC_IIR = 3, //interrupt state changed (data[0] = new IIR value, aux = previous IIR value)
+} vuart_rec_type;
+
+struct vuart_rec_event {
+    __u64 ts_ns; //local_clock() of the CPU recording the event
+    __u8 line;
+    __u8 type; //vuart_rec_type
+    __u8 len; //bytes used in data
+    __u8 aux; //type-specific, see vuart_rec_type
+    __u8 data[VUART_REC_DATA_LEN];
+} __packed;
+
+#if STEALTH_MODE <= STEALTH_MODE_BASIC && !defined(VUART_DISABLE_RECORDER) && defined(CONFIG_RELAY) && \
+    defined(CONFIG_DEBUG_FS)
+#define VUART_RECORDER_SUPPORTED
+
+struct serial8250_16550A_vdev;
+extern bool vuart_recording; //whether the recording is enabled (it's read without any locks on purpose)
+
+void __vuart_record(int line, vuart_rec_type type, u8 aux, const void *data, unsigned int len);
+int vuart_recorder_add(struct serial8250_16550A_vdev *vdev);
+int vuart_recorder_remove(struct serial8250_16550A_vdev *vdev);
+
+//Use this instead of __vuart_record() - it costs a single branch when the recording is disabled
+#define vuart_record(line, type, aux, data, len) \
+    do { if (unlikely(vuart_recording)) { __vuart_record(line, type, aux, data, len); } } while(0)
+
+#else //VUART_RECORDER_SUPPORTED
+#define vuart_record(line, type, aux, data, len) do { } while(0)
+#define vuart_recorder_add(dummy) (0)
+#define vuart_recorder_remove(dummy) ({ 0; }) //it's called as a statement so a plain (0) would warn
+#endif //VUART_RECORDER_SUPPORTED
+
+#endif //REDPILL_VUART_RECORDER_H
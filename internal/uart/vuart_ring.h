@@ -0,0 +1,251 @@
+/**
+ * Lock-free single-producer/single-consumer byte ring used as vUART chip FIFOs
+ *
+ * Originally the vUART used kfifo for its RX/TX FIFOs. While kfifo is lockless for a single reader & writer too, every
+ * access to it was done under the per-device spinlock (with IRQs disabled) one byte at a time. This structure is a
+ * minimal replacement which makes the data path safe without any locks as long as there's exactly ONE producer and
+ * exactly ONE consumer at a time. The vUART still serializes registers state (LSR, IIR etc.) with the vdev lock, but
+ * moving bytes in and out of FIFOs does not require it anymore.
+ *
+ * HOW IT WORKS?
+ * Both indexes are free-running (i.e. they're never wrapped, only masked when accessing the data) which makes
+ * distinguishing between full and empty trivial: head == tail is empty and head - tail == size is full. The head is
+ * written ONLY by the producer, the tail is written ONLY by the consumer. Data is published with a write barrier
+ * before moving the head, and a slot is released with a full barrier before moving the tail.
+ *
+ * RULES
+ *  - The size MUST be a power of 2 (hardware FIFOs always are anyway)
+ *  - Functions marked as "producer" can only be called by one context at a time (same for "consumer")
+ *  - vuart_ring_reset() is NOT thread-safe and can only be used when neither side is active (e.g. chip reset);
+ *    vuart_ring_discard() is the consumer-side equivalent which is safe to call at any time by the consumer
+ */
+#ifndef REDPILL_VUART_RING_H
+#define REDPILL_VUART_RING_H
+
+#include <linux/types.h> //u8, bool
+#include <linux/compiler.h> //ACCESS_ONCE() or READ_ONCE()/WRITE_ONCE()
+#include <linux/version.h> //KERNEL_VERSION()
+#include <linux/string.h> //memcpy()
+#include <asm/barrier.h> //smp_*mb()
+
+//ACCESS_ONCE() was replaced by READ_ONCE()/WRITE_ONCE() and later removed
+//See https://github.com/torvalds/linux/commit/230fa253df6352af12ad0a16128760b5cb3f92df
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+#define vuart_ring_load(var) ACCESS_ONCE(var)
+#define vuart_ring_store(var, val) (ACCESS_ONCE(var) = (val))
+#else
+#define vuart_ring_load(var) READ_ONCE(var)
+#define vuart_ring_store(var, val) WRITE_ONCE(var, val)
+#endif
+
+struct vuart_ring {
+    unsigned int head; //index of the next byte to be written; modified ONLY by the producer
+    unsigned int tail; //index of the next byte to be read; modified ONLY by the consumer
+    unsigned int mask; //size of the ring minus 1
+    u8 *data;
+};
+
+#define vuart_ring_size(ring) ((ring)->mask + 1)
+
+/**
+ * Number of bytes waiting in the ring (safe to call from either side; it can only be stale in the "safe" direction)
+ */
+static inline unsigned int vuart_ring_len(const struct vuart_ring *ring)
+{
+    return vuart_ring_load(ring->head) - vuart_ring_load(ring->tail);
+}
+
+static inline bool vuart_ring_is_empty(const struct vuart_ring *ring)
+{
+    return vuart_ring_load(ring->head) == vuart_ring_load(ring->tail);
+}
+
+static inline bool vuart_ring_is_full(const struct vuart_ring *ring)
+{
+    return vuart_ring_len(ring) > ring->mask;
+}
+
+/**
+ * Number of bytes which can be put into the ring (producer)
+ */
+static inline unsigned int vuart_ring_avail(const struct vuart_ring *ring)
+{
+    return vuart_ring_size(ring) - (ring->head - vuart_ring_load(ring->tail));
+}
+
+/**
+ * Puts a single byte into the ring (producer)
+ *
+ * @return 1 if the byte was put, 0 if the ring was full
+ */
+static inline unsigned int vuart_ring_put(struct vuart_ring *ring, u8 val)
+{
+    unsigned int head = ring->head;
+    if (unlikely(head - vuart_ring_load(ring->tail) > ring->mask))
+        return 0;
+
+    ring->data[head & ring->mask] = val;
+    smp_wmb(); //the byte must be visible before the consumer sees new head
+    vuart_ring_store(ring->head, head + 1);
+
+    return 1;
+}
+
+/**
+ * Gets a single byte from the ring (consumer)
+ *
+ * @return 1 if the byte was read, 0 if the ring was empty
+ */
+static inline unsigned int vuart_ring_get(struct vuart_ring *ring, u8 *val)
+{
+    unsigned int tail = ring->tail;
+    if (unlikely(vuart_ring_load(ring->head) == tail))
+        return 0;
+
+    smp_rmb(); //head must be read before the data it guards
+    *val = ring->data[tail & ring->mask];
+    smp_mb(); //the byte must be read before the producer can reuse the slot
+    vuart_ring_store(ring->tail, tail + 1);
+
+    return 1;
+}
+
+/**
+ * Copies as many bytes as possible from the buffer into the ring (producer)
+ *
+ * @return number of bytes copied (which may be less than len if the ring got full)
+ */
+static inline unsigned int vuart_ring_in(struct vuart_ring *ring, const void *buffer, unsigned int len)
+{
+    unsigned int head = ring->head;
+    unsigned int avail = vuart_ring_size(ring) - (head - vuart_ring_load(ring->tail));
+    if (len > avail)
+        len = avail;
+    if (unlikely(len == 0))
+        return 0;
+
+    unsigned int off = head & ring->mask;
+    unsigned int first = vuart_ring_size(ring) - off; //contiguous space till the end of the data buffer
+    if (first > len)
+        first = len;
+
+    memcpy(ring->data + off, buffer, first);
+    memcpy(ring->data, (const u8 *)buffer + first, len - first); //wrapped part (if any)
+    smp_wmb(); //see vuart_ring_put()
+    vuart_ring_store(ring->head, head + len);
+
+    return len;
+}
+
+/**
+ * Copies as many bytes as possible from the ring into a buffer (consumer)
+ *
+ * @return number of bytes copied (which may be less than len if the ring didn't contain enough data)
+ */
+static inline unsigned int vuart_ring_out(struct vuart_ring *ring, void *buffer, unsigned int len)
+{
+    unsigned int tail = ring->tail;
+    unsigned int used = vuart_ring_load(ring->head) - tail;
+    if (len > used)
+        len = used;
+    if (unlikely(len == 0))
+        return 0;
+
+    smp_rmb(); //see vuart_ring_get()
+    unsigned int off = tail & ring->mask;
+    unsigned int first = vuart_ring_size(ring) - off;
+    if (first > len)
+        first = len;
+
+    memcpy(buffer, ring->data + off, first);
+    memcpy((u8 *)buffer + first, ring->data, len - first);
+    smp_mb(); //see vuart_ring_get()
+    vuart_ring_store(ring->tail, tail + len);
+
+    return len;
+}
+
+/**
+ * Gives a read-only access to data waiting in the ring from a given position without consuming it (consumer)
+ *
+ * This is what vuart_ring_peek() does but it starts at any free-running index between the tail and the head. It's
+ * useful when there are multiple readers of the same data with their own positions (while only the slowest one moves
+ * the tail). A position outside of the data waiting in the ring (e.g. after the ring was discarded) is treated as the
+ * tail.
+ *
+ * @return total number of bytes available in both segments
+ */
+static inline unsigned int vuart_ring_peek_from(const struct vuart_ring *ring, unsigned int from, const u8 **seg1,
+                                                unsigned int *seg1_len, const u8 **seg2, unsigned int *seg2_len)
+{
+    unsigned int tail = ring->tail;
+    unsigned int head = vuart_ring_load(ring->head);
+    smp_rmb(); //see vuart_ring_get()
+
+    if (head - from > head - tail) //"from" is before the tail or after the head
+        from = tail;
+
+    unsigned int used = head - from;
+    unsigned int off = from & ring->mask;
+    unsigned int first = vuart_ring_size(ring) - off;
+    if (first > used)
+        first = used;
+
+    *seg1 = ring->data + off;
+    *seg1_len = first;
+    *seg2 = ring->data;
+    *seg2_len = used - first;
+
+    return used;
+}
+
+/**
+ * Gives a read-only access to data waiting in the ring without consuming it (consumer)
+ *
+ * Since the data may wrap around the end of the buffer it's returned as up to two contiguous segments, which should be
+ * read in order (seg1 then seg2). When data doesn't wrap seg2_len will be 0. Pointers stay valid until the consumer
+ * calls vuart_ring_skip() (or any other consumer function).
+ *
+ * @return total number of bytes available in both segments
+ */
+static inline unsigned int vuart_ring_peek(const struct vuart_ring *ring, const u8 **seg1, unsigned int *seg1_len,
+                                           const u8 **seg2, unsigned int *seg2_len)
+{
+    return vuart_ring_peek_from(ring, ring->tail, seg1, seg1_len, seg2, seg2_len);
+}
+
+/**
+ * Marks bytes obtained with vuart_ring_peek() as consumed (consumer)
+ *
+ * @param len number of bytes to release; it will be capped at the number of bytes in the ring
+ */
+static inline void vuart_ring_skip(struct vuart_ring *ring, unsigned int len)
+{
+    unsigned int tail = ring->tail;
+    unsigned int used = vuart_ring_load(ring->head) - tail;
+    if (len > used)
+        len = used;
+
+    smp_mb(); //see vuart_ring_get()
+    vuart_ring_store(ring->tail, tail + len);
+}
+
+/**
+ * Drops everything currently in the ring (consumer)
+ */
+static inline void vuart_ring_discard(struct vuart_ring *ring)
+{
+    smp_mb();
+    vuart_ring_store(ring->tail, vuart_ring_load(ring->head));
+}
+
+/**
+ * Resets both indexes of the ring; NOT safe to use while the ring is in use by anybody (see header comment)
+ */
+static inline void vuart_ring_reset(struct vuart_ring *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+#endif //REDPILL_VUART_RING_H
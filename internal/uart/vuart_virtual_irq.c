@@ -3,17 +3,224 @@
 #include "vuart_virtual_irq.h"
 #include "vuart_internal.h"
 #include "../../common.h"
+#include "../../config/uart_defs.h" //UART_NR
 #include "../../debug/debug_vuart.h"
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/kthread.h> //running vIRQ thread
-#include <linux/wait.h> //wait queue handling (init_waitqueue_head etc.)
+#include <linux/sched.h> //cond_resched()
+#include <linux/wait.h> //wait queue handling (DECLARE_WAIT_QUEUE_HEAD etc.)
+#include <linux/bitops.h> //set_bit, test_and_set_bit, xchg()
+#include <linux/mutex.h> //DEFINE_MUTEX
+#include <linux/spinlock.h> //DEFINE_SPINLOCK
+#include <linux/atomic.h> //atomic_t for virq_dispatch_refs
+#include <linux/hrtimer.h> //polling mode timer
 #include <linux/serial_8250.h> //serial8250_handle_irq
 
-//Default name of the thread for vIRQ
+//Default name of the thread for vIRQ; it gets IRQ# and ttyS# of the port which started it (as the thread is shared by
+// all ports the format should rather not use them, but it can to look like a real IRQ thread)
 #ifndef VUART_THREAD_FMT
-#define VUART_THREAD_FMT "vuart/%d-ttyS%d"
+#define VUART_THREAD_FMT "vuart/virq"
 #endif
 
+//Mode in which vIRQs are delivered after loading; it can be changed at runtime with vuart_set_irq_mode()
+#ifndef VUART_DEFAULT_IRQ_MODE
+#define VUART_DEFAULT_IRQ_MODE VUART_IRQ_THREAD
+#endif
+
+//Polling mode interval bounds: it's tightened to the minimum when there's traffic and doubled on every idle poll
+#ifndef VUART_POLL_MIN_NS
+#define VUART_POLL_MIN_NS (250 * NSEC_PER_USEC)
+#endif
+#ifndef VUART_POLL_MAX_NS
+#define VUART_POLL_MAX_NS (20 * NSEC_PER_MSEC)
+#endif
+
+/*
+ * All vUARTs share a single vIRQ dispatcher thread. Every port which has something to say sets its bit in the
+ * virq_pending bitmap and wakes the thread up (unless its bit was already set - then the thread is going to look at the
+ * port anyway). The thread grabs the whole bitmap at once and calls the 8250 interrupt handler for every port which
+ * still has an interrupt pending. This way multiple IIR changes on a port (e.g. when the driver reads registers from
+ * the interrupt handler) are coalesced into a single handler call and we don't need a thread per port.
+ *
+ * Alternatively (see vuart_set_irq_mode()) the thread can be replaced by a shared hrtimer which polls all ports. The
+ * polling interval adapts to the traffic: every poll which found nothing doubles it (up to VUART_POLL_MAX_NS) while
+ * any activity (or a trigger) brings it back to VUART_POLL_MIN_NS. This way latency isn't bound to jiffies (like with
+ * the 8250 timer, see VUART_USE_TIMER_FALLBACK) and idle ports cost almost nothing.
+ *
+ * The thread (or the timer) is started when the first port is prepared (see vuart_virq_prepare()) and stopped when
+ * the last one is released. Everything is static so enabling/disabling interrupts of a port never allocates anything.
+ *
+ * virq_vdevs are modified only with both virq_config_lock & virq_dispatch_lock held. The dispatcher holds
+ * virq_dispatch_lock only to take a snapshot of ports to service (it's a spinlock as the polling timer dispatches from a
+ * hardirq context) and calls handlers without it - they can take a while and the thread shouldn't keep IRQs disabled.
+ * To make sure a port isn't disabled under the dispatcher's feet every snapshot holds a reference (virq_dispatch_refs)
+ * until its handlers return. Disabling a port removes it from virq_vdevs and waits for all references taken before.
+ */
+static DECLARE_BITMAP(virq_pending, UART_NR);
+static DECLARE_WAIT_QUEUE_HEAD(virq_queue);
+static struct serial8250_16550A_vdev *virq_vdevs[UART_NR] = { NULL };
+static unsigned int virq_users = 0; //number of prepared ports
+static struct task_struct *virq_dispatcher = NULL;
+static int virq_name_irq, virq_name_line; //params for VUART_THREAD_FMT (of the port which prepared vIRQ first)
+static vuart_irq_mode virq_mode = VUART_DEFAULT_IRQ_MODE; //modified with virq_config_lock held
+static DEFINE_MUTEX(virq_config_lock); //serializes prepare/release/enable/disable/mode changes
+static DEFINE_SPINLOCK(virq_dispatch_lock); //protects virq_vdevs & taking virq_dispatch_refs
+static atomic_t virq_dispatch_refs = ATOMIC_INIT(0); //number of snapshots of virq_vdevs with handlers still running
+static DECLARE_WAIT_QUEUE_HEAD(virq_dispatch_wait); //woken up when virq_dispatch_refs drops to 0
+
+//Polling mode state; the timer is (re)armed only with virq_poll_lock held (see poll_timer_fired() for details)
+static struct hrtimer virq_poll_timer;
+static bool virq_polling = false;
+static u64 virq_poll_interval_ns = VUART_POLL_MIN_NS;
+static DEFINE_SPINLOCK(virq_poll_lock);
+
+#define has_pending_virq() (!bitmap_empty(virq_pending, UART_NR))
+
+/**
+ * Makes the polling timer fire after VUART_POLL_MIN_NS (if it wasn't going to fire sooner anyway)
+ */
+static void kick_poll_timer(void)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&virq_poll_lock, flags);
+    if (likely(virq_polling) && virq_poll_interval_ns > VUART_POLL_MIN_NS) {
+        virq_poll_interval_ns = VUART_POLL_MIN_NS;
+        hrtimer_start(&virq_poll_timer, ns_to_ktime(VUART_POLL_MIN_NS), HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&virq_poll_lock, flags);
+}
+
+void vuart_virq_trigger(struct serial8250_16550A_vdev *vdev)
+{
+    //If the bit was already set the dispatcher was woken up already and didn't get to this port yet
+    if (test_and_set_bit(vdev->line, virq_pending))
+        return;
+
+    if (virq_mode == VUART_IRQ_POLL)
+        kick_poll_timer();
+    else
+        wake_up_interruptible(&virq_queue);
+}
+
+/**
+ * Calls 8250 interrupt routine for all ports which requested it (see comment above virq_pending)
+ *
+ * @param poll_all whether ports which didn't request it should be checked too
+ *
+ * @return whether any handler was called
+ */
+static bool dispatch_pending_virqs(bool poll_all)
+{
+    DECLARE_BITMAP(pending, UART_NR);
+    struct serial8250_16550A_vdev *vdevs[UART_NR];
+    unsigned long flags;
+    bool handled = false;
+    int line;
+
+    //Taking the snapshot must clear the bits atomically - any port triggering from now on will wake us up again
+    for (int i = 0; i < BITS_TO_LONGS(UART_NR); ++i)
+        pending[i] = xchg(&virq_pending[i], 0);
+
+    if (poll_all)
+        bitmap_fill(pending, UART_NR);
+
+    //Ports are only snapshotted under the lock; the reference keeps them from being disabled until we're done
+    spin_lock_irqsave(&virq_dispatch_lock, flags);
+    for_each_set_bit(line, pending, UART_NR)
+        vdevs[line] = virq_vdevs[line];
+    atomic_inc(&virq_dispatch_refs);
+    spin_unlock_irqrestore(&virq_dispatch_lock, flags);
+
+    for_each_set_bit(line, pending, UART_NR) {
+        struct serial8250_16550A_vdev *vdev = vdevs[line];
+        if (unlikely(!vdev))
+            continue; //port was disabled after triggering
+
+        //The interrupt may have been already serviced while handling a previous trigger (e.g. the driver read RHR)
+        if (vdev->iir & UART_IIR_NO_INT)
+            continue;
+
+        if (unlikely(!vdev->up)) {
+            pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
+            continue;
+        }
+
+        //Like a real 8250 IRQ handler we read IIR through the port (and not peek at it) as some interrupts (e.g. THRI)
+        // are cleared by reading IIR
+        unsigned int iir = vdev->up->serial_in(vdev->up, UART_IIR);
+        if (iir & UART_IIR_NO_INT)
+            continue;
+
+        uart_prdbg("Calling serial8250 interrupt handler for ttyS%d", line);
+        serial8250_handle_irq(vdev->up, iir);
+        handled = true;
+
+        //Triggers are edge-based (see update_interrupts_state()), so if the handler didn't service everything (e.g.
+        // it stopped after reading a batch of characters) there will be no new trigger - the port must be looked at
+        // again. Setting the bit is enough as we're the dispatcher (and poll_timer_fired() checks it too).
+        if (!(vdev->iir & UART_IIR_NO_INT))
+            set_bit(line, virq_pending);
+    }
+
+    if (atomic_dec_and_test(&virq_dispatch_refs))
+        wake_up(&virq_dispatch_wait);
+
+    return handled;
+}
+
+/**
+ * Polling mode timer callback (see comment above virq_pending)
+ *
+ * The timer is never restarted by returning HRTIMER_RESTART but re-armed with hrtimer_start() under virq_poll_lock.
+ * This is deliberate: kick_poll_timer() can re-arm it concurrently (e.g. from within the handler we call here) and
+ * starting a timer which is about to be restarted by its callback is a BUG() on older kernels.
+ */
+static enum hrtimer_restart poll_timer_fired(struct hrtimer *timer)
+{
+    bool handled = dispatch_pending_virqs(true);
+    unsigned long flags;
+
+    spin_lock_irqsave(&virq_poll_lock, flags);
+    if (unlikely(!virq_polling))
+        goto out_unlock;
+
+    //A trigger which came after we took the snapshot has its bit set - it must not wait for the backed off interval
+    if (handled || has_pending_virq())
+        virq_poll_interval_ns = VUART_POLL_MIN_NS;
+    else if (virq_poll_interval_ns < VUART_POLL_MAX_NS)
+        virq_poll_interval_ns = min_t(u64, virq_poll_interval_ns * 2, VUART_POLL_MAX_NS);
+
+    hrtimer_start(&virq_poll_timer, ns_to_ktime(virq_poll_interval_ns), HRTIMER_MODE_REL);
+
+    out_unlock:
+    spin_unlock_irqrestore(&virq_poll_lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+static void start_polling(void)
+{
+    unsigned long flags;
+
+    pr_loc_dbg("Starting vIRQ polling");
+    spin_lock_irqsave(&virq_poll_lock, flags);
+    virq_polling = true;
+    virq_poll_interval_ns = VUART_POLL_MIN_NS;
+    hrtimer_start(&virq_poll_timer, ns_to_ktime(VUART_POLL_MIN_NS), HRTIMER_MODE_REL);
+    spin_unlock_irqrestore(&virq_poll_lock, flags);
+}
+
+static void stop_polling(void)
+{
+    unsigned long flags;
+
+    pr_loc_dbg("Stopping vIRQ polling");
+    spin_lock_irqsave(&virq_poll_lock, flags);
+    virq_polling = false; //the callback will not re-arm the timer anymore...
+    spin_unlock_irqrestore(&virq_poll_lock, flags);
+    hrtimer_cancel(&virq_poll_timer); //...so that this can actually finish
+}
+
 /**
  * Function running on a separate kernel thread responsible for simulating the IRQ call (normally done via hardware
  * interrupt triggering CPU to invoke Linux IRQ subsystem)
@@ -21,143 +228,226 @@
  * There's no sane way to trigger IRQs in the low range used by 8250 UARTs. A pure asm call of "int $4" will result in a
  * crash (yes, we did try first ;)). So instead of hacking around the kernel we simply used the 8250 public interface to
  * trigger interrupt routines and implemented a small IRQ handling subsystem on our own.
- * @param data
- * @return
  */
 static int virq_thread(void *data)
 {
-    allow_signal(SIGKILL);
+    uart_prdbg("%s started pid=%d", __FUNCTION__, current->pid);
+    while(likely(!kthread_should_stop())) {
+        wait_event_interruptible(virq_queue, has_pending_virq() || unlikely(kthread_should_stop()));
+        if (unlikely(kthread_should_stop()))
+            break;
+
+        dispatch_pending_virqs(false);
+        cond_resched(); //ports re-raised by the dispatcher are handled without sleeping - don't hog the CPU
+    }
+    uart_prdbg("%s stopped pid=%d", __FUNCTION__, current->pid);
+
+    return 0;
+}
 
+static int start_dispatcher_thread(void)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-extra-args"
+    //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#
+    struct task_struct *thread = kthread_run(virq_thread, NULL, VUART_THREAD_FMT, virq_name_irq, virq_name_line);
+#pragma GCC diagnostic pop
+    if (IS_ERR(thread)) {
+        pr_loc_bug("Failed to start vIRQ thread");
+        return PTR_ERR(thread);
+    }
+
+    virq_dispatcher = thread;
+    return 0;
+}
+
+static void stop_dispatcher_thread(void)
+{
+    kthread_stop(virq_dispatcher);
+    virq_dispatcher = NULL;
+}
+
+/**
+ * Starts whatever delivers vIRQs in the current mode; it must be called with virq_config_lock held
+ */
+static int start_delivery(void)
+{
+    if (virq_mode == VUART_IRQ_POLL) {
+        start_polling();
+        return 0;
+    }
+
+    return start_dispatcher_thread();
+}
+
+/**
+ * Reverses what start_delivery() did; it must be called with virq_config_lock held
+ */
+static void stop_delivery(void)
+{
+    if (virq_mode == VUART_IRQ_POLL)
+        stop_polling();
+    else if (virq_dispatcher)
+        stop_dispatcher_thread();
+}
+
+int vuart_virq_prepare(struct serial8250_16550A_vdev *vdev)
+{
     int out = 0;
-    struct serial8250_16550A_vdev *vdev = data;
+    pr_loc_dbg("Preparing vIRQ for ttyS%d", vdev->line);
 
-    uart_prdbg("%s started for ttyS%d pid=%d", __FUNCTION__, vdev->line, current->pid);
-    while(likely(!kthread_should_stop())) {
-        wait_event_interruptible(*vdev->virq_queue, !(vdev->iir & UART_IIR_NO_INT) || unlikely(kthread_should_stop()));
-        if (unlikely(signal_pending(current))) {
-            uart_prdbg("%s started for ttyS%d pid=%d received signal", __FUNCTION__, vdev->line, current->pid);
-            out = -EPIPE;
-            break;
-        }
+    mutex_lock(&virq_config_lock);
+    //The dispatcher is started with the first port and shared by all ports prepared later
+    if (virq_users == 0) {
+        hrtimer_init(&virq_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL); //it's not active so re-init is safe
+        virq_poll_timer.function = poll_timer_fired;
+        virq_name_irq = vdev->irq;
+        virq_name_line = vdev->line;
 
-        if (unlikely(kthread_should_stop()))
-            break;
+        if ((out = start_delivery()) != 0)
+            goto out_unlock;
+    }
+    ++virq_users;
 
-        if (unlikely(!vdev->up)) {
-            pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
-            continue;
-        }
+    out_unlock:
+    mutex_unlock(&virq_config_lock);
+    return out;
+}
 
-        uart_prdbg("Calling serial8250 interrupt handler");
-        serial8250_handle_irq(vdev->up, vdev->iir);
+int vuart_virq_release(struct serial8250_16550A_vdev *vdev)
+{
+    pr_loc_dbg("Releasing vIRQ for ttyS%d", vdev->line);
+
+    mutex_lock(&virq_config_lock);
+    if (unlikely(virq_users == 0)) {
+        pr_loc_bug("vIRQ for ttyS%d was not prepared", vdev->line);
+        mutex_unlock(&virq_config_lock);
+        return -EINVAL;
     }
-    uart_prdbg("%s stopped for ttyS%d pid=%d exit=%d", __FUNCTION__, vdev->line, current->pid, out);
 
-    //that can lead to a small memory leak for virq_queue if thread is killed outisde disable_interrupts() but this
-    // shouldn't normally happen unless something goes horribly wrong
-    vdev->virq_thread = NULL;
+    //Last port gone - there's no point in keeping the thread (or timer) around
+    if (--virq_users == 0)
+        stop_delivery();
+    mutex_unlock(&virq_config_lock);
+
+    return 0;
+}
+
+int vuart_virq_set_mode(vuart_irq_mode mode)
+{
+    int out = 0;
+
+    if (unlikely(mode != VUART_IRQ_THREAD && mode != VUART_IRQ_POLL)) {
+        pr_loc_bug("Invalid vIRQ mode %d", mode);
+        return -EINVAL;
+    }
+
+    mutex_lock(&virq_config_lock);
+    if (mode == virq_mode)
+        goto out_unlock;
+
+    //Nothing runs yet - the new mode will be used by vuart_virq_prepare()
+    if (virq_users == 0) {
+        virq_mode = mode;
+        goto out_unlock;
+    }
+
+    //The new mechanism is started before the old one is stopped (so no trigger is lost in between). Both can dispatch
+    // at the same time without harm as 8250 interrupt handler serializes itself with the port lock.
+    if (mode == VUART_IRQ_POLL) {
+        start_polling();
+        virq_mode = mode;
+        stop_dispatcher_thread();
+    } else {
+        if ((out = start_dispatcher_thread()) != 0)
+            goto out_unlock;
+        virq_mode = mode;
+        stop_polling();
+        wake_up_interruptible(&virq_queue); //something could have been triggered while we were switching
+    }
+
+    out_unlock:
+    mutex_unlock(&virq_config_lock);
+    pr_loc_dbg("vIRQ mode set to %s", mode == VUART_IRQ_POLL ? "polling" : "thread");
 
     return out;
 }
 
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
 {
-    int out, kmc;
-    kmc = 0;
-
-retry:
+    unsigned long flags;
+    int out = 0;
     pr_loc_dbg("Enabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
 
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
-        out = -ENODEV;
-        goto error_unlock_free;
+        return -ENODEV;
     }
 
+    mutex_lock(&virq_config_lock);
     if (unlikely(vuart_virq_active(vdev))) {
         pr_loc_bug("Interrupts are already enabled & scheduled for ttyS%d", vdev->line);
         out = -EBUSY;
-        goto error_unlock_free;
-    }
-
-    // by jim3ma: fix kernel warning log "BUG: sleeping function called from invalid context at mm/slab.h"
-    if (!(vdev->virq_queue = kmalloc(sizeof(wait_queue_head_t), GFP_ATOMIC)) ||
-        !(vdev->virq_thread = kmalloc(sizeof(struct task_struct), GFP_ATOMIC))) {
-        if (kmc == 10) {
-            out = -ENOMEM;
-            pr_loc_crt("kernel memory alloc failure - tried to reserve memory for vIRQ structures");
-            goto error_unlock_free;
-        } else {
-            unlock_vuart(vdev);
-            kmc ++;
-            goto retry;
-        }
+        goto out_unlock;
     }
 
-    init_waitqueue_head(vdev->virq_queue);
-    unlock_vuart(vdev); //we can safely unlock after reserving memory but before starting thread (so we're not atomic)
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-extra-args"
-    //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#
-    vdev->virq_thread = kthread_run(virq_thread, vdev, VUART_THREAD_FMT, vdev->irq, vdev->line);
-#pragma GCC diagnostic pop
-    if (IS_ERR(vdev->virq_thread)) {
-        out = PTR_ERR(vdev->virq_thread);
-        pr_loc_bug("Failed to start vIRQ thread");
-        goto error_free;
+    if (unlikely(virq_users == 0)) {
+        pr_loc_bug("Cannot enable vIRQ for ttyS%d - it wasn't prepared", vdev->line);
+        out = -EINVAL;
+        goto out_unlock;
     }
-    pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
 
-    return 0;
+    spin_lock_irqsave(&virq_dispatch_lock, flags);
+    virq_vdevs[vdev->line] = vdev;
+    spin_unlock_irqrestore(&virq_dispatch_lock, flags);
 
-error_unlock_free:
+    lock_vuart(vdev);
+    vdev->virq_active = true;
+    if (!(vdev->iir & UART_IIR_NO_INT)) //something could have happened before vIRQ was enabled
+        vuart_virq_trigger(vdev);
     unlock_vuart(vdev);
 
-error_free:
-    if (vdev->virq_queue) {
-        kfree(vdev->virq_queue);
-        vdev->virq_queue = NULL;
-    }
-    if (vdev->virq_thread) {
-        kfree(vdev->virq_thread);
-        vdev->virq_thread = NULL;
-    }
+    pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
+
+    out_unlock:
+    mutex_unlock(&virq_config_lock);
     return out;
 }
 
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
 {
-    int out;
+    unsigned long flags;
+    int out = 0;
     pr_loc_dbg("Disabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
 
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
-        out = -ENODEV;
-        goto out_unlock;
+        return -ENODEV;
     }
 
+    mutex_lock(&virq_config_lock);
     if (unlikely(!vuart_virq_active(vdev))) {
         pr_loc_bug("Interrupts are not enabled/scheduled for ttyS%d", vdev->line);
         out = -EBUSY;
         goto out_unlock;
     }
 
-    out = kthread_stop(vdev->virq_thread);
-    if (out < 0) {
-        pr_loc_bug("Failed to stop vIRQ thread");
-        goto out_unlock;
-    }
+    lock_vuart(vdev);
+    vdev->virq_active = false; //no new triggers from now on...
+    unlock_vuart(vdev);
+
+    spin_lock_irqsave(&virq_dispatch_lock, flags); //...no new snapshots with the port from now on...
+    virq_vdevs[vdev->line] = NULL;
+    clear_bit(vdev->line, virq_pending);
+    spin_unlock_irqrestore(&virq_dispatch_lock, flags);
+
+    //...and once all snapshots taken before are done the dispatcher isn't touching the port
+    wait_event(virq_dispatch_wait, atomic_read(&virq_dispatch_refs) == 0);
 
-    kfree(vdev->virq_thread);
-    vdev->virq_thread = NULL;
     pr_loc_dbg("vIRQ disabled for ttyS%d", vdev->line);
 
     out_unlock:
-    unlock_vuart(vdev);
-
-    return 0;
+    mutex_unlock(&virq_config_lock);
+    return out;
 }
-#endif
\ No newline at end of file
+#endif
@@ -4,17 +4,41 @@
 #ifdef VUART_USE_TIMER_FALLBACK
 #define vuart_virq_supported() 0
 #define vuart_virq_wake_up(dummy) //noop
+#define vuart_virq_prepare(dummy) (0)
+#define vuart_virq_release(dummy) ({ 0; }) //it's also called as a statement so a plain (0) would warn
 #define vuart_enable_interrupts(dummy) (0)
 #define vuart_disable_interrupts(dummy) (0)
+#define vuart_virq_set_mode(dummy) (-EOPNOTSUPP)
 
 #else //VUART_USE_TIMER_FALLBACK
 #include "vuart_internal.h"
 
 #define vuart_virq_supported() 1
-#define vuart_virq_active(vdev) (!!(vdev)->virq_thread)
-#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { wake_up_interruptible(vdev->virq_queue); }
+#define vuart_virq_active(vdev) ((vdev)->virq_active)
+#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { vuart_virq_trigger(vdev); }
+
+/**
+ * Marks the port as having an interrupt pending and wakes up the shared vIRQ dispatcher (if needed)
+ *
+ * It's safe to call from any context, including with the vdev lock held.
+ */
+void vuart_virq_trigger(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Reserves everything needed to deliver vIRQs to a port (i.e. the shared dispatcher thread)
+ *
+ * It must be called (in a sleepable context) before vuart_enable_interrupts() and balanced with vuart_virq_release()
+ * once interrupts are disabled. After this vuart_enable_interrupts() & vuart_disable_interrupts() do not allocate.
+ */
+int vuart_virq_prepare(struct serial8250_16550A_vdev *vdev);
+int vuart_virq_release(struct serial8250_16550A_vdev *vdev);
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev);
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Switches the way vIRQs are delivered to all ports, see vuart_set_irq_mode()
+ */
+int vuart_virq_set_mode(vuart_irq_mode mode);
 #endif //VUART_USE_TIMER_FALLBACK
 
 #endif //REDPILL_VUART_VIRTUAL_IRQ_H
\ No newline at end of file
@@ -11,9 +11,11 @@
 #include "shim/disable_exectutables.h" //Disable common problematic executables
 #include "shim/pci_shim.h" //Handles PCI devices emulation
 #include "shim/storage/smart_shim.h" //Handles emulation of SMART data for devices without it
+#include "shim/storage/nvme_smart_shim.h" //Provides ATA SMART for NVMe namespaces
 #include "shim/storage/sata_port_shim.h" //Handles VirtIO & SAS storage devices/disks peculiarities
 #include "shim/uart_fixer.h" //Various fixes for UART weirdness
 #include "shim/pmu_shim.h" //Emulates the platform management unit
+#include "internal/uart/virtual_uart.h" //vuart_set_irq_mode()
 #include "internal/helper/symbol_helper.h" //kln_func
 
 //Handle versioning stuff
@@ -60,7 +62,9 @@ static int __init init_(void)
 #ifndef DBG_DISABLE_UNLOADABLE
          || (out = register_pci_shim(current_config.hw_config)) != 0 //it's a core hw but it's not checked early
 #endif
-         || (out = register_disk_smart_shim()) != 0 //provide fake SMART to userspace
+         || (out = register_disk_smart_shim(&current_config.smart_sleep)) != 0 //provide fake SMART to userspace
+         || (out = register_nvme_smart_shim()) != 0 //after disk SMART shim (uses its emulation); failures are non-fatal
+         || (current_config.vuart_irq.configured && (out = vuart_set_irq_mode(current_config.vuart_irq.mode)) != 0)
          || (out = register_pmu_shim(current_config.hw_config)) != 0 //this is used as early as mfgBIOS loads (=late)
          || (out = initialize_stealth(&current_config)) != 0 //Should be after any shims to let shims have real stuff
        )
@@ -87,6 +91,7 @@ static void __exit cleanup_(void)
     int (*cleanup_handlers[])(void ) = {
         uninitialize_stealth,
         unregister_pmu_shim,
+        unregister_nvme_smart_shim,
         unregister_disk_smart_shim,
 #ifndef DBG_DISABLE_UNLOADABLE
         unregister_pci_shim,
@@ -0,0 +1,155 @@
+#include "pmu_state.h"
+#include "../../common.h"
+#include <linux/mutex.h> //DEFINE_MUTEX
+#include <linux/kobject.h> //kobject_create_and_add(), kernel_kobj, struct kobj_attribute
+#include <linux/sysfs.h> //sysfs_create_group(), sysfs_notify()
+
+#ifndef PMU_SYSFS_NAME //name of the directory in /sys/kernel
+#define PMU_SYSFS_NAME "vpmu"
+#endif
+#define PMU_STATE_UNKNOWN "unknown"
+
+struct pmu_state_value {
+    const char *name; //name of the sysfs attribute
+    bool event; //notify on every set, even if the value didn't change
+    char value[PMU_STATE_VALUE_MAX + 1];
+};
+
+#define DEFINE_PMU_STATE(attr_id, attr_name) [PMU_STATE_ ## attr_id] = { .name = attr_name }
+#define DEFINE_PMU_STATE_EVENT(attr_id, attr_name) [PMU_STATE_ ## attr_id] = { .name = attr_name, .event = true }
+static struct pmu_state_value pmu_state[PMU_STATE__CNT] = {
+    DEFINE_PMU_STATE(POWER, "power"),
+    DEFINE_PMU_STATE(PWR_LED, "pwr_led"),
+    DEFINE_PMU_STATE(STATUS_LED, "status_led"),
+    DEFINE_PMU_STATE(USB_LED, "usb_led"),
+    DEFINE_PMU_STATE(10G_LED, "10g_led"),
+    DEFINE_PMU_STATE(ALARM_LED, "alarm_led"),
+    DEFINE_PMU_STATE_EVENT(BUZZER, "buzzer"),
+    DEFINE_PMU_STATE(PWM_CYCLE, "pwm_cycle"),
+    DEFINE_PMU_STATE(PWM_HZ, "pwm_hz"),
+    DEFINE_PMU_STATE(WOL, "wol"),
+    DEFINE_PMU_STATE(SCHED_UP, "sched_up"),
+    DEFINE_PMU_STATE(FAN_HEALTH, "fan_health"),
+};
+static DEFINE_MUTEX(pmu_state_lock); //protects values in pmu_state
+
+#ifdef PMU_STATE_SYSFS_SUPPORTED
+static struct kobject *pmu_kobj = NULL;
+
+static ssize_t pmu_state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+
+#define PMU_STATE_KOBJ_ATTR(attr_id) \
+    [PMU_STATE_ ## attr_id] = { .attr = { .mode = S_IRUGO }, .show = pmu_state_show }
+static struct kobj_attribute pmu_kobj_attrs[PMU_STATE__CNT] = {
+    PMU_STATE_KOBJ_ATTR(POWER),
+    PMU_STATE_KOBJ_ATTR(PWR_LED),
+    PMU_STATE_KOBJ_ATTR(STATUS_LED),
+    PMU_STATE_KOBJ_ATTR(USB_LED),
+    PMU_STATE_KOBJ_ATTR(10G_LED),
+    PMU_STATE_KOBJ_ATTR(ALARM_LED),
+    PMU_STATE_KOBJ_ATTR(BUZZER),
+    PMU_STATE_KOBJ_ATTR(PWM_CYCLE),
+    PMU_STATE_KOBJ_ATTR(PWM_HZ),
+    PMU_STATE_KOBJ_ATTR(WOL),
+    PMU_STATE_KOBJ_ATTR(SCHED_UP),
+    PMU_STATE_KOBJ_ATTR(FAN_HEALTH),
+};
+static struct attribute *pmu_attrs[PMU_STATE__CNT + 1] = { NULL }; //populated in pmu_state_register()
+static struct attribute_group pmu_attr_group = {
+    .attrs = pmu_attrs,
+};
+
+static ssize_t pmu_state_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t out;
+
+    mutex_lock(&pmu_state_lock);
+    out = sprintf(buf, "%s\n", pmu_state[attr - pmu_kobj_attrs].value);
+    mutex_unlock(&pmu_state_lock);
+
+    return out;
+}
+
+static int pmu_sysfs_add(void)
+{
+    for (int i = 0; i < PMU_STATE__CNT; ++i) {
+        pmu_kobj_attrs[i].attr.name = pmu_state[i].name;
+        pmu_attrs[i] = &pmu_kobj_attrs[i].attr;
+    }
+
+    pmu_kobj = kobject_create_and_add(PMU_SYSFS_NAME, kernel_kobj);
+    if (unlikely(!pmu_kobj)) {
+        pr_loc_err("Failed to create /sys/kernel/%s", PMU_SYSFS_NAME);
+        return -ENOMEM;
+    }
+
+    int out = sysfs_create_group(pmu_kobj, &pmu_attr_group);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to create PMU state attributes - error=%d", out);
+        kobject_put(pmu_kobj);
+        pmu_kobj = NULL;
+        return out;
+    }
+
+    pr_loc_dbg("PMU state exported in /sys/kernel/%s", PMU_SYSFS_NAME);
+    return 0;
+}
+
+static void pmu_sysfs_remove(void)
+{
+    if (!pmu_kobj)
+        return;
+
+    sysfs_remove_group(pmu_kobj, &pmu_attr_group);
+    kobject_put(pmu_kobj);
+    pmu_kobj = NULL;
+}
+
+#define pmu_sysfs_notify(attr) \
+    do { if (likely(pmu_kobj)) { sysfs_notify(pmu_kobj, NULL, pmu_state[attr].name); } } while(0)
+#else //PMU_STATE_SYSFS_SUPPORTED
+#define pmu_sysfs_add() (0)
+#define pmu_sysfs_remove() do { } while(0)
+#define pmu_sysfs_notify(attr) do { } while(0)
+#endif //PMU_STATE_SYSFS_SUPPORTED
+
+void pmu_state_set(pmu_state_attr attr, const char *value, unsigned int len)
+{
+    if (unlikely(attr >= PMU_STATE__CNT)) {
+        pr_loc_bug("Invalid PMU state attribute %d", attr);
+        return;
+    }
+
+    struct pmu_state_value *state = &pmu_state[attr];
+    if (len > PMU_STATE_VALUE_MAX)
+        len = PMU_STATE_VALUE_MAX;
+
+    mutex_lock(&pmu_state_lock);
+    bool changed = strncmp(state->value, value, len) != 0 || state->value[len] != '\0';
+    if (changed) {
+        pr_loc_dbg("PMU state %s: %s => %.*s", state->name, state->value, len, value);
+        memcpy(state->value, value, len);
+        state->value[len] = '\0';
+    }
+    mutex_unlock(&pmu_state_lock);
+
+    if (changed || state->event)
+        pmu_sysfs_notify(attr);
+}
+
+int pmu_state_register(void)
+{
+    mutex_lock(&pmu_state_lock);
+    for (int i = 0; i < PMU_STATE__CNT; ++i)
+        strcpy(pmu_state[i].value, PMU_STATE_UNKNOWN);
+    mutex_unlock(&pmu_state_lock);
+
+    return pmu_sysfs_add();
+}
+
+int pmu_state_unregister(void)
+{
+    pmu_sysfs_remove();
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * Model of the PMU state as set by commands sent to the emulated PMU
+ *
+ * The PMU shim doesn't control any real hardware, but the latest state requested by the mfgBIOS for every LED, the
+ * buzzer, fan PWM etc. is still useful to know (e.g. the status LED is how DSM signals a degraded volume). Every piece
+ * of the state is kept as a short string (e.g. "on", "blink", "green_pulse" or PWM arguments like "50") and starts
+ * as "unknown" since we don't know what the real PMU would be showing at boot.
+ *
+ * When supported (see below), the state is exported as read-only attributes under /sys/kernel/vpmu/ (e.g.
+ * /sys/kernel/vpmu/status_led). Every change calls sysfs_notify() so that the userspace can poll() for POLLPRI on an
+ * attribute (after reading it once) instead of scraping logs. Event-like attributes (buzzer) notify on every command,
+ * even if the value didn't change.
+ *
+ * The sysfs export is only available in the stealth mode of STEALTH_MODE_BASIC or lower; it can also be disabled by
+ * defining PMU_DISABLE_SYSFS.
+ */
+#ifndef REDPILL_PMU_STATE_H
+#define REDPILL_PMU_STATE_H
+
+#include "../../internal/stealth.h" //STEALTH_MODE
+
+#define PMU_STATE_VALUE_MAX 16 //max length of a value; longer ones will be truncated
+
+typedef enum {
+    PMU_STATE_POWER = 0,
+    PMU_STATE_PWR_LED,
+    PMU_STATE_STATUS_LED,
+    PMU_STATE_USB_LED,
+    PMU_STATE_10G_LED,
+    PMU_STATE_ALARM_LED,
+    PMU_STATE_BUZZER,
+    PMU_STATE_PWM_CYCLE,
+    PMU_STATE_PWM_HZ,
+    PMU_STATE_WOL,
+    PMU_STATE_SCHED_UP,
+    PMU_STATE_FAN_HEALTH,
+    PMU_STATE__CNT
+} pmu_state_attr;
+
+#if STEALTH_MODE <= STEALTH_MODE_BASIC && !defined(PMU_DISABLE_SYSFS)
+#define PMU_STATE_SYSFS_SUPPORTED
+#endif
+
+/**
+ * Sets a piece of the PMU state and notifies sysfs pollers if it changed
+ *
+ * This function may sleep (it's meant to be called from PMU command handlers, which run on a workqueue).
+ *
+ * @param value string which doesn't have to be NULL-terminated; it will be truncated to PMU_STATE_VALUE_MAX chars
+ */
+void pmu_state_set(pmu_state_attr attr, const char *value, unsigned int len);
+
+/**
+ * Resets the state to "unknown" and exports it in sysfs (if supported)
+ */
+int pmu_state_register(void);
+
+/**
+ * Removes the sysfs export (if supported); it's safe to call it even if pmu_state_register() failed
+ */
+int pmu_state_unregister(void);
+
+#endif //REDPILL_PMU_STATE_H
@@ -4,12 +4,37 @@
 #include "shim_base.h"
 #include "../common.h"
 #include "../internal/uart/virtual_uart.h"
-#include <linux/kfifo.h> //kfifo_*
+#include "pmu/pmu_state.h" //pmu_state_*()
+#include "../config/platform_types.h" //hw_config
+#include "../internal/uart/vuart_ring.h" //struct vuart_ring
+#include <linux/jhash.h> //jhash()
+#include <linux/workqueue.h> //deferring command handlers
+#include <linux/spinlock.h> //DEFINE_SPINLOCK
+#include <linux/list.h> //pending commands list
 
 #define PMU_TTYS_LINE 1 //so far this is hardcoded by syno, so we doubt it will ever change
-#define WORK_BUFFER_LEN VUART_FIFO_LEN
+#ifndef PMU_VUART_CHIP //deeper FIFOs let the driver talk to us in bigger bursts = fewer vIRQs (see vuart_chip_model)
+#define PMU_VUART_CHIP VUART_CHIP_16950
+#endif
+#ifndef PMU_WORK_RING_LEN //MUST be a power of 2; it only holds the command being collected so it never fills up in practice
+#define PMU_WORK_RING_LEN 256
+#endif
 #define to_hex_buf_len(len) ((len)*3+1) //2 chars for each hex + space + NULL terminator
-#define HEX_BUFFER_LEN to_hex_buf_len(VUART_FIFO_LEN)
+#define HEX_BUFFER_LEN to_hex_buf_len(PMU_WORK_RING_LEN)
+#define PMU_CMD_ARGS_MAX 16 //arguments (see command_definition.has_args) longer than that are truncated
+#define PMU_RESPONSE_MAX 64 //max length of a response sent to the mfgBIOS (see pmu_respond())
+#ifndef PMU_UNIQ_FMT //format of the GET_UNIQ response payload; it gets the model name from hw_config (e.g. "DS918+")
+#define PMU_UNIQ_FMT "%s"
+#endif
+#ifndef pmu_trace_route //called for every command routed (cmd is NULL if unknown), see tools/pmu_bench
+#define pmu_trace_route(cmd, signature, sig_len) do { } while(0)
+#endif
+#ifndef PMU_WORKQUEUE_NAME //name of the workqueue executing command handlers (see queue_command())
+#define PMU_WORKQUEUE_NAME "vpmu"
+#endif
+#ifndef PMU_EVENT_QUEUE_LEN //max number of event/request commands waiting for execution (see queue_command())
+#define PMU_EVENT_QUEUE_LEN 16
+#endif
 
 //PMU packets are at minimum 2 bytes long (PMU_CMD_HEAD + 1-3 bytes command + optional data). If this is set to a high
 // value (e.g. VUART_FIFO_LEN) in practice commands will only be delivered when the client indicates end-of-transmission)
@@ -20,12 +45,50 @@
 typedef struct command_definition command_definition;
 
 /**
- * A single PMU command and its routing
+ * Groups of related commands
+ *
+ * Groups below PMU_GRP__STATE_CNT change the same piece of the PMU state, so only the latest pending command of such
+ * group is executed. The rest are events & requests - every one of them is executed (see queue_command()).
+ */
+typedef enum {
+    PMU_GRP_PWR_LED = 0,
+    PMU_GRP_STATUS_LED,
+    PMU_GRP_USB_LED,
+    PMU_GRP_10G_LED,
+    PMU_GRP_ALARM_LED,
+    PMU_GRP_MIR_LED,
+    PMU_GRP_LED_MODE,
+    PMU_GRP_PWM_CYCLE,
+    PMU_GRP_PWM_HZ,
+    PMU_GRP_WOL,
+    PMU_GRP_SCHED_UP,
+    PMU_GRP_FAN_HEALTH,
+    PMU_GRP__STATE_CNT,
+    PMU_GRP_POWER = PMU_GRP__STATE_CNT, //power off & reset
+    PMU_GRP_BUZZER, //every beep counts
+    PMU_GRP_SWITCH_UP_VER,
+    PMU_GRP_GET_UNIQ, //every request expects its response
+    PMU_GRP_SW1,
+    PMU_GRP__CNT
+} pmu_cmd_group;
+
+/**
+ * A single PMU command and its routing; it's also a node of the command trie (see match_command())
+ *
+ * Entries with fn set are commands. Entries with next set are prefixes of longer commands: next is an array of nodes
+ * for the following byte, indexed by (byte - next_min). A node can be both (e.g. "-S" vs "-SW1").
  */
 struct command_definition {
     void (*fn) (const command_definition *t, const char *data, u8 data_len);
     const u8 length; //commands are realistically 1-3 chars only
+    const bool has_args; //command is followed by variable-length arguments (e.g. PWM duty cycle "-V50")
+    const u8 group; //pmu_cmd_group
+    const u8 state; //pmu_state_attr changed by the command (only for cmd_set_state() handler)
+    const char *value; //new value of the state; NULL to use arguments of the command (only for cmd_set_state() handler)
     const char *name;
+    const command_definition *next;
+    const u8 next_min;
+    const u8 next_cnt;
 } __packed;
 
 /**
@@ -39,10 +102,23 @@ typedef enum {
 
 /**
  * Default/noop shim for a PMU command. It simply prints the command received.
+ *
+ * @param data arguments following the command signature (if any; CRLF is stripped)
  */
 static void cmd_shim_noop(const command_definition *t, const char *data, u8 data_len)
 {
-    pr_loc_dbg("vPMU received %s using %d bytes - NOOP", t->name, data_len);
+    pr_loc_dbg("vPMU received %s with %d bytes of arguments (\"%.*s\") - NOOP", t->name, data_len, data_len, data);
+}
+
+/**
+ * Shim for PMU commands which only change the state of something (e.g. a LED) - it updates the PMU state model
+ */
+static void cmd_set_state(const command_definition *t, const char *data, u8 data_len)
+{
+    if (t->value)
+        pmu_state_set(t->state, t->value, strlen(t->value));
+    else
+        pmu_state_set(t->state, data, data_len);
 }
 
 //@todo when we get the physical PMU emulator we can move this to a separate library so that shim contacts an internal
@@ -51,10 +127,21 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 #define PMU_CMD__MIN_CODE 0x30
 #define PMU_CMD__MAX_CODE 0x75
 #define single_byte_idx(id) ((id)-PMU_CMD__MIN_CODE)
-#define get_single_byte_cmd(id) single_byte_cmds[single_byte_idx(id)] //call it ONLY after has_single_byte_cmd!!!
-#define has_single_byte_cmd(id) \
-    (likely((id) >= PMU_CMD__MIN_CODE) && likely((id) <= PMU_CMD__MAX_CODE) && get_single_byte_cmd(id).length != 0)
-#define DEFINE_SINGLE_BYTE_CMD(cnm, fp) [single_byte_idx(PMU_CMD_ ## cnm)] = { .name = #cnm, .length = 1, .fn = fp }
+#define DEFINE_CMD(cnm, len, grp, fp) { .name = #cnm, .length = len, .group = PMU_GRP_ ## grp, .fn = fp }
+#define DEFINE_CMD_ARGS(cnm, len, grp, fp) \
+    { .name = #cnm, .length = len, .group = PMU_GRP_ ## grp, .fn = fp, .has_args = true }
+#define DEFINE_CMD_STATE(cnm, len, grp, val) \
+    { .name = #cnm, .length = len, .group = PMU_GRP_ ## grp, .fn = cmd_set_state, .state = PMU_STATE_ ## grp, \
+      .value = val }
+#define DEFINE_CMD_PREFIX(tbl, first) { .next = tbl, .next_min = first, .next_cnt = ARRAY_SIZE(tbl) }
+#define DEFINE_SINGLE_BYTE_CMD(cnm, grp, fp) [single_byte_idx(PMU_CMD_ ## cnm)] = DEFINE_CMD(cnm, 1, grp, fp)
+#define DEFINE_SINGLE_BYTE_CMD_ARGS(cnm, grp, fp) \
+    [single_byte_idx(PMU_CMD_ ## cnm)] = DEFINE_CMD_ARGS(cnm, 1, grp, fp)
+#define DEFINE_SINGLE_BYTE_STATE(cnm, grp, val) [single_byte_idx(PMU_CMD_ ## cnm)] = DEFINE_CMD_STATE(cnm, 1, grp, val)
+#define DEFINE_SINGLE_BYTE_STATE_ARGS(cnm, grp) \
+    [single_byte_idx(PMU_CMD_ ## cnm)] = \
+        { .name = #cnm, .length = 1, .group = PMU_GRP_ ## grp, .fn = cmd_set_state, .state = PMU_STATE_ ## grp, \
+          .has_args = true }
 
 #define PMU_CMD_OUT_HW_POWER_OFF 0x31 //"1"
 #define PMU_CMD_OUT_BUZ_SHORT 0x32 //"2"
@@ -77,15 +164,16 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 //0x43-4A unknown
 #define PMU_CMD_OUT_10G_LED_ON 0x4a //"J"
 #define PMU_CMD_OUT_10G_LED_OFF 0x4b //"K"
-//0x4C unknown
+#define PMU_CMD__PREFIX_L 0x4c //"L", only as a prefix of multibyte commands (see below)
 #define PMU_CMD_OUT_LED_TOG_PWR_STAT 0x4d //"M", allows for using one led for status and power and toggle between them
 //0x4E unknown
 #define PMU_CMD_OUT_SWITCH_UP_VER 0x4f //"O"
 #define PMU_CMD_OUT_MIR_LED_OFF 0x50 //"P"
-//0x51-55 unknown (except 52)
-#define PMU_CMD_OUT_GET_UNIQ 0x52 //"P"
-#define PMU_CMD_OUT_PWM_CYCLE 0x56 //"V"
-#define PMU_CMD_OUT_PWM_HZ 0x57 //"W"
+//0x51-55 unknown (except 52 & 53)
+#define PMU_CMD_OUT_GET_UNIQ 0x52 //"R"
+#define PMU_CMD__PREFIX_S 0x53 //"S", only as a prefix of multibyte commands (see below)
+#define PMU_CMD_OUT_PWM_CYCLE 0x56 //"V" + duty cycle as ASCII digits
+#define PMU_CMD_OUT_PWM_HZ 0x57 //"W" + frequency as ASCII digits
 //0x58-59 unknown
 //0x60-71 inputs (except 6C)
 #define PMU_CMD_OUT_WOL_ON 0x6c //"l"
@@ -94,46 +182,115 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 #define PMU_CMD_OUT_FAN_HEALTH_OFF 0x74 //"t"
 #define PMU_CMD_OUT_FAN_HEALTH_ON 0x75 //"u"
 
+static char pmu_uniq[PMU_RESPONSE_MAX - 2] = { '\0' }; //GET_UNIQ response payload (set in register_pmu_shim())
+
+/**
+ * Sends a response to a PMU command to the mfgBIOS
+ *
+ * Responses are framed like commands: a head, the code of the command being answered and then the payload. They're
+ * injected into the vUART RX, so the application gets them as soon as it reads from the port instead of waiting for its
+ * timeout. It can be called from command handlers only (see queue_command()).
+ */
+static void pmu_respond(const command_definition *t, char code, const char *payload, unsigned int len)
+{
+    char response[PMU_RESPONSE_MAX];
+
+    if (unlikely(len > PMU_RESPONSE_MAX - 2)) {
+        pr_loc_bug("Response to %s has %u bytes - truncating to %d", t->name, len, PMU_RESPONSE_MAX - 2);
+        len = PMU_RESPONSE_MAX - 2;
+    }
+
+    response[0] = PMU_CMD_HEAD;
+    response[1] = code;
+    memcpy(&response[2], payload, len);
+    len += 2;
+
+    int out = vuart_inject_rx(PMU_TTYS_LINE, response, len);
+    if (unlikely(out < 0))
+        pr_loc_err("Failed to send response to %s - error=%d", t->name, out);
+    else if (unlikely(out != len))
+        pr_loc_err("Only %d of %u bytes of response to %s were sent", out, len, t->name);
+    else
+        pr_loc_dbg("Sent %u bytes response to %s: \"%.*s\"", len, t->name, len, response);
+}
+
+/**
+ * Answers GET_UNIQ with the model unique (see PMU_UNIQ_FMT)
+ */
+static void cmd_get_uniq(const command_definition *t, const char *data, u8 data_len)
+{
+    pmu_respond(t, PMU_CMD_OUT_GET_UNIQ, pmu_uniq, strlen(pmu_uniq));
+}
+
+//Multibyte commands are defined as nodes of the trie starting with a "prefix" entry in the single byte table. Each level
+// is indexed relative to its first char, e.g. "LA1" is cmds_LA['1'-'0'].
+static const command_definition cmds_LA[] = { //"LAx" - alarm LED
+    ['0'-'0'] = DEFINE_CMD_STATE(OUT_ALARM_LED_OFF, 3, ALARM_LED, "off"), //"LA0"
+    ['1'-'0'] = DEFINE_CMD_STATE(OUT_ALARM_LED_ON, 3, ALARM_LED, "on"), //"LA1"
+    ['2'-'0'] = DEFINE_CMD_STATE(OUT_ALARM_LED_BLINK, 3, ALARM_LED, "blink"), //"LA2"
+};
+static const command_definition cmds_L[] = {
+    ['A'-'A'] = DEFINE_CMD_PREFIX(cmds_LA, '0'),
+};
+static const command_definition cmds_SW[] = {
+    ['1'-'1'] = DEFINE_CMD(OUT_SW1, 3, SW1, cmd_shim_noop), //"SW1"
+};
+static const command_definition cmds_S[] = {
+    ['W'-'W'] = DEFINE_CMD_PREFIX(cmds_SW, '1'),
+};
+
 static const command_definition single_byte_cmds[single_byte_idx(PMU_CMD__MAX_CODE)+1] = {
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_POWER_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_SHORT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_LONG, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_BLINK, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_RESET, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_CYCLE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_HZ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_WOL_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_ON, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_STATE(OUT_HW_POWER_OFF, POWER, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_BUZ_SHORT, BUZZER, "short"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_BUZ_LONG, BUZZER, "long"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_PWR_LED_ON, PWR_LED, "on"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_PWR_LED_BLINK, PWR_LED, "blink"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_PWR_LED_OFF, PWR_LED, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_OFF, STATUS_LED, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_ON_GREEN, STATUS_LED, "green"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_PULSE_GREEN, STATUS_LED, "green_pulse"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_ON_ORANGE, STATUS_LED, "orange"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_PULSE_ORANGE, STATUS_LED, "orange_pulse"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_STATUS_LED_PULSE, STATUS_LED, "pulse"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_USB_LED_ON, USB_LED, "on"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_USB_LED_PULSE, USB_LED, "pulse"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_USB_LED_OFF, USB_LED, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_HW_RESET, POWER, "reset"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_10G_LED_ON, 10G_LED, "on"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_10G_LED_OFF, 10G_LED, "off"),
+    [single_byte_idx(PMU_CMD__PREFIX_L)] = DEFINE_CMD_PREFIX(cmds_L, 'A'),
+    DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, LED_MODE, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, SWITCH_UP_VER, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, MIR_LED, cmd_shim_noop),
+    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, GET_UNIQ, cmd_get_uniq),
+    [single_byte_idx(PMU_CMD__PREFIX_S)] = DEFINE_CMD_PREFIX(cmds_S, 'W'),
+    DEFINE_SINGLE_BYTE_STATE_ARGS(OUT_PWM_CYCLE, PWM_CYCLE),
+    DEFINE_SINGLE_BYTE_STATE_ARGS(OUT_PWM_HZ, PWM_HZ),
+    DEFINE_SINGLE_BYTE_STATE(OUT_WOL_ON, WOL, "on"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_SCHED_UP_OFF, SCHED_UP, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_SCHED_UP_ON, SCHED_UP, "on"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_FAN_HEALTH_OFF, FAN_HEALTH, "off"),
+    DEFINE_SINGLE_BYTE_STATE(OUT_FAN_HEALTH_ON, FAN_HEALTH, "on"),
 };
 
+//Unknown commands are logged only the first time they're seen (mfgBIOS likes to repeat them), see route_command()
+#define PMU_UNKNOWN_SEEN_NR 8
+static u32 unknown_seen[PMU_UNKNOWN_SEEN_NR]; //jhash() of signatures already reported
+static unsigned int unknown_seen_cnt = 0;
 
-static char *uart_buffer = NULL; //keeps data streamed directly by the vUART... todo: vUART should manage this buffer
-static char *work_buffer = NULL; //collecting & operatint on the data received from vUART
-static char *work_buffer_curr = NULL; //pointer to the current free space in work_buffer
+/**
+ * Data received from vUART which wasn't routed yet
+ *
+ * The ring's tail always points at the head of the command being collected (or at scan_pos if there's none), so bytes
+ * are released as soon as they're routed. The parser state (scan_pos & has_cmd) is kept between calls so that every
+ * byte is scanned only once, see process_work_buffer().
+ */
+static struct vuart_ring work_ring = { .mask = PMU_WORK_RING_LEN - 1 };
+static unsigned int scan_pos = 0; //free-running index of the next byte in work_ring to be scanned
+static bool has_cmd = false; //whether the tail of work_ring points at a head of a command being collected
+static char *cmd_buffer = NULL; //contiguous copy of a command which wrapped around the end of work_ring
 static char *hex_print_buffer = NULL; //helper buffer to print char arrays in hex
 
-#define work_buffer_fill() ((unsigned int)(work_buffer_curr - work_buffer))
-
 /**
  * Free all buffers used by this submodule
  *
@@ -141,18 +298,17 @@ static char *hex_print_buffer = NULL; //helper buffer to print char arrays in he
  */
 static void free_buffers(void)
 {
-    if (likely(uart_buffer))
-        kfree(uart_buffer);
+    if (likely(work_ring.data))
+        kfree(work_ring.data);
 
-    if (likely(work_buffer))
-        kfree(work_buffer);
+    if (likely(cmd_buffer))
+        kfree(cmd_buffer);
 
     if (likely(hex_print_buffer))
         kfree(hex_print_buffer);
 
-    uart_buffer = NULL;
-    work_buffer = NULL;
-    work_buffer_curr = NULL;
+    work_ring.data = NULL;
+    cmd_buffer = NULL;
     hex_print_buffer = NULL;
 }
 
@@ -161,11 +317,16 @@ static void free_buffers(void)
  */
 static int alloc_buffers(void)
 {
-    kmalloc_or_exit_int(uart_buffer, VUART_FIFO_LEN);
-    kmalloc_or_exit_int(work_buffer, WORK_BUFFER_LEN);
+    BUILD_BUG_ON_NOT_POWER_OF_2(PMU_WORK_RING_LEN); //vuart_ring requirement
+    BUILD_BUG_ON(PMU_WORK_RING_LEN > 256); //arguments length of a command (up to the whole ring) is passed as u8
+
+    kmalloc_or_exit_int(work_ring.data, PMU_WORK_RING_LEN);
+    kmalloc_or_exit_int(cmd_buffer, PMU_WORK_RING_LEN);
     kmalloc_or_exit_int(hex_print_buffer, HEX_BUFFER_LEN);
 
-    work_buffer_curr = work_buffer;
+    vuart_ring_reset(&work_ring);
+    scan_pos = 0;
+    has_cmd = false;
 
     return 0;
 }
@@ -200,48 +361,252 @@ static __used const char *get_hex_print(const char *buffer, int len)
 /**
  * Matches command against a list of known ones based on the signature specified
  *
+ * The signature is walked through the command trie once, remembering the longest command matched on the way. Whatever
+ * follows that command must be either nothing, a CRLF (sic!), or arguments of a command which takes them.
+ *
  * @param cmd pointer to a pointer where address of command structure can be saved if found
+ * @param data pointer to a pointer where the arguments of the command will be saved if found
+ * @param data_len length of arguments (excluding CRLF, if present)
+ *
+ * @return PMU_CMD_FOUND when a command was matched; PMU_CMD_AMBIGUOUS when the signature is a truncated prefix of a
+ *         longer command (and nothing shorter matched); PMU_CMD_NOT_FOUND otherwise
  */
 static pmu_match_status noinline
-match_command(const command_definition **cmd, const char *signature, const unsigned int sig_len)
+match_command(const command_definition **cmd, const char **data, u8 *data_len, const char *signature,
+              const unsigned int sig_len)
 {
     if (unlikely(sig_len == 0)) {
         pr_loc_dbg("Invalid zero-length command (stray head without command signature) - discarding");
         return PMU_CMD_NOT_FOUND;
     }
 
-    if (likely(sig_len == 1) //regular 1 byte
-        || (sig_len == 3 && signature[1] == 0x0d && signature[2] == 0x0a) //1 byte with CRLF (sic!)
-       ) {
-        if (!has_single_byte_cmd(signature[0]))
-            return PMU_CMD_NOT_FOUND;
+    const command_definition *level = single_byte_cmds;
+    unsigned int level_min = PMU_CMD__MIN_CODE;
+    unsigned int level_cnt = ARRAY_SIZE(single_byte_cmds);
+    const command_definition *found = NULL;
+    unsigned int pos = 0;
+    while (pos < sig_len) {
+        unsigned int idx = (u8)signature[pos] - level_min;
+        if (idx >= level_cnt) //also catches chars below level_min as idx wraps around
+            break;
+
+        const command_definition *node = &level[idx];
+        if (!node->fn && !node->next) //empty slot in the table
+            break;
+
+        ++pos;
+        if (node->fn)
+            found = node;
+
+        if (!node->next)
+            break;
+
+        level = node->next;
+        level_min = node->next_min;
+        level_cnt = node->next_cnt;
+    }
+
+    if (!found)
+        return (pos == sig_len) ? PMU_CMD_AMBIGUOUS : PMU_CMD_NOT_FOUND;
+
+    const char *rest = signature + found->length;
+    unsigned int rest_len = sig_len - found->length;
+    if (rest_len >= 2 && rest[rest_len-2] == 0x0d && rest[rest_len-1] == 0x0a) //1 byte with CRLF (sic!)
+        rest_len -= 2;
+
+    if (rest_len != 0 && !found->has_args)
+        return PMU_CMD_NOT_FOUND;
+
+    *cmd = found;
+    *data = rest;
+    *data_len = rest_len;
+    return PMU_CMD_FOUND;
+}
+
+/**
+ * Checks if the unknown command signature was already reported, and remembers it if it wasn't
+ */
+static bool unknown_already_seen(const char *buffer, const unsigned int len)
+{
+    u32 hash = jhash(buffer, len, len);
+    for (unsigned int i = 0; i < min_t(unsigned int, unknown_seen_cnt, PMU_UNKNOWN_SEEN_NR); ++i) {
+        if (unknown_seen[i] == hash)
+            return true;
+    }
+
+    unknown_seen[unknown_seen_cnt++ % PMU_UNKNOWN_SEEN_NR] = hash;
+    return false;
+}
+
+/**
+ * Command handlers execution
+ *
+ * The parsing happens in the vUART TX callback, which runs in the vIRQ/8250 path with the vdev lock held. Handlers are
+ * not executed there but deferred to an ordered (i.e. one at a time) workqueue, so that a slow handler can never stall
+ * the serial I/O.
+ * Every state-like command group (see pmu_cmd_group) has a single pending slot. When a command is routed while another
+ * one from the same group is still pending, it simply replaces the pending one in place (so e.g. a burst of LED changes
+ * results in a single handler call with the latest state). Events & requests (e.g. beeps or GET_UNIQ) cannot be merged
+ * like that, so each of them takes its own slot from a pool of PMU_EVENT_QUEUE_LEN. Slots are executed in the order in
+ * which they became pending.
+ */
+struct pmu_pending_cmd {
+    struct list_head list;
+    const command_definition *cmd;
+    u8 data_len;
+    char data[PMU_CMD_ARGS_MAX];
+};
+
+static struct pmu_pending_cmd pending_slots[PMU_GRP__STATE_CNT];
+static struct pmu_pending_cmd event_slots[PMU_EVENT_QUEUE_LEN];
+static LIST_HEAD(pending_cmds);
+static LIST_HEAD(free_event_slots);
+static DEFINE_SPINLOCK(pending_lock); //protects all slots & lists above
+
+#define is_event_slot(pending) ((pending) >= event_slots && (pending) < event_slots + PMU_EVENT_QUEUE_LEN)
+static struct workqueue_struct *cmd_wq = NULL;
+
+static void cmd_worker(struct work_struct *work)
+{
+    const command_definition *cmd;
+    char data[PMU_CMD_ARGS_MAX];
+    u8 data_len;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pending_lock, flags);
+    while (!list_empty(&pending_cmds)) {
+        struct pmu_pending_cmd *pending = list_first_entry(&pending_cmds, struct pmu_pending_cmd, list);
+        if (is_event_slot(pending))
+            list_move(&pending->list, &free_event_slots);
+        else
+            list_del_init(&pending->list);
+        cmd = pending->cmd;
+        data_len = pending->data_len;
+        memcpy(data, pending->data, data_len);
+        spin_unlock_irqrestore(&pending_lock, flags);
+
+        pr_loc_dbg("Executing cmd %s handler %pF", cmd->name, cmd->fn);
+        cmd->fn(cmd, data, data_len);
+
+        spin_lock_irqsave(&pending_lock, flags);
+    }
+    spin_unlock_irqrestore(&pending_lock, flags);
+}
+static DECLARE_WORK(cmd_work, cmd_worker);
+
+/**
+ * Puts the command into its group's pending slot (or a new event slot) and schedules its execution
+ */
+static void queue_command(const command_definition *cmd, const char *data, u8 data_len)
+{
+    if (unlikely(data_len > PMU_CMD_ARGS_MAX)) {
+        pr_loc_wrn("Arguments of %s are %d bytes long - truncating to %d", cmd->name, data_len, PMU_CMD_ARGS_MAX);
+        data_len = PMU_CMD_ARGS_MAX;
+    }
+
+    unsigned long flags;
+    struct pmu_pending_cmd *pending;
+    spin_lock_irqsave(&pending_lock, flags);
+    if (cmd->group >= PMU_GRP__STATE_CNT) {
+        if (unlikely(list_empty(&free_event_slots))) {
+            spin_unlock_irqrestore(&pending_lock, flags);
+            pr_loc_wrn("Too many PMU commands pending - dropping %s", cmd->name);
+            return;
+        }
 
-        *cmd = &get_single_byte_cmd(signature[0]);
-        return PMU_CMD_FOUND;
+        pending = list_first_entry(&free_event_slots, struct pmu_pending_cmd, list);
+        list_move_tail(&pending->list, &pending_cmds);
+    } else {
+        pending = &pending_slots[cmd->group];
+        if (list_empty(&pending->list))
+            list_add_tail(&pending->list, &pending_cmds);
+        else
+            pr_loc_dbg("Cmd %s replaces pending %s", cmd->name, pending->cmd->name);
     }
 
-    return PMU_CMD_NOT_FOUND; //@todo Currently we don't handle multibyte commands; it has to be a full iteration
+    pending->cmd = cmd;
+    pending->data_len = data_len;
+    memcpy(pending->data, data, data_len);
+    spin_unlock_irqrestore(&pending_lock, flags);
+
+    queue_work(cmd_wq, &cmd_work);
+}
+
+static int start_cmd_wq(void)
+{
+    for (int i = 0; i < PMU_GRP__STATE_CNT; ++i)
+        INIT_LIST_HEAD(&pending_slots[i].list);
+
+    INIT_LIST_HEAD(&free_event_slots);
+    for (int i = 0; i < PMU_EVENT_QUEUE_LEN; ++i)
+        list_add_tail(&event_slots[i].list, &free_event_slots);
+
+    cmd_wq = alloc_ordered_workqueue(PMU_WORKQUEUE_NAME, 0);
+    if (unlikely(!cmd_wq)) {
+        pr_loc_crt("Failed to create workqueue for PMU commands");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/**
+ * Executes all commands still pending and stops the workqueue; it should be called when no new commands can come
+ */
+static void stop_cmd_wq(void)
+{
+    if (!cmd_wq)
+        return;
+
+    destroy_workqueue(cmd_wq); //this drains the queue
+    cmd_wq = NULL;
 }
 
 /**
- * Finds command based on its signature and execute its callback if found
+ * Finds command based on its signature and queues its execution if found
  */
 static void route_command(const char *buffer, const unsigned int len)
 {
     const command_definition *cmd = NULL;
+    const char *data;
+    u8 data_len;
+
+    pmu_match_status status = match_command(&cmd, &data, &data_len, buffer, len);
+    pmu_trace_route((status == PMU_CMD_FOUND) ? cmd : NULL, buffer, len);
+    if (status != PMU_CMD_FOUND) {
+        if (!unknown_already_seen(buffer, len))
+            pr_loc_wrn("Unknown%s %d byte PMU command with signature hex=\"%s\" ascii=\"%.*s\"",
+                       (status == PMU_CMD_AMBIGUOUS) ? " (truncated)" : "", len, get_hex_print(buffer, len), len,
+                       buffer);
+        return;
+    }
 
-    if (match_command(&cmd, buffer, len) != PMU_CMD_FOUND) {
-        pr_loc_wrn("Unknown %d byte PMU command with signature hex=\"%s\" ascii=\"%.*s\"", len,
-                   get_hex_print(buffer, len), len, buffer);
+    queue_command(cmd, data, data_len);
+}
+
+/**
+ * Routes a command collected in the work ring
+ *
+ * @param from free-running index of the first byte of the command signature (i.e. just after the head)
+ */
+static void route_ring_command(unsigned int from, unsigned int len)
+{
+    const u8 *seg1, *seg2;
+    unsigned int seg1_len, seg2_len;
+    vuart_ring_peek_from(&work_ring, from, &seg1, &seg1_len, &seg2, &seg2_len);
+
+    if (likely(seg1_len >= len)) { //in most cases commands are not wrapped so they can be routed in place
+        route_command((const char *)seg1, len);
         return;
     }
 
-    pr_loc_dbg("Executing cmd %s handler %pF", cmd->name, cmd->fn);
-    cmd->fn(cmd, buffer, len);
+    memcpy(cmd_buffer, seg1, seg1_len);
+    memcpy(cmd_buffer + seg1_len, seg2, len - seg1_len);
+    route_command(cmd_buffer, len);
 }
 
 /**
- * Scans work buffer (copied from vUART buffer) to find commands
+ * Scans data in the work ring which wasn't scanned yet to find commands
  *
  * @param end_of_packet Indicates whether this command was called because the vUART transmitter assumed
  *                      end-of-transmission/IDLE, or flushed due to its buffer being full. If this parameter is true the
@@ -250,77 +615,50 @@ static void route_command(const char *buffer, const unsigned int len)
  *                      will be a multibyte command (but we possibly didn't get all the bytes YET) or this is single or
  *                      multibyte command which we don't know.
  *
- * This function makes an assumption that when it's called that the buffer represents the whole state of the command
- * If this becomes to take too long we can move it to a separate thread, but this will require a lock.
+ * Every command is routed as soon as the head of the next one is found, as it's complete at this point. The last one
+ * is routed only at the end of a packet. The parser state is preserved between calls so that each call only scans the
+ * data added since the previous one. Routed commands are executed asynchronously (see queue_command()).
  */
 static noinline void process_work_buffer(bool end_of_packet)
 {
-    if (unlikely(work_buffer == work_buffer_curr)) {
-        //this can happen if kernel sends no data but we get IDLE... shouldn't logically happen
-        pr_loc_wrn("%s called on empty buffer?!", __FUNCTION__);
-        return;
-    }
-
-    int cmd_len = -1; //number of bytes in the command (excluding header)
-    for(char *curr = work_buffer; curr < work_buffer_curr; ++curr) {
-        if (*curr == PMU_CMD_HEAD) { //got the beginning of a new command
+    unsigned int head = work_ring.head;
+    for (; scan_pos != head; ++scan_pos) {
+        char curr = work_ring.data[scan_pos & work_ring.mask];
+        if (curr == PMU_CMD_HEAD) { //got the beginning of a new command
             //we've found a new command in the buffer - lets check if the previously collected data matches anything
-            if (cmd_len != -1) { //we only want to call it if this isn't the first byte after last cmd (or 1st in buf)
-                route_command(curr-cmd_len, cmd_len);
-                cmd_len = 0; //we've got the head so 0 and not -1
-            } else {
-                ++cmd_len; //We've read the buffer containing head, we then expect to get something which is non-head
-            }
-        } else {
-            if (cmd_len == -1) { //we don't expect data before head
-                pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", *curr,
-                           *curr);
-                continue;
-            }
-
-            ++cmd_len; //collecting another byte for the currently processed command
+            if (has_cmd)
+                route_ring_command(work_ring.tail + 1, scan_pos - work_ring.tail - 1);
+
+            vuart_ring_skip(&work_ring, scan_pos - work_ring.tail); //everything before the new head is processed
+            has_cmd = true;
+        } else if (!has_cmd) { //we don't expect data before head
+            pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", curr, curr);
+            vuart_ring_skip(&work_ring, 1);
         }
     }
 
-    //We've finished processing the buffer. Now we need to decide what to do with that last piece of data
-    unsigned int processed = work_buffer_fill();
-    if (cmd_len != -1) { //if it's -1 it means we didn't find any heading so we're just discarding all data
-        if (end_of_packet) {
-            route_command(work_buffer_curr-cmd_len, cmd_len);
-        } else { //if the packed didn't end we need to keep that piece of buffer for the next run
-            processed -= cmd_len + 1; //we also keep head
-        }
-    }
-
-    unsigned int left = work_buffer_fill() - processed;
-    if (likely(left != 0)) {
-        memmove(work_buffer, work_buffer+processed, left);
-    }
-    work_buffer_curr = work_buffer + left;
+    //Some versions of the mfgBIOS send head AND THEN in a separate packet the actual command (sic!), so a lone head
+    // is kept even when the packet ended
+    if (!has_cmd || !end_of_packet || scan_pos - work_ring.tail <= 1)
+        return;
 
-//    pr_loc_dbg("Left buffer %p curr=%p with %d bytes in it (ascii=\"%.*s\" hex={%s})", work_buffer, work_buffer_curr, left, left, work_buffer,
-//               get_hex_print(work_buffer, left));
+    route_ring_command(work_ring.tail + 1, scan_pos - work_ring.tail - 1);
+    vuart_ring_discard(&work_ring);
+    has_cmd = false;
 }
 
 /**
- * Callback passed to vUART. It will be called any time some data is available.
+ * Drain callback passed to vUART. It will be called any time some data is available.
+ *
+ * The data is copied straight from the vUART TX FIFO into the work ring (see vuart_set_tx_drain_callback()). The
+ * callback always consumes everything it was given, as leaving anything behind would stall the mfgBIOS.
  */
-static noinline void pmu_rx_callback(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+static noinline unsigned int pmu_rx_callback(int line, const struct vuart_tx_view *view, vuart_flush_reason reason)
 {
-    pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", len, reason, get_hex_print(buffer, len), len, buffer);
-
-    int buffer_space = WORK_BUFFER_LEN - work_buffer_fill();
-    if (unlikely(work_buffer_curr + len > work_buffer + WORK_BUFFER_LEN)) { //todo just remove as much as needed from the buffer to fit more data
-        pr_loc_err("Work buffer is full! Only %d of %d bytes will be copied from receiver", len, buffer_space);
-        len = buffer_space;
-    }
+    pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", view->len, reason,
+               get_hex_print(view->seg[0].buffer, view->seg[0].len), view->seg[0].len, view->seg[0].buffer);
 
-    memcpy(work_buffer_curr, buffer, len);
-    work_buffer_curr += len;
-//    pr_loc_dbg("Copied data to work buffer, now with %d bytes in it (cur=%p)",
-//               (unsigned int)(work_buffer_curr - work_buffer), work_buffer_curr);
-
-    //We only want to analyze the buffer when we are sure we have the full command to process. This is because commands
+    //We only want to route a command when we are sure we have the full command to process. This is because commands
     // are variable length and have no end delimiter not length specified with prefixes of short commands conflicting
     // with longer commands (sic!)
     //For example, you have "SW1" command which when sent will look like "-SW1" (0x2d 0x53 0x57 0x31). We can capture
@@ -328,15 +666,51 @@ static noinline void pmu_rx_callback(int line, const char *buffer, unsigned int
     // (unlikely but possible) since it will be something like "-SW1-3". However, we CANNOT distinguish "-S" from
     // incomplete "-SW1". So we need to rely on IDLE - if we got "-S" with IDLE it means it was "-S" and not the
     // beginning of "-SW1".
-    //We also forcefully flush on full buffer even if no IDLE was specified, as it's technically possible for the
-    // software to send a long sequence of commands at once totaling more than our buffer (extremely unlikely).
-    //Additionally, we only process IDLE-signalled buffers when they have at least a single byte of data as some
-    // versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!)
-    if (reason == VUART_FLUSH_IDLE && work_buffer_fill() > 1)
+    //Since the ring only holds the command being collected, it can only get full with a "command" longer than the ring
+    // (i.e. garbage). In such case it's routed as-is (so that it's reported) and the collection starts over.
+    for (int i = 0; i < ARRAY_SIZE(view->seg); ++i) {
+        const char *seg = view->seg[i].buffer;
+        unsigned int seg_len = view->seg[i].len;
+        while (seg_len != 0) {
+            unsigned int copied = vuart_ring_in(&work_ring, seg, seg_len);
+            process_work_buffer(false);
+            seg += copied;
+            seg_len -= copied;
+
+            if (unlikely(vuart_ring_avail(&work_ring) == 0)) {
+                pr_loc_err("PMU command exceeds %d bytes - routing what was collected", PMU_WORK_RING_LEN);
+                route_ring_command(work_ring.tail + 1, PMU_WORK_RING_LEN - 1);
+                vuart_ring_discard(&work_ring);
+                has_cmd = false;
+            }
+        }
+    }
+
+    if (reason == VUART_FLUSH_IDLE)
         process_work_buffer(true);
-    //our buffer is full [we must process] or vUART buffer was full [we should process]
-    else if (buffer_space <= len || reason == VUART_FLUSH_FULL)
-        process_work_buffer(false);
+
+    return view->len;
+}
+
+/**
+ * Stops routing commands and removes the vUART
+ *
+ * The order matters: no new commands can be queued once the callback is removed, and handlers still pending (which
+ * may respond via vuart_inject_rx()) must finish before the vUART (and its FIFOs) is gone.
+ */
+static int detach_vuart(void)
+{
+    int out;
+
+    if ((out = vuart_set_tx_drain_callback(PMU_TTYS_LINE, NULL, 0)) != 0)
+        pr_loc_err("Failed to remove RX callback - error=%d", out);
+
+    stop_cmd_wq(); //commands still pending are executed before the workqueue is gone
+
+    if ((out = vuart_remove_device(PMU_TTYS_LINE)) != 0)
+        pr_loc_err("Failed to remove vUART for line=%d", PMU_TTYS_LINE);
+
+    return out;
 }
 
 int register_pmu_shim(const struct hw_config *hw)
@@ -344,16 +718,18 @@ int register_pmu_shim(const struct hw_config *hw)
     shim_reg_in();
 
     int out;
-    if ((out = vuart_add_device(PMU_TTYS_LINE) != 0)) {
+    if ((out = vuart_add_device_model(PMU_TTYS_LINE, PMU_VUART_CHIP) != 0)) {
         pr_loc_err("Failed to initialize vUART for PMU at ttyS%d", PMU_TTYS_LINE);
         return out;
     }
 
-    if ((out = alloc_buffers()) != 0)
+    if ((out = alloc_buffers()) != 0 || (out = start_cmd_wq()) != 0 || (out = pmu_state_register()) != 0)
         goto error_out;
 
+    snprintf(pmu_uniq, sizeof(pmu_uniq), PMU_UNIQ_FMT, hw->name);
+
     //We don't set the threshold as some commands are variable length but the "packets" are properly split
-    if ((out = vuart_set_tx_callback(PMU_TTYS_LINE, pmu_rx_callback, uart_buffer, VUART_THRESHOLD_MAX))) {
+    if ((out = vuart_set_tx_drain_callback(PMU_TTYS_LINE, pmu_rx_callback, VUART_THRESHOLD_MAX))) {
         pr_loc_err("Failed to register RX callback");
         goto error_out;
     }
@@ -362,8 +738,9 @@ int register_pmu_shim(const struct hw_config *hw)
     return 0;
 
     error_out:
+    detach_vuart();
+    pmu_state_unregister();
     free_buffers();
-    vuart_remove_device(PMU_TTYS_LINE); //this also removes callback (if set)
     return out;
 }
 
@@ -372,14 +749,13 @@ int unregister_pmu_shim(void)
     shim_ureg_in();
 
     int out = 0;
-    if (unlikely(!uart_buffer)) {
+    if (unlikely(!work_ring.data)) {
         pr_loc_bug("Attempted to %s while it's not registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
 
-    if ((out = vuart_remove_device(PMU_TTYS_LINE)) != 0)
-        pr_loc_err("Failed to remove vUART for line=%d", PMU_TTYS_LINE);
-
+    out = detach_vuart();
+    pmu_state_unregister();
     free_buffers();
 
     shim_ureg_ok();
@@ -0,0 +1,510 @@
+/**
+ * Provides ATA SMART for NVMe namespaces
+ *
+ * DSM reads SMART of disks using ATA commands (HDIO_DRIVE_CMD & HDIO_DRIVE_TASK ioctls). The SMART shim (see
+ * smart_shim.c) handles these for SCSI disks only, while NVMe namespaces reject them. This shim hooks the NVMe block
+ * device ioctl() and answers them using the SMART shim emulation (see smart_emulate_ioctl()). SMART values carry real
+ * data taken from the NVMe "SMART / Health Information" log page:
+ *   - composite temperature => Temperature_Celsius (194)
+ *   - power on hours => Power_On_Hours (9)
+ *   - power cycles => Power_Cycle_Count (12)
+ *   - media & data integrity errors => Reported_Uncorrect (187)
+ *   - percentage used => SSD_Life_Left (231)
+ *
+ * The log page is global for the whole controller, so it's cached per controller (and not per namespace) for
+ * NVME_SMART_LOG_TTL. This way polling SMART of multiple namespaces doesn't translate to admin commands each time.
+ * Cached entries are dropped when the PCI device of their controller is unbound or removed. IDENTIFY is fake and cheap
+ * to build, so unlike for SCSI disks it's never cached (gendisks of removed namespaces are not tracked).
+ *
+ * The log page is read by the original NVMe ioctl() with NVME_IOCTL_ADMIN_CMD, the same way as nvme-cli does it. As
+ * that ioctl() only accepts userspace memory, a temporary anonymous mapping is created in the calling process for the
+ * command and its data. This avoids depending on NVMe driver internals, which are very different across kernels.
+ * Since other threads of the process can access that mapping, the command is read back after the ioctl() and the log
+ * page is discarded if the command doesn't match what we've sent (see read_health_log()).
+ *
+ * HOOKING
+ * The NVMe ioctl() handler is installed the same way as in the SMART shim: a temporary canary replaces nvme_ioctl() to
+ * capture the block_device_operations on the first ioctl(), which are then rerouted to nvme_ioctl_smart_shim(). See
+ * sd_ioctl_canary() in smart_shim.c for the rationale. If the NVMe driver isn't loaded yet the canary is installed when
+ * it registers. With native NVMe multipath only the ops of the device which received the first ioctl() are shimmed.
+ *
+ * References
+ *  - NVM Express Base Specification, section "SMART / Health Information (Log Identifier 02h)"
+ */
+#include "nvme_smart_shim.h"
+#include "smart_shim.h" //smart_emulate_ioctl(), struct smart_health
+#include "../shim_base.h"
+#include "../../common.h"
+#include "../../internal/intercept_driver_register.h" //waiting for "nvme" driver to load
+#include "../../internal/helper/memory_helper.h" //WITH_MEM_UNLOCKED
+#include "../../internal/helper/symbol_helper.h" //kernel_has_symbol()
+#include "../../internal/override/override_symbol.h" //installing nvme_ioctl_canary()
+#include <linux/blkdev.h> //struct block_device_operations
+#include <linux/device.h> //bus_register_notifier(), BUS_NOTIFY_*
+#include <linux/fs.h> //struct block_device
+#include <linux/genhd.h> //struct gendisk, disk_to_dev()
+#include <linux/hdreg.h> //HDIO_DRIVE_CMD, HDIO_DRIVE_TASK
+#include <linux/list.h> //list_*
+#include <linux/mm.h> //vm_mmap(), vm_munmap()
+#include <linux/mman.h> //PROT_*, MAP_*
+#include <linux/mutex.h> //DEFINE_MUTEX
+#include <linux/pci.h> //pci_bus_type
+#include <linux/sched.h> //current
+#include <linux/unaligned/le_byteshift.h> //get_unaligned_le16(), get_unaligned_le64()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+#include <linux/nvme_ioctl.h> //struct nvme_admin_cmd, NVME_IOCTL_ADMIN_CMD
+#else
+#include <linux/nvme.h> //struct nvme_admin_cmd, NVME_IOCTL_ADMIN_CMD
+#endif
+
+#define SHIM_NAME "NVMe SMART emulator"
+#define NVME_DRV_NAME "nvme"
+#define NVME_IOCTL_SYMBOL "nvme_ioctl"
+
+//How long the health log page of a controller is served from cache before it's read again
+#ifndef NVME_SMART_LOG_TTL
+#define NVME_SMART_LOG_TTL (60 * HZ)
+#endif
+
+#define NVME_ADM_GET_LOG_PAGE 0x02
+#define NVME_LID_SMART 0x02
+#define NVME_NSID_GLOBAL 0xffffffff
+#define NVME_SMART_LOG_LEN 512
+#define NVME_SMART_LOG_UOFFSET 512 //where in the temporary user mapping the log page is read to (after the command)
+
+//Offsets of fields in the SMART / Health Information log page; 16-byte counters are read as 64-bit (low part)
+#define NVME_SMART_TEMP 1 //2 bytes, Kelvin
+#define NVME_SMART_PERCENT_USED 5
+#define NVME_SMART_POWER_CYCLES 112
+#define NVME_SMART_POWER_ON_HOURS 128
+#define NVME_SMART_MEDIA_ERRORS 160
+#define KELVIN_TO_CELSIUS 273
+
+struct nvme_health_entry {
+    struct list_head list;
+    struct device *ctrl; //parent device of namespace gendisks
+    struct device *pci_dev; //PCI device of the controller, used to match removal notifications
+    unsigned long stored; //jiffies
+    struct smart_health health;
+};
+
+static LIST_HEAD(health_entries);
+static DEFINE_MUTEX(health_lock);
+
+//address of original nvme_ioctl(); populated by the canary and after the canary trampoline is removed
+static int (*nvme_ioctl_org) (struct block_device *, fmode_t, unsigned, unsigned long) = NULL;
+static struct block_device_operations *nvme_fops = NULL; //to restore nvme_ioctl() on removal
+static struct override_symbol_inst *nvme_ioctl_canary_ovs = NULL;
+static DEFINE_MUTEX(nvme_ioctl_canary_lock);
+static driver_watcher_instance *driver_watcher = NULL;
+
+/************************************************ Health log handling *************************************************/
+static struct nvme_health_entry *find_health_entry(struct device *ctrl)
+{
+    struct nvme_health_entry *entry;
+    list_for_each_entry(entry, &health_entries, list) {
+        if (entry->ctrl == ctrl)
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Drops entries of all controllers on a given PCI device (or all entries if pci_dev is NULL)
+ */
+static void drop_health_entries(struct device *pci_dev)
+{
+    struct nvme_health_entry *entry, *tmp;
+
+    mutex_lock(&health_lock);
+    list_for_each_entry_safe(entry, tmp, &health_entries, list) {
+        if (pci_dev && entry->pci_dev != pci_dev)
+            continue;
+
+        list_del(&entry->list);
+        kfree(entry);
+    }
+    mutex_unlock(&health_lock);
+}
+
+/**
+ * Finds the PCI device a controller (or any other device) sits on
+ */
+static struct device *find_pci_dev(struct device *dev)
+{
+    for (; dev; dev = dev->parent) {
+        if (dev->bus == &pci_bus_type)
+            return dev;
+    }
+
+    return NULL;
+}
+
+/**
+ * Drops cached health when NVMe controller goes away, as its struct device may be freed and reused
+ */
+static int pci_event_handler(struct notifier_block *self, unsigned long action, void *data)
+{
+    if (action != BUS_NOTIFY_UNBOUND_DRIVER && action != BUS_NOTIFY_DEL_DEVICE)
+        return NOTIFY_DONE;
+
+    drop_health_entries(data);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block pci_nb = {
+    .notifier_call = pci_event_handler,
+};
+static bool pci_nb_registered = false; //the shim is optional so unregister may be called after a failed register
+
+static void parse_health_log(const u8 *log, struct smart_health *health)
+{
+    memset(health, 0, sizeof(*health));
+
+    u16 temp_k = get_unaligned_le16(&log[NVME_SMART_TEMP]);
+    if (temp_k > KELVIN_TO_CELSIUS) { //0 means not reported
+        health->temp = min_t(u16, temp_k - KELVIN_TO_CELSIUS, 0xff);
+        health->valid |= SMART_HEALTH_TEMP;
+    }
+
+    health->power_on_hours = min_t(u64, get_unaligned_le64(&log[NVME_SMART_POWER_ON_HOURS]), U32_MAX);
+    health->power_cycles = min_t(u64, get_unaligned_le64(&log[NVME_SMART_POWER_CYCLES]), U32_MAX);
+    health->uncorrected = get_unaligned_le64(&log[NVME_SMART_MEDIA_ERRORS]);
+    health->percent_used = log[NVME_SMART_PERCENT_USED];
+    health->valid |= SMART_HEALTH_POWER_ON_HOURS | SMART_HEALTH_POWER_CYCLES | SMART_HEALTH_UNCORRECTED |
+                     SMART_HEALTH_PERCENT_USED;
+}
+
+/**
+ * Reads SMART / Health Information log page of the controller using the original ioctl()
+ *
+ * @param log kernel buffer of NVME_SMART_LOG_LEN
+ */
+static int read_health_log(struct block_device *bdev, fmode_t mode, u8 *log)
+{
+    //The command buffer is borrowed from the caller's address space, so there must be one (i.e. it's not a kthread)
+    if (unlikely(!current->mm)) {
+        pr_loc_dbg("Cannot read NVMe health log for a caller without user memory");
+        return -EOPNOTSUPP;
+    }
+
+    unsigned long uaddr = vm_mmap(NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    if (unlikely(IS_ERR_VALUE(uaddr))) {
+        pr_loc_err("Failed to map temporary user memory for NVMe admin command - error=%ld", (long)uaddr);
+        return (int)uaddr;
+    }
+
+    struct nvme_admin_cmd __user *ucmd = (void __user *)uaddr;
+    struct nvme_admin_cmd cmd = {
+        .opcode = NVME_ADM_GET_LOG_PAGE,
+        .nsid = NVME_NSID_GLOBAL,
+        .addr = (u64)(uaddr + NVME_SMART_LOG_UOFFSET),
+        .data_len = NVME_SMART_LOG_LEN,
+        .cdw10 = NVME_LID_SMART | (((NVME_SMART_LOG_LEN / 4) - 1) << 16), //log id + number of dwords (0-based)
+    };
+
+    int out;
+    if (unlikely(copy_to_user(ucmd, &cmd, sizeof(cmd)) != 0)) {
+        pr_loc_err("Failed to copy NVMe admin command to user ptr=%p", ucmd);
+        out = -EFAULT;
+        goto out_unmap;
+    }
+
+    out = nvme_ioctl_org(bdev, mode, NVME_IOCTL_ADMIN_CMD, (unsigned long)ucmd);
+    if (out != 0) {
+        pr_loc_dbg("Failed to read SMART log of /dev/%s - error/status=%d", bdev->bd_disk->disk_name, out);
+        out = (out < 0) ? out : -EIO; //positive values are NVMe status codes
+        goto out_unmap;
+    }
+
+    //The mapping is shared with all threads of the process - if any of them changed the command before the driver read
+    // it, something else than we asked for was executed and the data cannot be trusted. The driver only writes back
+    // the result field.
+    struct nvme_admin_cmd sent_cmd;
+    if (unlikely(copy_from_user(&sent_cmd, ucmd, sizeof(sent_cmd)) != 0)) {
+        pr_loc_err("Failed to read back NVMe admin command from user ptr=%p", ucmd);
+        out = -EFAULT;
+        goto out_unmap;
+    }
+
+    cmd.result = sent_cmd.result;
+    if (unlikely(memcmp(&cmd, &sent_cmd, sizeof(cmd)) != 0)) {
+        pr_loc_err("NVMe admin command for /dev/%s was modified while being executed (opcode=0x%02x addr=0x%llx "
+                   "cdw10=0x%08x) - discarding SMART log", bdev->bd_disk->disk_name, sent_cmd.opcode,
+                   (unsigned long long)sent_cmd.addr, sent_cmd.cdw10);
+        out = -EIO;
+        goto out_unmap;
+    }
+
+    if (unlikely(copy_from_user(log, (void __user *)(uaddr + NVME_SMART_LOG_UOFFSET), NVME_SMART_LOG_LEN) != 0)) {
+        pr_loc_err("Failed to copy NVMe SMART log from user ptr=%p", (void *)(uaddr + NVME_SMART_LOG_UOFFSET));
+        out = -EFAULT;
+    }
+
+    out_unmap:
+    vm_munmap(uaddr, PAGE_SIZE);
+    return out;
+}
+
+/**
+ * Gets health of NVMe namespace's controller - see smart_health_reader
+ */
+static int read_nvme_health(struct block_device *bdev, fmode_t mode, struct smart_health *health)
+{
+    struct device *ctrl = disk_to_dev(bdev->bd_disk)->parent;
+    int out = 0;
+
+    mutex_lock(&health_lock);
+    struct nvme_health_entry *entry = find_health_entry(ctrl);
+    if (entry && jiffies - entry->stored < NVME_SMART_LOG_TTL) {
+        *health = entry->health;
+        goto out_unlock;
+    }
+
+    u8 *log = kmalloc(NVME_SMART_LOG_LEN, GFP_KERNEL);
+    if (unlikely(!log)) {
+        pr_loc_crt("kernel memory alloc failure - tried to reserve memory for NVMe SMART log");
+        out = -ENOMEM;
+        goto out_unlock;
+    }
+
+    if ((out = read_health_log(bdev, mode, log)) != 0)
+        goto out_free;
+
+    parse_health_log(log, health);
+    if (!entry) {
+        entry = kmalloc(sizeof(struct nvme_health_entry), GFP_KERNEL);
+        if (unlikely(!entry)) {
+            pr_loc_wrn("Failed to allocate NVMe health entry for /dev/%s - it will not be cached",
+                       bdev->bd_disk->disk_name);
+            goto out_free;
+        }
+
+        entry->ctrl = ctrl;
+        entry->pci_dev = find_pci_dev(ctrl);
+        list_add(&entry->list, &health_entries);
+    }
+
+    entry->stored = jiffies;
+    entry->health = *health;
+
+    out_free:
+    kfree(log);
+    out_unlock:
+    mutex_unlock(&health_lock);
+    return out;
+}
+
+/********************************** ioctl() handling re-routing from driver to shim ***********************************/
+static int nvme_ioctl_smart_shim(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+        case HDIO_DRIVE_CMD:
+        case HDIO_DRIVE_TASK:
+            return smart_emulate_ioctl(bdev, mode, cmd, (void __user *)arg, read_nvme_health);
+
+        default: //any other ioctls are proxied as-is
+            return nvme_ioctl_org(bdev, mode, cmd, arg);
+    }
+}
+
+static int nvme_ioctl_smart_shim_install(void)
+{
+    if (unlikely(nvme_fops->ioctl == nvme_ioctl_smart_shim)) {
+        pr_loc_bug("nvme_ioctl() SMART shim was already installed");
+        return 0;
+    }
+
+    pr_loc_dbg("Rerouting nvme_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &nvme_fops->ioctl, nvme_fops->ioctl,
+               nvme_fops->ioctl, nvme_ioctl_smart_shim, nvme_ioctl_smart_shim);
+    nvme_ioctl_org = nvme_fops->ioctl;
+
+    WITH_MEM_UNLOCKED(
+        &nvme_fops->ioctl, sizeof(void *),
+        nvme_fops->ioctl = nvme_ioctl_smart_shim;
+    );
+
+    return 0;
+}
+
+static int nvme_ioctl_smart_shim_uninstall(void)
+{
+    if (!nvme_fops)
+        return 0;
+
+    pr_loc_dbg("Restoring nvme_fops->ioctl<%p>=%pF<%p> to %pF<%p>", &nvme_fops->ioctl, nvme_fops->ioctl,
+               nvme_fops->ioctl, nvme_ioctl_org, nvme_ioctl_org);
+
+    WITH_MEM_UNLOCKED(
+        &nvme_fops->ioctl, sizeof(void *),
+        nvme_fops->ioctl = nvme_ioctl_org;
+    );
+
+    nvme_ioctl_org = NULL;
+    nvme_fops = NULL;
+
+    return 0;
+}
+
+static int nvme_ioctl_canary_uninstall(void)
+{
+    if (!nvme_ioctl_canary_ovs)
+        return 0;
+
+    int out = restore_symbol(nvme_ioctl_canary_ovs);
+    if (out != 0) {
+        pr_loc_err("Failed to uninstall %s() canary", NVME_IOCTL_SYMBOL);
+        return out;
+    }
+
+    nvme_ioctl_canary_ovs = NULL;
+    return 0;
+}
+
+/**
+ * Captures nvme_fops on the first ioctl() to any NVMe namespace and installs nvme_ioctl_smart_shim() there
+ */
+static int nvme_ioctl_canary(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+    int out = 0;
+    mutex_lock(&nvme_ioctl_canary_lock);
+
+    //another ioctl() processed the canary while we were waiting for the lock
+    if (unlikely(!nvme_ioctl_canary_ovs))
+        goto out_unlock;
+
+    nvme_fops = (void *)bdev->bd_disk->fops; //forcefully remove "const" protection here
+    if ((out = nvme_ioctl_smart_shim_install()) != 0) {
+        pr_loc_err("Failed to install proper NVMe SMART shim");
+        goto out_unlock;
+    }
+
+    out = nvme_ioctl_canary_uninstall(); //it will log what's wrong
+
+    out_unlock:
+    mutex_unlock(&nvme_ioctl_canary_lock);
+    if (unlikely(out != 0 || !nvme_fops))
+        return -EIO; //we cannot continue as nvme_ioctl() wasn't restored and calling it can cause an infinite loop
+
+    return nvme_fops->ioctl(bdev, mode, cmd, arg);
+}
+
+static int nvme_ioctl_canary_install(void)
+{
+    mutex_lock(&nvme_ioctl_canary_lock);
+    nvme_ioctl_canary_ovs = override_symbol(NVME_IOCTL_SYMBOL, nvme_ioctl_canary);
+    if (IS_ERR(nvme_ioctl_canary_ovs)) {
+        int out = PTR_ERR(nvme_ioctl_canary_ovs);
+        pr_loc_err("Failed to install %s() canary - error=%d", NVME_IOCTL_SYMBOL, out);
+        nvme_ioctl_canary_ovs = NULL;
+        mutex_unlock(&nvme_ioctl_canary_lock);
+        return out;
+    }
+
+    mutex_unlock(&nvme_ioctl_canary_lock);
+    return 0;
+}
+
+/**
+ * Installs the canary when the NVMe driver (which may be a module loaded much later than us) registers
+ */
+static driver_watch_notify_result nvme_load_watcher(struct device_driver *drv, driver_watch_notify_state event)
+{
+    if (unlikely(event != DWATCH_STATE_LIVE))
+        return DWATCH_NOTIFY_CONTINUE;
+
+    driver_watcher = NULL; //returning DWATCH_NOTIFY_DONE causes automatic unwatching
+    if (!kernel_has_symbol(NVME_IOCTL_SYMBOL)) {
+        pr_loc_wrn("%s driver loaded but %s() doesn't exist - NVMe SMART will not be available", NVME_DRV_NAME,
+                   NVME_IOCTL_SYMBOL);
+        return DWATCH_NOTIFY_DONE;
+    }
+
+    pr_loc_dbg("%s driver loaded - installing canary", NVME_DRV_NAME);
+    nvme_ioctl_canary_install(); //it will log what's wrong; there's nothing more we can do from here
+    return DWATCH_NOTIFY_DONE;
+}
+
+/****************************************** Standard public API of the shim *******************************************/
+int register_nvme_smart_shim(void)
+{
+    shim_reg_in();
+
+    int out = bus_register_notifier(&pci_bus_type, &pci_nb);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register for PCI bus notifications - error=%d", out);
+        goto out_disabled;
+    }
+    pci_nb_registered = true;
+
+    if (kernel_has_symbol(NVME_IOCTL_SYMBOL)) {
+        pr_loc_dbg("NVMe driver exists - installing canary");
+        if ((out = nvme_ioctl_canary_install()) != 0)
+            goto out_unregister;
+    } else if ((out = is_driver_registered(NVME_DRV_NAME, &pci_bus_type)) != 0) {
+        //the driver is there but the ioctl() isn't called the way we expect (or the lookup failed) - not fatal
+        pr_loc_wrn("Cannot provide NVMe SMART - %s() not found (driver state=%d)", NVME_IOCTL_SYMBOL, out);
+    } else {
+        pr_loc_dbg("NVMe driver not loaded - waiting for it");
+        driver_watcher = watch_driver_register(NVME_DRV_NAME, nvme_load_watcher, DWATCH_STATE_LIVE);
+        if (unlikely(IS_ERR(driver_watcher))) {
+            out = PTR_ERR(driver_watcher);
+            driver_watcher = NULL;
+            pr_loc_err("Failed to register driver watcher for %s - error=%d", NVME_DRV_NAME, out);
+            goto out_unregister;
+        }
+    }
+
+    shim_reg_ok();
+    return 0;
+
+    out_unregister:
+    bus_unregister_notifier(&pci_bus_type, &pci_nb);
+    pci_nb_registered = false;
+    out_disabled:
+    //NVMe SMART is an extra - a failure here shouldn't prevent the whole module from loading
+    pr_loc_err("NVMe SMART will not be available - error=%d", out);
+    return 0;
+}
+
+int unregister_nvme_smart_shim(void)
+{
+    shim_ureg_in();
+
+    int out;
+    bool is_error = false;
+
+    if (driver_watcher) {
+        out = unwatch_driver_register(driver_watcher);
+        driver_watcher = NULL;
+        if (out != 0) {
+            pr_loc_err("Failed to unwatch %s driver - error=%d", NVME_DRV_NAME, out);
+            is_error = true;
+        }
+    }
+
+    mutex_lock(&nvme_ioctl_canary_lock);
+    if ((out = nvme_ioctl_canary_uninstall()) != 0)
+        is_error = true;
+
+    nvme_ioctl_smart_shim_uninstall();
+    mutex_unlock(&nvme_ioctl_canary_lock);
+
+    if (pci_nb_registered) {
+        if ((out = bus_unregister_notifier(&pci_bus_type, &pci_nb)) != 0) {
+            pr_loc_err("Failed to unsubscribe from PCI bus notifications - error=%d", out);
+            is_error = true;
+        }
+        pci_nb_registered = false;
+    }
+
+    drop_health_entries(NULL);
+
+    if (is_error)
+        return -EIO;
+
+    shim_ureg_ok();
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef REDPILL_NVME_SMART_SHIM_H
+#define REDPILL_NVME_SMART_SHIM_H
+
+int register_nvme_smart_shim(void);
+int unregister_nvme_smart_shim(void);
+
+#endif //REDPILL_NVME_SMART_SHIM_H
@@ -0,0 +1,254 @@
+#include "smart_cache.h"
+#include "../../common.h"
+#include "../../internal/scsi/hdparam.h" //ata_ioctl_buf_size()
+#include "../../internal/scsi/scsi_notifier.h" //subscribe_scsi_disk_events(), SCSI_EVT_*
+#include <linux/genhd.h> //struct gendisk, disk_to_dev()
+#include <linux/jiffies.h> //jiffies
+#include <linux/list.h> //list_*
+#include <linux/mutex.h> //DEFINE_MUTEX
+#include <linux/uaccess.h> //copy_to_user()
+#include <linux/version.h> //LINUX_VERSION_CODE, KERNEL_VERSION()
+#include <linux/workqueue.h> //periodic I/O counters sampling
+#include <scsi/scsi_device.h> //struct scsi_device
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#include <linux/part_stat.h> //part_stat_read()
+#endif
+
+#define SMART_CACHE_RESPONSE_LEN ata_ioctl_buf_size(1)
+
+//How often I/O counters of cached disks are sampled (see smart_cache_idle_time()); it should be well below the shortest
+// spin-down time used
+#ifndef SMART_CACHE_IO_SAMPLE_INTERVAL
+#define SMART_CACHE_IO_SAMPLE_INTERVAL (10 * HZ)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,19,0)
+#define DISK_STAT_READ READ
+#define DISK_STAT_WRITE WRITE
+#else
+#define DISK_STAT_READ STAT_READ
+#define DISK_STAT_WRITE STAT_WRITE
+#endif
+
+struct smart_cache_entry {
+    struct list_head list;
+    struct gendisk *disk;
+    struct device *sdev; //parent device of the disk (=scsi_device->sdev_gendev), used to match SCSI notifications
+    unsigned long valid; //bitmask of smart_cache_kind which are cached
+    unsigned long stored[SMART_CACHE__CNT]; //jiffies when the response was put
+    unsigned long lifetime[SMART_CACHE__CNT]; //jiffies for which the response is fresh (see smart_cache_put())
+    u64 io_total; //last I/O counters sampled (see disk_io_total())
+    unsigned long io_changed; //jiffies when io_total was last seen changing
+    u8 response[SMART_CACHE__CNT][SMART_CACHE_RESPONSE_LEN];
+};
+
+static LIST_HEAD(cache_entries);
+static DEFINE_MUTEX(cache_lock); //protects cache_entries; it's held while copying to userspace (which may sleep)
+static bool track_io = false; //whether io_sample_work runs (see register_smart_cache())
+static void sample_all_io(struct work_struct *work);
+static DECLARE_DELAYED_WORK(io_sample_work, sample_all_io);
+
+/**
+ * Returns a sum of (accounted) I/O counters of the disk; passthrough commands like SMART aren't counted
+ *
+ * part0.stamp cannot be used to tell when the last I/O happened, as on older kernels it's also bumped by merely reading
+ * /proc/diskstats or /sys/block/.../stat (which DSM does all the time).
+ */
+static u64 disk_io_total(struct gendisk *disk)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,11,0)
+    struct hd_struct *part = &disk->part0;
+#else
+    struct block_device *part = disk->part0;
+#endif
+
+    return (u64)part_stat_read(part, ios[DISK_STAT_READ]) + part_stat_read(part, ios[DISK_STAT_WRITE]) +
+           part_stat_read(part, sectors[DISK_STAT_READ]) + part_stat_read(part, sectors[DISK_STAT_WRITE]);
+}
+
+/**
+ * Updates the time of the last I/O if counters of the entry's disk changed since the last sample; call with cache_lock
+ */
+static void sample_io(struct smart_cache_entry *entry)
+{
+    u64 io_total = disk_io_total(entry->disk);
+    if (entry->io_total != io_total) {
+        entry->io_total = io_total;
+        entry->io_changed = jiffies;
+    }
+}
+
+/**
+ * Samples I/O counters of all cached disks, so that their idle time doesn't depend on how often SMART is requested
+ */
+static void sample_all_io(struct work_struct *work)
+{
+    struct smart_cache_entry *entry;
+
+    mutex_lock(&cache_lock);
+    list_for_each_entry(entry, &cache_entries, list) {
+        sample_io(entry);
+    }
+    mutex_unlock(&cache_lock);
+
+    schedule_delayed_work(&io_sample_work, SMART_CACHE_IO_SAMPLE_INTERVAL);
+}
+
+static struct smart_cache_entry *find_entry(struct gendisk *disk)
+{
+    struct smart_cache_entry *entry;
+    list_for_each_entry(entry, &cache_entries, list) {
+        if (entry->disk == disk)
+            return entry;
+    }
+
+    return NULL;
+}
+
+int smart_cache_get(struct gendisk *disk, smart_cache_kind kind, void __user *buff_ptr, unsigned long max_age)
+{
+    int out = -ENOENT;
+
+    mutex_lock(&cache_lock);
+    struct smart_cache_entry *entry = find_entry(disk);
+    if (entry && test_bit(kind, &entry->valid)) {
+        //unsigned subtraction makes the age correct even when jiffies wrap around
+        if (jiffies - entry->stored[kind] >= max(entry->lifetime[kind], max_age)) {
+            mutex_unlock(&cache_lock);
+            return -ENOENT;
+        }
+
+        out = 0;
+        if (unlikely(copy_to_user(buff_ptr, entry->response[kind], SMART_CACHE_RESPONSE_LEN) != 0)) {
+            pr_loc_err("Failed to copy cached response kind=%d to user ptr=%p", kind, buff_ptr);
+            out = -EFAULT;
+        }
+    }
+    mutex_unlock(&cache_lock);
+
+    return out;
+}
+
+void smart_cache_put(struct gendisk *disk, smart_cache_kind kind, const u8 *response, unsigned long lifetime)
+{
+    if (unlikely(kind >= SMART_CACHE__CNT)) {
+        pr_loc_bug("Invalid SMART cache kind %d", kind);
+        return;
+    }
+
+    mutex_lock(&cache_lock);
+    struct smart_cache_entry *entry = find_entry(disk);
+    if (!entry) {
+        entry = kmalloc(sizeof(struct smart_cache_entry), GFP_KERNEL);
+        if (unlikely(!entry)) {
+            pr_loc_wrn("Failed to allocate SMART cache entry for /dev/%s - it will not be cached", disk->disk_name);
+            mutex_unlock(&cache_lock);
+            return;
+        }
+
+        entry->disk = disk;
+        entry->sdev = disk_to_dev(disk)->parent;
+        entry->valid = 0;
+        entry->io_total = track_io ? disk_io_total(disk) : 0;
+        entry->io_changed = jiffies;
+        list_add(&entry->list, &cache_entries);
+        pr_loc_dbg("Created SMART cache entry for /dev/%s", disk->disk_name);
+    }
+
+    memcpy(entry->response[kind], response, SMART_CACHE_RESPONSE_LEN);
+    entry->stored[kind] = jiffies;
+    entry->lifetime[kind] = lifetime;
+    set_bit(kind, &entry->valid);
+    mutex_unlock(&cache_lock);
+}
+
+unsigned long smart_cache_idle_time(struct gendisk *disk)
+{
+    unsigned long idle = 0;
+
+    mutex_lock(&cache_lock);
+    struct smart_cache_entry *entry = find_entry(disk);
+    if (entry && track_io) {
+        sample_io(entry); //I/O since the last periodic sample happened just now, as far as we can tell
+        idle = jiffies - entry->io_changed;
+    }
+    mutex_unlock(&cache_lock);
+
+    return idle;
+}
+
+void smart_cache_invalidate(struct gendisk *disk)
+{
+    mutex_lock(&cache_lock);
+    struct smart_cache_entry *entry = find_entry(disk);
+    if (entry) {
+        pr_loc_dbg("Invalidating SMART cache entry for /dev/%s", disk->disk_name);
+        list_del(&entry->list);
+        kfree(entry);
+    }
+    mutex_unlock(&cache_lock);
+}
+
+/**
+ * Drops entries of all disks attached to a given SCSI device (or all entries if sdev is NULL)
+ */
+static void invalidate_sdev(struct device *sdev)
+{
+    struct smart_cache_entry *entry, *tmp;
+
+    mutex_lock(&cache_lock);
+    list_for_each_entry_safe(entry, tmp, &cache_entries, list) {
+        if (sdev && entry->sdev != sdev)
+            continue;
+
+        list_del(&entry->list);
+        kfree(entry);
+    }
+    mutex_unlock(&cache_lock);
+}
+
+/**
+ * Drops cached responses when a disk goes away or is (re)probed, as its gendisk may be gone or reused
+ */
+static int scsi_disk_event_handler(struct notifier_block *self, unsigned long state, void *data)
+{
+    if (state != SCSI_EVT_DEV_REMOVING && state != SCSI_EVT_DEV_PROBING)
+        return NOTIFY_DONE;
+
+    struct scsi_device *sdp = data;
+    invalidate_sdev(&sdp->sdev_gendev);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block scsi_disk_nb = {
+    .notifier_call = scsi_disk_event_handler,
+};
+
+int register_smart_cache(bool track_io_)
+{
+    int out = subscribe_scsi_disk_events(&scsi_disk_nb);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to register for SCSI disks notifications - error=%d", out);
+        return out;
+    }
+
+    track_io = track_io_;
+    if (track_io)
+        schedule_delayed_work(&io_sample_work, SMART_CACHE_IO_SAMPLE_INTERVAL);
+
+    return 0;
+}
+
+int unregister_smart_cache(void)
+{
+    int out = unsubscribe_scsi_disk_events(&scsi_disk_nb);
+    if (unlikely(out != 0))
+        pr_loc_err("Failed to unsubscribe from SCSI disks notifications - error=%d", out);
+
+    if (track_io) {
+        cancel_delayed_work_sync(&io_sample_work); //it re-arms itself but cancel_*_sync() handles that
+        track_io = false;
+    }
+    invalidate_sdev(NULL);
+    return out;
+}
@@ -0,0 +1,77 @@
+/**
+ * Per-disk cache of final HDIO_DRIVE_CMD responses produced by the SMART shim
+ *
+ * DSM storage daemons issue the same ATA commands (most notably IDENTIFY DEVICE) over and over for every disk. The
+ * answer to them doesn't change unless the disk is replaced or reconfigured, so after the SMART shim produces a final
+ * response (i.e. the original one from the drive + our modifications, or a fake one) it's stored here and served
+ * directly to the userspace next time, without reaching the device at all.
+ *
+ * Responses which do change over time (e.g. SMART values read from the disk) are stored with a limited lifetime, after
+ * which they are treated as a miss. This is mainly useful for disks where getting them is expensive (see smart_sat.h).
+ * A caller can also explicitly accept responses older than their lifetime, e.g. to not wake up a sleeping disk. To
+ * tell whether a disk sleeps the cache can also track when its I/O counters last changed (see smart_cache_idle_time()).
+ * They're sampled periodically (every SMART_CACHE_IO_SAMPLE_INTERVAL) and not just when SMART is requested, so that
+ * e.g. the first request after an I/O burst doesn't see the disk as active if it went idle long before that.
+ *
+ * Entries are keyed by the gendisk and are dropped when the underlying SCSI device is removed (or probed again) as
+ * signaled by the SCSI notifier. They can also be dropped explicitly when a command which may change them is sent.
+ */
+#ifndef REDPILL_SMART_CACHE_H
+#define REDPILL_SMART_CACHE_H
+
+#include <linux/kernel.h> //ULONG_MAX
+#include <linux/types.h> //u8
+
+struct gendisk;
+
+#define SMART_CACHE_FOREVER ULONG_MAX //lifetime of responses valid until invalidated
+
+typedef enum {
+    SMART_CACHE_IDENTIFY = 0, //ATA_CMD_ID_ATA
+    SMART_CACHE_VALUES, //ATA_CMD_SMART => ATA_SMART_READ_VALUES
+    SMART_CACHE_THRESHOLDS, //ATA_CMD_SMART => ATA_SMART_READ_THRESHOLDS
+    SMART_CACHE__CNT
+} smart_cache_kind;
+
+/**
+ * Copies a cached response (header + data, as returned by HDIO_DRIVE_CMD) to the userspace ioctl() buffer
+ *
+ * @param max_age age (in jiffies) up to which the response is acceptable even if it outlived its lifetime; 0 = none
+ *
+ * @return 0 on hit, -ENOENT on miss, -EFAULT if the copy failed
+ */
+int smart_cache_get(struct gendisk *disk, smart_cache_kind kind, void __user *buff_ptr, unsigned long max_age);
+
+/**
+ * Stores a final response (header + one sector of data, i.e. ata_ioctl_buf_size(1) bytes) for a disk
+ *
+ * Failure to store (e.g. no memory) is not fatal - the next request will simply not be served from cache.
+ *
+ * @param lifetime time in jiffies for which the response is served (SMART_CACHE_FOREVER = until invalidated); with 0 it
+ *                 will only be served to callers explicitly accepting older responses
+ */
+void smart_cache_put(struct gendisk *disk, smart_cache_kind kind, const u8 *response, unsigned long lifetime);
+
+/**
+ * Returns for how long I/O counters of a disk didn't change
+ *
+ * The time is only tracked for disks which have an entry (i.e. something was put for them), and it counts from when
+ * the entry was created. It's precise up to SMART_CACHE_IO_SAMPLE_INTERVAL, and only if the cache was registered with
+ * I/O tracking enabled (see register_smart_cache()).
+ *
+ * @return jiffies since I/O counters of the disk were last seen changing; 0 if the disk has no entry
+ */
+unsigned long smart_cache_idle_time(struct gendisk *disk);
+
+/**
+ * Drops all cached responses of a disk
+ */
+void smart_cache_invalidate(struct gendisk *disk);
+
+/**
+ * @param track_io whether to periodically sample I/O counters of cached disks (needed for smart_cache_idle_time())
+ */
+int register_smart_cache(bool track_io);
+int unregister_smart_cache(void);
+
+#endif //REDPILL_SMART_CACHE_H
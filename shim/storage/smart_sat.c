@@ -0,0 +1,247 @@
+#ifndef SMART_DISABLE_SAT
+#include "smart_sat.h"
+#include "../../common.h"
+#include "../../internal/scsi/hdparam.h" //HDIO_DRIVE_CMD_*, ata_ioctl_buf_size()
+#include "../../internal/scsi/scsiparam.h" //SCSI_CMD_TIMEOUT, SCSI_BUF_SIZE
+#include "../../internal/scsi/scsi_toolbox.h" //is_scsi_leaf(), is_scsi_disk()
+#include <linux/dma-direction.h> //DMA_FROM_DEVICE
+#include <linux/genhd.h> //struct gendisk, disk_to_dev()
+#include <linux/unaligned/be_byteshift.h> //get_unaligned_be16(), get_unaligned_be32()
+#include <scsi/scsi.h> //ATA_16, LOG_SENSE, READ_DEFECT_DATA, ILLEGAL_REQUEST
+#include <scsi/scsi_eh.h> //struct scsi_sense_hdr, scsi_sense_valid()
+#include <scsi/scsi_device.h> //struct scsi_device, scsi_execute_req()
+
+#define SAT_CMD_RETRIES 1 //SMART is polled periodically - there's no point in retrying a lot
+#define SAT_PROTO_PIO_DATA_IN 4 //ATA PASS-THROUGH protocol field (byte 1, bits 1-4)
+#define SAT_FLAGS_PIO_IN_SECT 0x0e //T_DIR=from device, BYT_BLOK=blocks, T_LENGTH=in sector count field
+
+#define LOG_SENSE_PC_CUMULATIVE (1 << 6) //page control: cumulative values
+#define LOG_PAGE_WRITE_ERRORS 0x02
+#define LOG_PAGE_READ_ERRORS 0x03
+#define LOG_PAGE_TEMPERATURE 0x0d
+#define LOG_PAGE_START_STOP 0x0e
+#define LOG_PAGE_BG_SCAN 0x15
+#define LOG_PARAM_TOTAL_UNCORRECTED 0x0006 //in read/write error counter pages
+#define LOG_PARAM_TEMPERATURE 0x0000
+#define LOG_PARAM_START_STOP_CYCLES 0x0004
+#define LOG_PARAM_BG_SCAN_STATUS 0x0000 //begins with accumulated power-on minutes
+#define LOG_HDR_LEN 4
+#define LOG_PARAM_HDR_LEN 4
+
+#define DEFECT_REQ_GLIST (1 << 3)
+#define DEFECT_FORMAT_BYTES_FROM_INDEX 4
+#define DEFECT_HDR_LEN 4
+
+struct scsi_device *smart_sat_get_sdev(struct gendisk *disk)
+{
+    struct device *parent = disk_to_dev(disk)->parent;
+    if (unlikely(!parent) || !is_scsi_leaf(parent))
+        return NULL;
+
+    struct scsi_device *sdp = to_scsi_device(parent);
+    return is_scsi_disk(sdp) ? sdp : NULL;
+}
+
+/**
+ * Executes a data-in SCSI command and translates its result into -E
+ */
+static int exec_data_in(struct scsi_device *sdp, const u8 *cdb, u8 *buffer, unsigned int len)
+{
+    struct scsi_sense_hdr sshdr;
+
+    memset(buffer, 0, len);
+    int out = scsi_execute_req(sdp, cdb, DMA_FROM_DEVICE, buffer, len, &sshdr, SCSI_CMD_TIMEOUT, SAT_CMD_RETRIES,
+                               NULL);
+    if (likely(out == 0))
+        return 0;
+
+    if (scsi_sense_valid(&sshdr) && sshdr.sense_key == ILLEGAL_REQUEST) {
+        pr_loc_dbg("SCSI cmd 0x%02x rejected by /dev/%s as illegal (asc=0x%02x ascq=0x%02x)", cdb[0],
+                   sdp->syno_disk_name, sshdr.asc, sshdr.ascq);
+        return -EOPNOTSUPP;
+    }
+
+    pr_loc_dbg("SCSI cmd 0x%02x failed - result=0x%x", cdb[0], out);
+    return -EIO;
+}
+
+int smart_sat_ata_cmd(struct scsi_device *sdp, const u8 *req_header, u8 *response)
+{
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT] != 1)) {
+        pr_loc_bug("Only single sector ATA commands can be passed through");
+        return -EINVAL;
+    }
+
+    u8 *buffer;
+    kmalloc_or_exit_int(buffer, ATA_SECT_SIZE);
+
+    u8 cdb[16] = {
+        [0] = ATA_16,
+        [1] = SAT_PROTO_PIO_DATA_IN << 1,
+        [2] = SAT_FLAGS_PIO_IN_SECT,
+        [4] = req_header[HDIO_DRIVE_CMD_HDR_FEATURE],
+        [6] = req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT],
+        [8] = req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM], //LBA low = log address for SMART READ LOG
+        [14] = req_header[HDIO_DRIVE_CMD_HDR_CMD],
+    };
+
+    //SMART commands require a "key" in LBA mid & high registers (see "8.55 SMART" in ATA/ATAPI-6)
+    if (req_header[HDIO_DRIVE_CMD_HDR_CMD] == ATA_CMD_SMART) {
+        cdb[10] = ATA_SMART_LBAM_PASS;
+        cdb[12] = ATA_SMART_LBAH_PASS;
+    }
+
+    int out = exec_data_in(sdp, cdb, buffer, ATA_SECT_SIZE);
+    if (out == 0) {
+        response[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
+        response[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
+        response[HDIO_DRIVE_CMD_RET_SEC_CNT] = req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT];
+        response[HDIO_DRIVE_CMD_RET_SEC_CNT + 1] = 0x00;
+        memcpy(response + HDIO_DRIVE_CMD_HDR_OFFSET, buffer, ATA_SECT_SIZE);
+    }
+
+    kfree(buffer);
+    return out;
+}
+
+/**
+ * Reads a log page into the buffer
+ *
+ * @return length of the page parameters (following the page header), or -E on error
+ */
+static int log_sense(struct scsi_device *sdp, u8 page, u8 *buffer)
+{
+    u8 cdb[10] = {
+        [0] = LOG_SENSE,
+        [2] = LOG_SENSE_PC_CUMULATIVE | page,
+        [7] = (SCSI_BUF_SIZE >> 8) & 0xff,
+        [8] = SCSI_BUF_SIZE & 0xff,
+    };
+
+    int out = exec_data_in(sdp, cdb, buffer, SCSI_BUF_SIZE);
+    if (out != 0)
+        return out;
+
+    if (unlikely((buffer[0] & 0x3f) != page)) {
+        pr_loc_dbg("Expected log page 0x%02x, got 0x%02x", page, buffer[0] & 0x3f);
+        return -EIO;
+    }
+
+    return min_t(int, get_unaligned_be16(&buffer[2]), SCSI_BUF_SIZE - LOG_HDR_LEN);
+}
+
+/**
+ * Finds a parameter in a log page read by log_sense()
+ *
+ * @return pointer to the parameter value or NULL if not found; *len is set to the length of the value
+ */
+static const u8 *log_find_param(const u8 *buffer, int page_len, u16 code, unsigned int *len)
+{
+    const u8 *param = buffer + LOG_HDR_LEN;
+    const u8 *end = param + page_len;
+
+    while (param + LOG_PARAM_HDR_LEN <= end) {
+        unsigned int param_len = param[3];
+        if (param + LOG_PARAM_HDR_LEN + param_len > end)
+            break;
+
+        if (get_unaligned_be16(param) == code) {
+            *len = param_len;
+            return param + LOG_PARAM_HDR_LEN;
+        }
+
+        param += LOG_PARAM_HDR_LEN + param_len;
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads a big-endian counter (of any length up to 8 bytes) from a log page
+ */
+static bool log_read_counter(const u8 *buffer, int page_len, u16 code, u64 *value)
+{
+    unsigned int len;
+    const u8 *param = log_find_param(buffer, page_len, code, &len);
+    if (!param || len == 0 || len > sizeof(u64))
+        return false;
+
+    *value = 0;
+    for (unsigned int i = 0; i < len; ++i)
+        *value = (*value << 8) | param[i];
+
+    return true;
+}
+
+/**
+ * Reads the number of entries in the grown defect list
+ */
+static int read_grown_defects(struct scsi_device *sdp, u8 *buffer, u32 *count)
+{
+    u8 cdb[10] = {
+        [0] = READ_DEFECT_DATA,
+        [2] = DEFECT_REQ_GLIST | DEFECT_FORMAT_BYTES_FROM_INDEX,
+        [8] = DEFECT_HDR_LEN, //only the header (containing the list length) is needed
+    };
+
+    int out = exec_data_in(sdp, cdb, buffer, DEFECT_HDR_LEN);
+    if (out != 0)
+        return out;
+
+    //Short block format (0) uses 4 bytes per entry, all others 8 bytes
+    *count = get_unaligned_be16(&buffer[2]) / (((buffer[1] & 0x07) == 0) ? 4 : 8);
+    return 0;
+}
+
+int smart_sat_read_scsi_health(struct scsi_device *sdp, struct smart_health *health)
+{
+    u8 *buffer;
+    int len;
+    u64 value;
+
+    kmalloc_or_exit_int(buffer, SCSI_BUF_SIZE);
+    memset(health, 0, sizeof(*health));
+
+    if ((len = log_sense(sdp, LOG_PAGE_TEMPERATURE, buffer)) > 0 &&
+        log_read_counter(buffer, len, LOG_PARAM_TEMPERATURE, &value) && (value & 0xff) != 0xff) {
+        health->temp = value & 0xff; //1st byte is reserved, 2nd is the temperature (0xff = not available)
+        health->valid |= SMART_HEALTH_TEMP;
+    }
+
+    if ((len = log_sense(sdp, LOG_PAGE_START_STOP, buffer)) > 0 &&
+        log_read_counter(buffer, len, LOG_PARAM_START_STOP_CYCLES, &value)) {
+        health->start_stop = value;
+        health->valid |= SMART_HEALTH_START_STOP;
+    }
+
+    unsigned int param_len;
+    const u8 *param;
+    if ((len = log_sense(sdp, LOG_PAGE_BG_SCAN, buffer)) > 0 &&
+        (param = log_find_param(buffer, len, LOG_PARAM_BG_SCAN_STATUS, &param_len)) && param_len >= 4) {
+        health->power_on_hours = get_unaligned_be32(param) / 60; //it's stored in minutes
+        health->valid |= SMART_HEALTH_POWER_ON_HOURS;
+    }
+
+    if ((len = log_sense(sdp, LOG_PAGE_READ_ERRORS, buffer)) > 0 &&
+        log_read_counter(buffer, len, LOG_PARAM_TOTAL_UNCORRECTED, &value)) {
+        health->uncorrected += value;
+        health->valid |= SMART_HEALTH_UNCORRECTED;
+    }
+
+    if ((len = log_sense(sdp, LOG_PAGE_WRITE_ERRORS, buffer)) > 0 &&
+        log_read_counter(buffer, len, LOG_PARAM_TOTAL_UNCORRECTED, &value)) {
+        health->uncorrected += value;
+        health->valid |= SMART_HEALTH_UNCORRECTED;
+    }
+
+    if (read_grown_defects(sdp, buffer, &health->grown_defects) == 0)
+        health->valid |= SMART_HEALTH_GROWN_DEFECTS;
+
+    kfree(buffer);
+    pr_loc_dbg("Read SCSI health of /dev/%s: valid=0x%02x temp=%u poh=%u ss=%u defects=%u uncorrected=%llu",
+               sdp->syno_disk_name, health->valid, health->temp, health->power_on_hours, health->start_stop,
+               health->grown_defects, health->uncorrected);
+
+    return health->valid ? 0 : -EOPNOTSUPP;
+}
+#endif //SMART_DISABLE_SAT
@@ -0,0 +1,56 @@
+/**
+ * Access to real SMART data of disks behind SCSI HBAs which don't support HDIO_DRIVE_CMD
+ *
+ * HDIO_DRIVE_CMD is only translated to ATA commands by libata. Disks connected to other HBAs (e.g. SAS HBAs with their
+ * own SCSI/ATA translation layer) reject it, and the SMART shim used to fake data for them. However, such HBAs usually
+ * implement SAT (SCSI/ATA Translation, T10/1826-D) for SATA disks, so ATA commands can still be sent to them wrapped in
+ * SCSI ATA PASS-THROUGH(16). Real SAS disks don't speak ATA at all, but most of the interesting health data (temperature,
+ * power-on time, grown defects, uncorrected errors) can be read from their SCSI log pages (LOG SENSE) and the grown
+ * defect list (READ DEFECT DATA). The SMART shim converts these into ATA SMART attributes.
+ *
+ * The translation can be disabled by defining SMART_DISABLE_SAT.
+ *
+ * References
+ *  - T10 SAT (SCSI / ATA Translation), section "ATA PASS-THROUGH (16) command"
+ *  - T10 SPC-4 (SCSI Primary Commands), section "Log parameters" & SBC-3 for READ DEFECT DATA
+ */
+#ifndef REDPILL_SMART_SAT_H
+#define REDPILL_SMART_SAT_H
+
+#include "smart_shim.h" //struct smart_health
+
+struct gendisk;
+struct scsi_device;
+
+#ifndef SMART_DISABLE_SAT
+/**
+ * Finds SCSI device of a disk
+ *
+ * @return scsi_device or NULL if the disk isn't a SCSI one
+ */
+struct scsi_device *smart_sat_get_sdev(struct gendisk *disk);
+
+/**
+ * Executes a single-sector PIO data-in ATA command (e.g. IDENTIFY or SMART READ VALUES) using ATA PASS-THROUGH(16)
+ *
+ * @param req_header HDIO_DRIVE_CMD request header (cmd, sector number, feature, sector count)
+ * @param response buffer of ata_ioctl_buf_size(1) bytes; on success it will be populated like HDIO_DRIVE_CMD would
+ *
+ * @return 0 on success, -EOPNOTSUPP if the device doesn't accept ATA PASS-THROUGH (e.g. it's a SAS disk), -ENOMEM,
+ *         or -EIO on other errors
+ */
+int smart_sat_ata_cmd(struct scsi_device *sdp, const u8 *req_header, u8 *response);
+
+/**
+ * Reads health data of a SCSI (SAS) disk from its log pages & grown defect list
+ *
+ * @return 0 if at least one field was read, -EOPNOTSUPP if none could be read, or -ENOMEM
+ */
+int smart_sat_read_scsi_health(struct scsi_device *sdp, struct smart_health *health);
+#else //SMART_DISABLE_SAT
+#define smart_sat_get_sdev(disk) ((struct scsi_device *)NULL)
+#define smart_sat_ata_cmd(sdp, req_header, response) (-EOPNOTSUPP)
+#define smart_sat_read_scsi_health(sdp, health) (-EOPNOTSUPP)
+#endif //SMART_DISABLE_SAT
+
+#endif //REDPILL_SMART_SAT_H
@@ -48,12 +48,35 @@
  *
  *
  * LIMITATIONS
- *   - Values are always static and the same for all drives
+ *   - Values are always static and the same for all drives (unless they can be read via SCSI, see below)
  *   - Power-on hours & other counters (e.g. start-stop count) are static
  *     - Ideally values should be calculated as hours from some date to ensure they increase
  *     - Start-stop counter (and others) can be derived from power-on hours using linear regression
  *
  *
+ * CACHING
+ * DSM queries ATA IDENTIFY for every disk very often. The final IDENTIFY response (real one, possibly with SMART flags
+ * patched, or a fake one) is cached per disk (see smart_cache.h), so repeated requests never reach the device. The cache
+ * is dropped when the disk is removed/re-probed, or when a command which can change IDENTIFY data is sent through
+ * HDIO_DRIVE_CMD (see ata_cmd_may_change_identify()). Changes made via SG_IO are not tracked.
+ * Fake SMART values, thresholds & logs are the same for every disk and never change, so they're built only once when
+ * the shim registers (see build_smart_sectors()).
+ *
+ *
+ * DISKS BEHIND SCSI HBAs
+ * Disks connected to HBAs not driven by libata reject HDIO_DRIVE_CMD. Before faking anything for them, IDENTIFY and
+ * SMART values/thresholds are requested using SCSI ATA PASS-THROUGH, and for SAS disks the most important counters of
+ * the fake values are replaced with ones from SCSI log pages (see smart_sat.h and populate_sat_smart()). These are
+ * cached with a TTL of SMART_SAT_CACHE_TTL. SMART logs, tests & HDIO_DRIVE_TASK status are still faked for such disks.
+ *
+ *
+ * SLEEPING DISKS
+ * Every SMART request reaching a disk spins it up. Optionally (see smart_shim_set_sleep_cache()) the last real SMART
+ * values & thresholds of each disk are kept and served from memory when the disk had no I/O for the spin-down time,
+ * up to a configured max age. IDENTIFY is always cached (see above). HDIO_DRIVE_TASK (SMART STATUS) and commands sent
+ * via SG_IO still reach the disk.
+ *
+ *
  * SEQUENCE OF ACTIONS FOR IOCTL REPLACEMENT
  * This submodule has a rather unintuitive initialization sequence (it's multistage). It works in the following order:
  *   1. Checks if "sd" driver is loaded
@@ -78,6 +101,7 @@
  *  - https://github.com/qemu/qemu/blob/266469947161aa10b1d36843580d369d5aa38589/hw/ide/core.c#L1826 (qemu SMART)
  */
 #include "smart_shim.h"
+#include "../../config/runtime_config.h" //struct smart_sleep_cache
 #include "../shim_base.h"
 #include "../../common.h"
 #include "../../internal/intercept_driver_register.h" //waiting for "sd" driver to load
@@ -87,6 +111,8 @@
 #include "../../internal/scsi/scsi_toolbox.h" //checking for "sd" driver load state
 #include "../../internal/override/override_symbol.h" //installing sd_ioctl_canary()
 #include "scsi_disk_serial.h" // rp_fetch_block_serial()
+#include "smart_cache.h" //smart_cache_*()
+#include "smart_sat.h" //smart_sat_*(), struct smart_health
 #include <linux/fs.h> //struct block_device
 #include <linux/genhd.h> //struct gendisk
 #include <linux/blkdev.h> //struct block_device_operations
@@ -95,6 +121,21 @@
 
 #define SHIM_NAME "SMART emulator"
 
+//How long SMART values/thresholds obtained via SAT/LOG SENSE (see smart_sat.h) are served from cache before the disk
+// is asked again. DSM polls SMART much more often than these values meaningfully change.
+#ifndef SMART_SAT_CACHE_TTL
+#define SMART_SAT_CACHE_TTL (60 * HZ)
+#endif
+
+//Serving SMART of sleeping disks from memory is opt-in (see smart_shim_set_sleep_cache() & CMDLINE_CT_SMART_SLEEP); 0
+// idle time = disabled
+#ifndef SMART_SLEEP_CACHE_IDLE_SEC
+#define SMART_SLEEP_CACHE_IDLE_SEC 0
+#endif
+#ifndef SMART_SLEEP_CACHE_MAX_AGE_SEC
+#define SMART_SLEEP_CACHE_MAX_AGE_SEC (24 * 60 * 60)
+#endif
+
 #ifdef DBG_SMART_PRINT_ALL_IOCTL
 #define pr_loc_dbg_ioctl(cmd_hex, subcmd_name, bdev) \
     pr_loc_dbg("Handling ioctl(0x%x)->%s for /dev/%s", cmd_hex, subcmd_name, (bdev)->bd_disk->disk_name);
@@ -111,6 +152,8 @@ static int (*sd_ioctl_org) (struct block_device *, fmode_t, unsigned, unsigned l
 struct block_device_operations *sd_fops = NULL; //ptr to drivers/scsi/sd.c:sd_fops [to restore sd_ioctl on removal]
 static struct override_symbol_inst* sd_ioctl_canary_ovs = NULL; //sd_ioctl() override for canary
 static spinlock_t sd_ioctl_canary_lock;
+static unsigned long sleep_cache_idle __read_mostly = SMART_SLEEP_CACHE_IDLE_SEC * HZ; //jiffies; 0 = disabled
+static unsigned long sleep_cache_max_age __read_mostly = SMART_SLEEP_CACHE_MAX_AGE_SEC * HZ; //jiffies
 
 /********************************************* Fake SMART data definition *********************************************/
 //see "Table 4: SMART Attribute Summary" in micron.com document for a nice summary
@@ -270,7 +313,8 @@ static __always_inline void put_ioctl_buffer(unsigned char *buffer)
 }
 
 /*************************************** ATAPI/WIN command interface handling *****************************************/
-static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, const char* const disk_name)
+static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, const char* const disk_name,
+                           struct gendisk *disk)
 {
     pr_loc_dbg("Generating completely fake ATA IDENTITY");
 
@@ -309,10 +353,40 @@ static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, const ch
         return -EFAULT;
     }
 
+    if (disk)
+        smart_cache_put(disk, SMART_CACHE_IDENTIFY, kbuf, SMART_CACHE_FOREVER);
     kfree(kbuf);
     return 0;
 }
 
+/**
+ * Reads ATA IDENTIFY using ATA PASS-THROUGH (see smart_sat.h) into user ioctl() buffer
+ *
+ * @return 0 on success, -EOPNOTSUPP if the disk cannot be asked that way, -EFAULT when data fails to copy to user
+ *         buffer, or other -E on errors
+ */
+static int populate_sat_identify(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
+{
+    struct scsi_device *sdp = smart_sat_get_sdev(disk);
+    if (!sdp || req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT] != ATA_CMD_ID_ATA_SECTORS)
+        return -EOPNOTSUPP;
+
+    unsigned char *kbuf;
+    kmalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS));
+
+    int out = smart_sat_ata_cmd(sdp, req_header, kbuf);
+    if (out == 0) {
+        pr_loc_dbg("Got real ATA IDENTIFY via SAT for /dev/%s", disk->disk_name);
+        if (unlikely(copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_CMD_ID_ATA_SECTORS)) != 0)) {
+            pr_loc_err("Failed to copy SAT ATA IDENTIFY packet to user ptr=%p", (void *)buff_ptr);
+            out = -EFAULT;
+        }
+    }
+
+    kfree(kbuf);
+    return out;
+}
+
 /**
  * Handles on-the-fly modification of data related to ATA IDENTIFY DEVICE command
  *
@@ -322,18 +396,25 @@ static int populate_ata_id(const u8 *req_header, void __user *buff_ptr, const ch
  *                              handle_hdio_drive_cmd_ioctl()). This command shouldn't normally fail for any drive.
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be read and possibly altered
+ * @param disk disk the final response will be cached for
  *
  * @return definitive exit code for the ioctl(); in practice 0 when succedded [regardless of the modifications made] or
  *         the same error code as org_ioctl_exec_result passed
  */
-static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_header, void __user *buff_ptr, const char* const disk_name)
+static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_header, void __user *buff_ptr,
+                                   const char* const disk_name, struct gendisk *disk)
 {
     //ATA IDENTIFY should not fail - it may mean a problem with a disk or the "disk" is a adapter (e.g. IDE>SATA) with
     // no disk connected, or if executed against a USB flash drive... or it's an VirtIO SCSI disk read as ATA
     if (unlikely(org_ioctl_exec_result != 0)) {
         pr_loc_dbg("sd_ioctl(HDIO_DRIVE_CMD ; ATA_CMD_ID_ATA) failed with error=%d, attempting to emulate something",
                    org_ioctl_exec_result);
-        return populate_ata_id(req_header, buff_ptr, disk_name);
+        //SATA disks behind a SAS HBA will still answer when asked via SAT, and the rest of the flow can continue
+        int sat_out = populate_sat_identify(req_header, buff_ptr, disk);
+        if (sat_out == -EFAULT)
+            return sat_out;
+        else if (sat_out != 0)
+            return populate_ata_id(req_header, buff_ptr, disk_name, disk);
     }
 
     //sanity check if requested ATA IDENTIFY sector count is really what we're planning to copy
@@ -353,6 +434,7 @@ static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_head
     u16 *ata_identity = (u16 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
     if (ata_is_smart_supported(ata_identity) && ata_is_smart_enabled(ata_identity)) {
         pr_loc_dbg("ATA_CMD_ID_ATA confirmed SMART support - noop");
+        smart_cache_put(disk, SMART_CACHE_IDENTIFY, kbuf, SMART_CACHE_FOREVER);
         put_ioctl_buffer(kbuf); //we no longer need the buffer as we're not touching it, we've only read it
         return 0; //SMART supported, pass identity as-is
     }
@@ -370,37 +452,37 @@ static int handle_ata_cmd_identify(int org_ioctl_exec_result, const u8 *req_head
         return -EFAULT;
     }
 
+    smart_cache_put(disk, SMART_CACHE_IDENTIFY, kbuf, SMART_CACHE_FOREVER);
     put_ioctl_buffer(kbuf);
     return 0;
 }
 
+/********************************************** Precomputed SMART sectors *********************************************/
+//The fake SMART data is constant, so every response which doesn't depend on the disk (header + a single sector with
+// its checksum) is built once by build_smart_sectors() when the shim registers. From then on these buffers are only
+// read and copied to the userspace as-is, which makes SMART polling free of allocations & recalculations.
+typedef enum {
+    SMART_SECT_VALUES = 0, //ATA_SMART_READ_VALUES
+    SMART_SECT_THRESHOLDS, //ATA_SMART_READ_THRESHOLDS
+    SMART_SECT_LOG_DIR, //WIN_FT_SMART_READ_LOG_SECTOR of log 0x00
+    SMART_SECT_LOG_SUMMARY, //WIN_FT_SMART_READ_LOG_SECTOR of log 0x01
+    SMART_SECT_LOG_COMP, //WIN_FT_SMART_READ_LOG_SECTOR of log 0x02
+    SMART_SECT_LOG_SELF_TEST, //WIN_FT_SMART_READ_LOG_SECTOR of log 0x06
+    SMART_SECT__CNT
+} smart_sector;
+
+#define SMART_SECT_BUF_SIZE ata_ioctl_buf_size(1)
+static u8 smart_sectors[SMART_SECT__CNT][SMART_SECT_BUF_SIZE] __read_mostly;
+
 /**
- * Populates user ioctl() buffer with fake SMART snapshot values
- *
- * This function is responsible for the generation of data which you see in a usual tabular format as a result of
- * "smartctl -A" command. The data is formated from the "fake_smart" constant array present on the top of this file.
+ * Builds SMART snapshot values (including thresholds) from the "fake_smart" constant array present on the top of this
+ * file
  *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @param kbuf ioctl() buffer (header + sector) to build the response in; it must be zeroed
  */
-static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr)
+static void build_ata_smart_values(u8 *kbuf)
 {
-    pr_loc_dbg("Generating fake SMART values");
-
-    //sanity check if requested SMART READ VALUES sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ VALUES, got %d",
-                   ATA_SMART_READ_VALUES_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
     int i, j;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS));
     u8 *smart_values = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -433,41 +515,16 @@ static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr
     smart_values[373] = 0x4B; //long self-test polling time (minutes), see Table 59
 
     ata_calc_sector_checksum(smart_values);
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART VALUES packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
- * Populates user ioctl() buffer with a subset of fake SMART snapshot values, containing only thresholds
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ * Builds a subset of SMART snapshot values, containing only thresholds
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @param kbuf ioctl() buffer (header + sector) to build the response in; it must be zeroed
  */
-static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff_ptr)
+static void build_ata_smart_thresholds(u8 *kbuf)
 {
-    pr_loc_dbg("Generating fake SMART thresholds");
-
-    //sanity check if requested SMART READ THRESHOLDS sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_THRESHOLDS_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ THRESHOLDS, got %d",
-                   ATA_SMART_READ_THRESHOLDS_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
     int i;
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS));
     u8 *smart_thresholds = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -487,45 +544,16 @@ static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff
     }
 
     ata_calc_sector_checksum(smart_thresholds);
-
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy SMART THRESHOLDS packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
-        return -EFAULT;
-    }
-
-    kfree(kbuf);
-    return 0;
 }
 
 /**
- * Read stored SMART log using WIN_SMART interface
+ * Builds a stored SMART log sector for the WIN_SMART interface (see populate_win_smart_log())
  *
- * This is a special command from the "WIN_SMART" subset to read the SMART offline log. To understand it see the
- * "8.55.6 SMART READ LOG" in ATA/ATAPI-6 specs. It describes it as"Command code B0h with the content of the Features
- * register equal to D5h" (B0h = 0xb0 = ATA_CMD_SMART; D5h = 0x05 = WIN_FT_SMART_READ_LOG_SECTOR).
- * There are multiple types of logs. This function implements all non-vendor ones.
- *
- * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
- * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
- *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @param kbuf ioctl() buffer (header + sector) to build the response in; it must be zeroed
+ * @param log_addr log address; only the ones listed in smart_sector are supported
  */
-static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
+static void build_win_smart_log(u8 *kbuf, u8 log_addr)
 {
-    pr_loc_dbg("Generating fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-
-    //sanity check if requested SMART READ LOG sector count is really what we're planning to copy
-    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_WIN_SMART_READ_LOG_SECTORS) {
-        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA WIN_SMART READ LOG, got %d",
-                   ATA_WIN_SMART_READ_LOG_SECTORS, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS),
-                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
-        return -EIO;
-    }
-
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS));
     u8 *smart_log = (u8 *)(kbuf + HDIO_DRIVE_CMD_HDR_OFFSET);
 
     //First write response header
@@ -534,7 +562,7 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
     kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_READ_LOG_SECTORS;
 
     //See "Table 62 − Log address definition" in ATAPI/6 docs
-    switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
+    switch (log_addr) {
         case 0x00: //log directory. While the spec says it's optional supporting it means fewer calls to other ones
             //we're indicating that we DO support multi-sector logging to avoid further log-read logic complexity. If
             // the support is indicated as absent all reads to logs at index 0 must return "command aborted" response
@@ -565,43 +593,151 @@ static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
             ata_calc_sector_checksum(smart_log);
             break;
 
-        default: //other ones are reserved/vendor/etc
-            pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
-                       req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
-            return -EIO;
+        default:
+            pr_loc_bug("Cannot build WIN_SMART log_addr=%d", log_addr);
     }
+}
 
-    if (copy_to_user(buff_ptr, kbuf, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS)) != 0) {
-        pr_loc_err("Failed to copy WIN_SMART LOG packet to user ptr=%p", buff_ptr);
-        kfree(kbuf);
+/**
+ * Builds all responses kept in smart_sectors; it's safe to call it again (the result will be the same)
+ */
+static void build_smart_sectors(void)
+{
+    memset(smart_sectors, 0, sizeof(smart_sectors));
+    build_ata_smart_values(smart_sectors[SMART_SECT_VALUES]);
+    build_ata_smart_thresholds(smart_sectors[SMART_SECT_THRESHOLDS]);
+    build_win_smart_log(smart_sectors[SMART_SECT_LOG_DIR], 0x00);
+    build_win_smart_log(smart_sectors[SMART_SECT_LOG_SUMMARY], 0x01);
+    build_win_smart_log(smart_sectors[SMART_SECT_LOG_COMP], 0x02);
+    build_win_smart_log(smart_sectors[SMART_SECT_LOG_SELF_TEST], 0x06);
+}
+
+/**
+ * Copies a precomputed response to user ioctl() buffer
+ *
+ * @return 0 on success or -EFAULT when data fails to copy to user buffer
+ */
+static __always_inline int copy_smart_sector(smart_sector sector, void __user *buff_ptr, const char *name)
+{
+    if (unlikely(copy_to_user(buff_ptr, smart_sectors[sector], SMART_SECT_BUF_SIZE) != 0)) {
+        pr_loc_err("Failed to copy %s packet to user ptr=%p", name, buff_ptr);
         return -EFAULT;
     }
 
-    kfree(kbuf);
     return 0;
 }
 
+/**
+ * Populates user ioctl() buffer with fake SMART snapshot values
+ *
+ * This function is responsible for the generation of data which you see in a usual tabular format as a result of
+ * "smartctl -A" command. The data is formated from the "fake_smart" constant array present on the top of this file
+ * (see build_ata_smart_values()).
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
+ */
+static int populate_ata_smart_values(const u8 *req_header, void __user *buff_ptr)
+{
+    pr_loc_dbg("Generating fake SMART values");
+
+    //sanity check if requested SMART READ VALUES sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ VALUES, got %d",
+                   ATA_SMART_READ_VALUES_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    return copy_smart_sector(SMART_SECT_VALUES, buff_ptr, "SMART VALUES");
+}
+
+/**
+ * Populates user ioctl() buffer with a subset of fake SMART snapshot values, containing only thresholds
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
+ */
+static int populate_ata_smart_thresholds(const u8 *req_header, void __user *buff_ptr)
+{
+    pr_loc_dbg("Generating fake SMART thresholds");
+
+    //sanity check if requested SMART READ THRESHOLDS sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_THRESHOLDS_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ THRESHOLDS, got %d",
+                   ATA_SMART_READ_THRESHOLDS_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_THRESHOLDS_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    return copy_smart_sector(SMART_SECT_THRESHOLDS, buff_ptr, "SMART THRESHOLDS");
+}
+
+/**
+ * Read stored SMART log using WIN_SMART interface
+ *
+ * This is a special command from the "WIN_SMART" subset to read the SMART offline log. To understand it see the
+ * "8.55.6 SMART READ LOG" in ATA/ATAPI-6 specs. It describes it as"Command code B0h with the content of the Features
+ * register equal to D5h" (B0h = 0xb0 = ATA_CMD_SMART; D5h = 0x05 = WIN_FT_SMART_READ_LOG_SECTOR).
+ * There are multiple types of logs. This function implements all non-vendor ones (see build_win_smart_log()).
+ *
+ * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
+ * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ *
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
+ */
+static int populate_win_smart_log(const u8 *req_header, void __user *buff_ptr)
+{
+    pr_loc_dbg("Generating fake WIN_SMART log=%d entries", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+
+    //sanity check if requested SMART READ LOG sector count is really what we're planning to copy
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_WIN_SMART_READ_LOG_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA WIN_SMART READ LOG, got %d",
+                   ATA_WIN_SMART_READ_LOG_SECTORS, ata_ioctl_buf_size(ATA_WIN_SMART_READ_LOG_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    //See "Table 62 − Log address definition" in ATAPI/6 docs
+    switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
+        case 0x00:
+            return copy_smart_sector(SMART_SECT_LOG_DIR, buff_ptr, "WIN_SMART LOG");
+        case 0x01:
+            return copy_smart_sector(SMART_SECT_LOG_SUMMARY, buff_ptr, "WIN_SMART LOG");
+        case 0x02:
+            return copy_smart_sector(SMART_SECT_LOG_COMP, buff_ptr, "WIN_SMART LOG");
+        case 0x06:
+            return copy_smart_sector(SMART_SECT_LOG_SELF_TEST, buff_ptr, "WIN_SMART LOG");
+
+        default: //other ones are reserved/vendor/etc
+            pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
+                       req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
+            return -EIO;
+    }
+}
+
 /**
  * Dispatches an drive-internal SMART test using WIN_SMART interface
  *
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
  *
- * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
- *         copy to user buffer
+ * @return 0 on success, -EIO on unexpected call, or -EFAULT when data fails to copy to user buffer
  */
 static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_ptr)
 {
     pr_loc_dbg("Generating fake WIN_SMART offline test type=%d", req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
 
-    unsigned char *kbuf;
-    kzalloc_or_exit_int(kbuf, HDIO_DRIVE_CMD_HDR_OFFSET);
-
-    //First write response header
-    kbuf[HDIO_DRIVE_CMD_RET_STATUS] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_ERROR] = 0x00;
-    kbuf[HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST;
+    //we only need to populate the response header
+    static const u8 rsp_header[HDIO_DRIVE_CMD_HDR_OFFSET] = {
+        [HDIO_DRIVE_CMD_RET_STATUS]  = 0x00,
+        [HDIO_DRIVE_CMD_RET_ERROR]   = 0x00,
+        [HDIO_DRIVE_CMD_RET_SEC_CNT] = ATA_WIN_SMART_EXEC_TEST,
+    };
 
     //See "Table 58 − SMART EXECUTE OFF-LINE IMMEDIATE LBA Low register values" in ATAPI/6 docs
     switch (req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]) {
@@ -611,47 +747,171 @@ static int populate_win_smart_exec_test(const u8 *req_header, void __user *buff_
         case 0x7f: //abort previous test
         case 0x81: //short in captive mode
         case 0x82: //long in captive mode
-            break; //we only need to populate the response header
+            break;
 
         default: //other ones are reserved/vendor/etc
             pr_loc_err("Unexpected WIN_FT_SMART_READ_LOG_SECTOR with log_addr=%d",
                        req_header[HDIO_DRIVE_CMD_HDR_SEC_NUM]);
-            kfree(kbuf);
             return -EIO;
     }
 
-    if (copy_to_user(buff_ptr, kbuf, HDIO_DRIVE_CMD_HDR_OFFSET) != 0) {
+    if (copy_to_user(buff_ptr, rsp_header, HDIO_DRIVE_CMD_HDR_OFFSET) != 0) {
         pr_loc_err("Failed to copy WIN_SMART TEST header to user ptr=%p", buff_ptr);
-        kfree(kbuf);
         return -EFAULT;
     }
 
-    kfree(kbuf);
     return 0;
 }
 
+/****************************************** Real SMART data of non-ATA disks ******************************************/
+/**
+ * Sets a raw value of an attribute in SMART values sector built by build_ata_smart_values()
+ *
+ * Raw values are 6 bytes little-endian; the caller is responsible for recalculating the checksum.
+ */
+static void set_smart_attr_raw(u8 *smart_values, u8 id, u64 raw)
+{
+    for (int i = 0; i < ARRAY_SIZE(fake_smart); i++) {
+        u8 *attr = &smart_values[2 + (ATA_SMART_RECORD_LEN * i)];
+        if (attr[0] != id)
+            continue;
+
+        for (int j = 0; j < 6; j++)
+            attr[5 + j] = (raw >> (8 * j)) & 0xff;
+
+        return;
+    }
+}
+
+/**
+ * Adds an attribute which isn't a part of "fake_smart" to SMART values sector built by build_ata_smart_values()
+ *
+ * The caller is responsible for recalculating the checksum.
+ */
+static void add_smart_attr(u8 *smart_values, u8 id, u8 flags, u8 value, u64 raw)
+{
+    for (int i = ARRAY_SIZE(fake_smart); i < ATA_SMART_MAX_RECORDS; i++) {
+        u8 *attr = &smart_values[2 + (ATA_SMART_RECORD_LEN * i)];
+        if (attr[0] != 0)
+            continue;
+
+        attr[0] = id;
+        attr[1] = flags;
+        attr[3] = value;
+        attr[4] = value; //worst
+        for (int j = 0; j < 6; j++)
+            attr[5 + j] = (raw >> (8 * j)) & 0xff;
+
+        return;
+    }
+
+    pr_loc_bug("No space left for SMART attribute %d", id);
+}
+
+/**
+ * Overlays real health data on top of the fake SMART values sector
+ *
+ * @param kbuf ioctl() buffer (header + sector), usually a copy of smart_sectors[SMART_SECT_VALUES]
+ */
+static void apply_smart_health(u8 *kbuf, const struct smart_health *health)
+{
+    u8 *smart_values = kbuf + HDIO_DRIVE_CMD_HDR_OFFSET;
+
+    if (health->valid & SMART_HEALTH_START_STOP)
+        set_smart_attr_raw(smart_values, 4, health->start_stop); //Start_Stop_Count
+    if (health->valid & SMART_HEALTH_GROWN_DEFECTS)
+        set_smart_attr_raw(smart_values, 5, health->grown_defects); //Reallocated_Sector_Ct
+    if (health->valid & SMART_HEALTH_POWER_ON_HOURS)
+        set_smart_attr_raw(smart_values, 9, health->power_on_hours); //Power_On_Hours
+    if (health->valid & SMART_HEALTH_UNCORRECTED)
+        set_smart_attr_raw(smart_values, 187, health->uncorrected); //Reported_Uncorrect
+    if (health->valid & SMART_HEALTH_TEMP)
+        set_smart_attr_raw(smart_values, 194, health->temp); //Temperature_Celsius
+    if (health->valid & SMART_HEALTH_POWER_CYCLES)
+        set_smart_attr_raw(smart_values, 12, health->power_cycles); //Power_Cycle_Count
+    if (health->valid & SMART_HEALTH_PERCENT_USED) { //SSD_Life_Left (normalized & raw value = % of life left)
+        u8 life_left = health->percent_used >= 100 ? 0 : 100 - health->percent_used;
+        add_smart_attr(smart_values, 231, 0x13, life_left, life_left);
+    }
+
+    smart_values[ATA_SECT_SIZE - 1] = 0;
+    ata_calc_sector_checksum(smart_values);
+}
+
+/**
+ * Attempts to get real SMART values/thresholds of a disk which rejected HDIO_DRIVE_CMD (e.g. one behind a SAS HBA)
+ *
+ * ATA disks are asked directly using ATA PASS-THROUGH. When that's not possible (e.g. a SAS disk) SMART values are
+ * built from the fake ones with the counters replaced by data read from SCSI log pages. If nothing can be read (or the
+ * pass-through failed in any other way, e.g. timed out) the fake sector is used. The final response is cached for
+ * SMART_SAT_CACHE_TTL to not send a burst of SCSI commands on every poll, as well as to not re-probe disks which don't
+ * support any of this or are failing.
+ *
+ * @return 0 on success, -EFAULT when data fails to copy to user buffer, or other -E when the caller should fall back to
+ *         fake data
+ */
+static int populate_sat_smart(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk,
+                              smart_cache_kind kind)
+{
+    struct scsi_device *sdp = smart_sat_get_sdev(disk);
+    if (!sdp || req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT] != 1)
+        return -EOPNOTSUPP;
+
+    u8 *kbuf;
+    kmalloc_or_exit_int(kbuf, SMART_SECT_BUF_SIZE);
+
+    int out = smart_sat_ata_cmd(sdp, req_header, kbuf);
+    if (out != 0) {
+        struct smart_health health;
+        memcpy(kbuf, smart_sectors[(kind == SMART_CACHE_VALUES) ? SMART_SECT_VALUES : SMART_SECT_THRESHOLDS],
+               SMART_SECT_BUF_SIZE);
+
+        //thresholds stay fake - they're matching the attributes in fake values. Log pages are only asked for when the
+        // disk explicitly rejected pass-through (i.e. it's not ATA); after e.g. a timeout they will most likely fail too
+        if (out == -EOPNOTSUPP && kind == SMART_CACHE_VALUES && smart_sat_read_scsi_health(sdp, &health) == 0)
+            apply_smart_health(kbuf, &health);
+
+        out = 0;
+    }
+
+    if (unlikely(copy_to_user(buff_ptr, kbuf, SMART_SECT_BUF_SIZE) != 0)) {
+        pr_loc_err("Failed to copy translated SMART packet to user ptr=%p", buff_ptr);
+        out = -EFAULT;
+    } else {
+        smart_cache_put(disk, kind, kbuf, SMART_SAT_CACHE_TTL);
+    }
+
+    kfree(kbuf);
+    return out;
+}
+
 /**
  * Emulates various SMART data requested via ATA_CMD_SMART method
  *
  * SMART responses here assume that original ioctl() failed (since otherwise it would be no point to emulate them). If
  * you call this function on a drive with functioning SMART it will be ignored and fake smart will be generated for it.
+ * Values & thresholds are first attempted to be read using SCSI commands (see populate_sat_smart()).
  *
  * @param req_header ioctl() header sent along the request, will be HDIO_DRIVE_CMD_HDR_OFFSET bytes long
  * @param buff_ptr userspace pointer to a buffer passed to the ioctl() call; it will be overwritten with data
+ * @param disk disk the request was sent to
  *
  * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
  *         copy to user buffer
  */
-static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __user *buff_ptr)
+static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __user *buff_ptr, struct gendisk *disk)
 {
+    int out;
     pr_loc_dbg("Got SMART *command* - looking for feature=0x%x", req_header[HDIO_DRIVE_CMD_HDR_FEATURE]);
 
     switch (req_header[HDIO_DRIVE_CMD_HDR_FEATURE]) {
         case ATA_SMART_READ_VALUES: //read all SMART values snapshot
-            return populate_ata_smart_values(req_header, buff_ptr);
+            out = populate_sat_smart(req_header, buff_ptr, disk, SMART_CACHE_VALUES);
+            return (out == 0 || out == -EFAULT) ? out : populate_ata_smart_values(req_header, buff_ptr);
 
         case ATA_SMART_READ_THRESHOLDS: //read all SMART thresholds snapshot
-            return populate_ata_smart_thresholds(req_header, buff_ptr);
+            out = populate_sat_smart(req_header, buff_ptr, disk, SMART_CACHE_THRESHOLDS);
+            return (out == 0 || out == -EFAULT) ? out : populate_ata_smart_thresholds(req_header, buff_ptr);
 
         case ATA_SMART_ENABLE: //enable previously disabled SMART support
             pr_loc_wrn("Attempted ATA_SMART_ENABLE modification!");\
@@ -669,6 +929,96 @@ static int __always_inline handle_ata_cmd_smart(const u8 *req_header, void __use
     }
 }
 
+/**
+ * Checks if an ATA command sent via HDIO_DRIVE_CMD can change what the drive reports in IDENTIFY
+ *
+ * This is deliberately pessimistic: only commands known to not affect IDENTIFY data keep the cache.
+ */
+static __always_inline bool ata_cmd_may_change_identify(const u8 *req_header)
+{
+    switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
+        case ATA_CMD_ID_ATA:
+        case ATA_CMD_CHK_POWER:
+        case ATA_CMD_STANDBY:
+        case ATA_CMD_STANDBYNOW1:
+        case ATA_CMD_IDLE:
+        case ATA_CMD_IDLEIMMEDIATE:
+            return false;
+
+        case ATA_CMD_SMART: //SMART enabled flag is a part of IDENTIFY
+            return req_header[HDIO_DRIVE_CMD_HDR_FEATURE] == ATA_SMART_ENABLE ||
+                   req_header[HDIO_DRIVE_CMD_HDR_FEATURE] == ATA_SMART_DISABLE;
+
+        default:
+            return true;
+    }
+}
+
+/**
+ * Checks which cached response (if any) can answer an ATA command sent via HDIO_DRIVE_CMD
+ *
+ * @return smart_cache_kind or SMART_CACHE__CNT if the command is not cacheable
+ */
+static __always_inline smart_cache_kind ata_cmd_cache_kind(const u8 *req_header)
+{
+    if (req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT] != 1)
+        return SMART_CACHE__CNT;
+
+    if (req_header[HDIO_DRIVE_CMD_HDR_CMD] == ATA_CMD_ID_ATA)
+        return SMART_CACHE_IDENTIFY;
+
+    if (req_header[HDIO_DRIVE_CMD_HDR_CMD] == ATA_CMD_SMART) {
+        switch (req_header[HDIO_DRIVE_CMD_HDR_FEATURE]) {
+            case ATA_SMART_READ_VALUES:
+                return SMART_CACHE_VALUES;
+            case ATA_SMART_READ_THRESHOLDS:
+                return SMART_CACHE_THRESHOLDS;
+        }
+    }
+
+    return SMART_CACHE__CNT;
+}
+
+/**
+ * Determines how old cached responses can be served for a disk (see smart_shim_set_sleep_cache())
+ *
+ * @return max age in jiffies, or 0 if the disk is active (or the feature is disabled)
+ */
+static __always_inline unsigned long sleep_cache_max_age_for(struct gendisk *disk)
+{
+    unsigned long idle = sleep_cache_idle;
+    if (!idle || smart_cache_idle_time(disk) < idle)
+        return 0;
+
+    return sleep_cache_max_age;
+}
+
+/**
+ * Keeps a copy of a real response of the disk to serve it while the disk sleeps
+ *
+ * It's stored with no lifetime, so it will not be used unless the disk is idle (see sleep_cache_max_age_for()).
+ */
+static void remember_real_response(struct gendisk *disk, smart_cache_kind kind, void __user *buff_ptr)
+{
+    if (kind == SMART_CACHE__CNT || !sleep_cache_idle)
+        return;
+
+    unsigned char *kbuf = get_ioctl_buffer_kcopy(1, buff_ptr);
+    if (unlikely(IS_ERR(kbuf)))
+        return; //not fatal - the next request will simply reach the disk
+
+    smart_cache_put(disk, kind, kbuf, 0);
+    put_ioctl_buffer(kbuf);
+}
+
+void smart_shim_set_sleep_cache(unsigned int idle_sec, unsigned int max_age_sec)
+{
+    pr_loc_inf("SMART of disks idle for %us will be served from memory for up to %us%s", idle_sec, max_age_sec,
+               idle_sec ? "" : " (disabled)");
+    sleep_cache_max_age = max_age_sec * HZ;
+    sleep_cache_idle = idle_sec * HZ;
+}
+
 /**
  * Shims various commands launched via HDIO_DRIVE_CMD interface, routing them to individual shims
  *
@@ -689,17 +1039,26 @@ static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode,
         return -EIO;
     }
 
+    //IDENTIFY of a given disk doesn't change, so if we've already responded to it the drive doesn't need to be asked.
+    // The same goes for translated SMART values/thresholds until their TTL expires, and for any SMART data of a disk
+    // which is asleep (as asking it would spin it up).
+    smart_cache_kind cache_kind = ata_cmd_cache_kind(req_header);
+    if (cache_kind != SMART_CACHE__CNT) {
+        int cache_out = smart_cache_get(bdev->bd_disk, cache_kind, buff_ptr, sleep_cache_max_age_for(bdev->bd_disk));
+        if (cache_out != -ENOENT)
+            return cache_out;
+    }
+
     int ioctl_out = sd_ioctl_org(bdev, mode, cmd, (unsigned long)buff_ptr);
+    if (ata_cmd_may_change_identify(req_header))
+        smart_cache_invalidate(bdev->bd_disk);
+
     switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
         //this command probes the disk for its overall capabilities; it may have nothing to do with SMART reading but
         // we need to modify it to indicate SMART support
         case ATA_CMD_ID_ATA:
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_ID_ATA", bdev);
 
-            // TODO for some disks from HBA, we can get smart info from SG_IO,
-            // but for SA6400, DSM only fetch ATA smart info,
-            // we need convert SG_IO smart info into ATA format instead of fake it.
-
             // use the real serial if it's not empty, other wise use the disk name
             char * disk_serial;
             disk_serial = rp_fetch_block_serial(bdev->bd_disk->disk_name);
@@ -707,12 +1066,17 @@ static int handle_hdio_drive_cmd_ioctl(struct block_device *bdev, fmode_t mode,
                 disk_serial = bdev->bd_disk->disk_name;
             }
 
-            return handle_ata_cmd_identify(ioctl_out, req_header, buff_ptr, disk_serial);
+            return handle_ata_cmd_identify(ioctl_out, req_header, buff_ptr, disk_serial, bdev->bd_disk);
 
         //this command asks directly for the SMART data of the drive and will fail on drives with no real SMART support
         case ATA_CMD_SMART: //if the drive supports SMART it will just return the data as-is, no need to proxy
             pr_loc_dbg_ioctl(cmd, "ATA_CMD_SMART", bdev);
-            return (ioctl_out == 0) ? 0 : handle_ata_cmd_smart(req_header, buff_ptr);
+            if (ioctl_out == 0) {
+                remember_real_response(bdev->bd_disk, cache_kind, buff_ptr);
+                return 0;
+            }
+
+            return handle_ata_cmd_smart(req_header, buff_ptr, bdev->bd_disk);
 
         //We're only interested in a subset of commands - rest are simply redirected back
         default:
@@ -814,6 +1178,90 @@ handle_hdio_drive_task_ioctl(struct block_device *bdev, fmode_t mode, unsigned i
     }
 }
 
+/*************************************** Emulation for disks not speaking ATA ****************************************/
+/**
+ * Populates user ioctl() buffer with fake SMART snapshot values overlaid with real health data
+ *
+ * @return 0 on success, -EIO on unexpected call, -ENOMEM when memory reservation fails, or -EFAULT when data fails to
+ *         copy to user buffer
+ */
+static int populate_health_smart_values(const u8 *req_header, void __user *buff_ptr,
+                                        const struct smart_health *health)
+{
+    if (unlikely(req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]) != ATA_SMART_READ_VALUES_SECTORS) {
+        pr_loc_err("Expected %d bytes (%d sectors) DATA for ATA SMART READ VALUES, got %d",
+                   ATA_SMART_READ_VALUES_SECTORS, ata_ioctl_buf_size(ATA_SMART_READ_VALUES_SECTORS),
+                   req_header[HDIO_DRIVE_CMD_HDR_SEC_CNT]);
+        return -EIO;
+    }
+
+    u8 *kbuf;
+    kmalloc_or_exit_int(kbuf, SMART_SECT_BUF_SIZE);
+    memcpy(kbuf, smart_sectors[SMART_SECT_VALUES], SMART_SECT_BUF_SIZE);
+    apply_smart_health(kbuf, health);
+
+    int out = 0;
+    if (unlikely(copy_to_user(buff_ptr, kbuf, SMART_SECT_BUF_SIZE) != 0)) {
+        pr_loc_err("Failed to copy SMART VALUES packet to user ptr=%p", buff_ptr);
+        out = -EFAULT;
+    }
+
+    kfree(kbuf);
+    return out;
+}
+
+int smart_emulate_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr,
+                        smart_health_reader *read_health)
+{
+    struct gendisk *disk = bdev->bd_disk;
+
+    if (cmd == HDIO_DRIVE_TASK) {
+        u8 req_header[HDIO_DRIVE_TASK_HDR_OFFSET];
+        if (unlikely(copy_from_user(req_header, buff_ptr, HDIO_DRIVE_TASK_HDR_OFFSET) != 0)) {
+            pr_loc_err("Expected to copy HDIO_DRIVE_TASK header of %d bytes from %p - it failed",
+                       HDIO_DRIVE_TASK_HDR_OFFSET, buff_ptr);
+            return -EIO;
+        }
+
+        return (req_header[HDIO_DRIVE_TASK_HDR_CMD] == WIN_CMD_SMART) ? handle_ata_task_smart(req_header, buff_ptr)
+                                                                      : -EIO;
+    }
+
+    if (unlikely(cmd != HDIO_DRIVE_CMD)) {
+        pr_loc_bug("%s called for ioctl(0x%x) which is not SMART-related", __FUNCTION__, cmd);
+        return -EINVAL;
+    }
+
+    u8 req_header[HDIO_DRIVE_CMD_HDR_OFFSET];
+    if (unlikely(copy_from_user(req_header, buff_ptr, HDIO_DRIVE_CMD_HDR_OFFSET) != 0)) {
+        pr_loc_err("Expected to copy HDIO_DRIVE_CMD header of %d bytes from %p - it failed", HDIO_DRIVE_CMD_HDR_OFFSET,
+                   buff_ptr);
+        return -EIO;
+    }
+
+    switch (req_header[HDIO_DRIVE_CMD_HDR_CMD]) {
+        case ATA_CMD_ID_ATA: {
+            pr_loc_dbg_ioctl(cmd, "ATA_CMD_ID_ATA", bdev);
+            //Not cached: the disk isn't SCSI so nothing would drop the entry when it's removed
+            return populate_ata_id(req_header, buff_ptr, disk->disk_name, NULL);
+        }
+
+        case ATA_CMD_SMART:
+            pr_loc_dbg_ioctl(cmd, "ATA_CMD_SMART", bdev);
+            if (req_header[HDIO_DRIVE_CMD_HDR_FEATURE] == ATA_SMART_READ_VALUES && read_health) {
+                struct smart_health health;
+                if (read_health(bdev, mode, &health) == 0)
+                    return populate_health_smart_values(req_header, buff_ptr, &health);
+            }
+
+            return handle_ata_cmd_smart(req_header, buff_ptr, disk);
+
+        default:
+            pr_loc_dbg_ioctl_unk(cmd, req_header[HDIO_DRIVE_CMD_HDR_CMD], bdev);
+            return -EIO;
+    }
+}
+
 /********************************** ioctl() handling re-routing from driver to shim ***********************************/
 //These are called from each other so we need to predeclare them
 int sd_ioctl_canary_install(void);
@@ -1040,21 +1488,30 @@ int sd_ioctl_canary_uninstall(void)
 }
 
 /****************************************** Standard public API of the shim *******************************************/
-int register_disk_smart_shim(void)
+int register_disk_smart_shim(const struct smart_sleep_cache *sleep_config)
 {
     shim_reg_in();
 
     int out;
 
+    if (sleep_config->configured)
+        smart_shim_set_sleep_cache(sleep_config->idle_sec, sleep_config->max_age_sec ?: SMART_SLEEP_CACHE_MAX_AGE_SEC);
+
+    build_smart_sectors();
     out = is_scsi_driver_loaded();
     if (IS_SCSI_DRIVER_ERROR(out)) {
         pr_loc_err("Failed to determine SCSI driver status - error=%d", out);
         return out;
     } else if(out == SCSI_DRV_LOADED || kernel_has_symbol("sd_ioctl")) {
         //driver is loaded, OR it's not loaded, but it's compiled-in
+        if ((out = register_smart_cache(sleep_cache_idle != 0)) != 0)
+            return out;
+
         pr_loc_dbg("SCSI driver exists - installing canary");
-        if ((out = sd_ioctl_canary_install()) != 0)
+        if ((out = sd_ioctl_canary_install()) != 0) {
+            unregister_smart_cache();
             return out;
+        }
     } else { //driver not loaded and doesn't exist (=not compiled in)
         //normally this should call watch_scsi_driver_register() but the current implementation of driver watcher allows
         // for just a single watcher per driver (as it doesn't use standard kernel notifiers, sic!). This is however
@@ -1087,6 +1544,12 @@ int unregister_disk_smart_shim(void)
         is_error = true;
     }
 
+    out = unregister_smart_cache();
+    if (out != 0) {
+        pr_loc_err("unregister_smart_cache failed - error=%d", out);
+        is_error = true;
+    }
+
     if (is_error)
         return -EIO;
 
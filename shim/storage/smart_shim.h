@@ -1,7 +1,61 @@
 #ifndef REDPILL_SMART_SHIM_H
 #define REDPILL_SMART_SHIM_H
 
-int register_disk_smart_shim(void);
+#include <linux/fs.h> //fmode_t
+#include <linux/types.h> //u8, u32, u64
+
+struct block_device;
+struct smart_sleep_cache;
+
+//Health data which is common for different transports; only fields with bits set in "valid" were read
+#define SMART_HEALTH_TEMP (1 << 0)
+#define SMART_HEALTH_POWER_ON_HOURS (1 << 1)
+#define SMART_HEALTH_START_STOP (1 << 2)
+#define SMART_HEALTH_GROWN_DEFECTS (1 << 3)
+#define SMART_HEALTH_UNCORRECTED (1 << 4)
+#define SMART_HEALTH_POWER_CYCLES (1 << 5)
+#define SMART_HEALTH_PERCENT_USED (1 << 6)
+struct smart_health {
+    unsigned int valid;
+    u8 temp; //Celsius
+    u32 power_on_hours;
+    u32 start_stop;
+    u32 grown_defects; //sectors reallocated during the lifetime of the disk
+    u64 uncorrected; //errors which couldn't be recovered
+    u32 power_cycles;
+    u8 percent_used; //estimated % of the (SSD) life used; may exceed 100
+};
+
+typedef int (smart_health_reader)(struct block_device *bdev, fmode_t mode, struct smart_health *health);
+
+/**
+ * Answers SMART-related ioctl()s (HDIO_DRIVE_CMD & HDIO_DRIVE_TASK) of a disk which doesn't speak ATA at all
+ *
+ * IDENTIFY is faked (see populate_ata_id()) and SMART values are the fake ones with real health data applied (if it
+ * can be read). Everything else is handled the same way as for SCSI disks without SMART support.
+ *
+ * @param read_health callback to get health data of the disk; called only when SMART values are requested
+ *
+ * @return ioctl() result
+ */
+int smart_emulate_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, void __user *buff_ptr,
+                        smart_health_reader *read_health);
+
+/**
+ * Configures serving SMART data of idle disks from memory, so that polling it doesn't spin them up
+ *
+ * When enabled, the last real SMART values & thresholds returned by each disk are kept. If a disk had no I/O for at
+ * least idle_sec (which should match its spin-down time) SMART requests are answered with these, as long as they're
+ * not older than max_age_sec. Once they are the disk is asked (and thus woken up) again. The default is set with
+ * SMART_SLEEP_CACHE_IDLE_SEC & SMART_SLEEP_CACHE_MAX_AGE_SEC, and it can be overridden with "smart_sleep=" cmdline option
+ * (see CMDLINE_CT_SMART_SLEEP). Enabling it only takes effect for the shim registered afterwards, as I/O of disks is
+ * tracked from the registration on.
+ *
+ * @param idle_sec time without I/O after which a disk is considered asleep; 0 disables the feature
+ */
+void smart_shim_set_sleep_cache(unsigned int idle_sec, unsigned int max_age_sec);
+
+int register_disk_smart_shim(const struct smart_sleep_cache *sleep_config);
 int unregister_disk_smart_shim(void);
 
 #endif //REDPILL_SMART_SHIM_H
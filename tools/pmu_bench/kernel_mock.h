@@ -0,0 +1,148 @@
+/**
+ * Userspace stand-ins for kernel APIs used by shim/pmu_shim.c
+ *
+ * This extends the vUART benchmark mock (../vuart_bench/kernel_mock.h) with what the PMU shim needs on top of it. The
+ * workqueue is manual: queued work only runs when the benchmark calls kmock_run_work() (or the workqueue is destroyed),
+ * which makes it possible to control how many commands get coalesced.
+ */
+#ifndef PMU_BENCH_KERNEL_MOCK_H
+#define PMU_BENCH_KERNEL_MOCK_H
+
+#include "../vuart_bench/kernel_mock.h"
+
+#ifndef noinline
+#define noinline __attribute__((noinline))
+#endif
+#ifndef __used
+#define __used __attribute__((used))
+#endif
+
+/****************************************************** Logging *******************************************************/
+extern bool kmock_quiet; //suppresses all logs (e.g. when fuzzing), defined by the benchmark
+
+#undef printk
+#undef pr_crit
+#undef pr_err
+#undef pr_warn
+#undef pr_info
+#define kmock_log(pfx, fmt, ...) do { if (!kmock_quiet) fprintf(stderr, pfx fmt, ##__VA_ARGS__); } while(0)
+#define printk(fmt, ...) kmock_log("", fmt, ##__VA_ARGS__)
+#define pr_crit(fmt, ...) kmock_log("CRIT ", fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) kmock_log("ERR ", fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) kmock_log("WARN ", fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) kmock_log("INFO ", fmt, ##__VA_ARGS__)
+
+/******************************************************* Locking ******************************************************/
+#define DEFINE_SPINLOCK(name) spinlock_t name = { 0 }
+
+/******************************************************* Lists ********************************************************/
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    new->prev = head->prev;
+    new->next = head;
+    head->prev->next = new;
+    head->prev = new;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    INIT_LIST_HEAD(entry);
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    list_add_tail(new, head->next);
+}
+
+static inline void list_move(struct list_head *entry, struct list_head *head)
+{
+    list_del_init(entry);
+    list_add(entry, head);
+}
+
+static inline void list_move_tail(struct list_head *entry, struct list_head *head)
+{
+    list_del_init(entry);
+    list_add_tail(entry, head);
+}
+
+/******************************************************* Hashing ******************************************************/
+//Not the real jhash (FNV-1a) but it only has to be a decent hash
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+    const u8 *data = key;
+    u32 hash = 2166136261u ^ initval;
+    while (length--)
+        hash = (hash ^ *data++) * 16777619u;
+
+    return hash;
+}
+
+/***************************************************** Workqueues *****************************************************/
+struct work_struct {
+    void (*func)(struct work_struct *);
+    bool pending;
+};
+
+struct workqueue_struct {
+    struct work_struct *work; //the PMU shim only ever queues a single work item
+};
+
+extern unsigned long kmock_work_runs; //number of times queued work was executed, defined by the benchmark
+
+#define DECLARE_WORK(name, fn) struct work_struct name = { .func = (fn) }
+
+static inline struct workqueue_struct *alloc_ordered_workqueue(const char *fmt, unsigned int flags)
+{
+    return calloc(1, sizeof(struct workqueue_struct));
+}
+
+static inline bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    if (work->pending)
+        return false;
+
+    work->pending = true;
+    wq->work = work;
+    return true;
+}
+
+static inline void kmock_run_work(struct workqueue_struct *wq)
+{
+    if (!wq || !wq->work || !wq->work->pending)
+        return;
+
+    wq->work->pending = false;
+    ++kmock_work_runs;
+    wq->work->func(wq->work);
+}
+
+static inline void destroy_workqueue(struct workqueue_struct *wq)
+{
+    kmock_run_work(wq);
+    free(wq);
+}
+
+#endif //PMU_BENCH_KERNEL_MOCK_H
@@ -0,0 +1,617 @@
+/**
+ * Userspace replay & fuzz benchmark of the PMU protocol parser (shim/pmu_shim.c)
+ *
+ * The whole pmu_shim.c is compiled here against mocked kernel APIs (see kernel_mock.h) with the vUART replaced by
+ * direct calls to its TX drain callback. Every command routed by the parser is captured (see pmu_trace_route), so
+ * the result of parsing a stream can be compared between runs.
+ *
+ * A source is a stream of TX flushes, i.e. chunks of data with their vuart_flush_reason. It's either generated (a
+ * synthetic mfgBIOS session with known commands, CRLF-terminated ones, heads sent in separate packets, arguments and
+ * unknown commands) or replayed from vUART recorder captures (see vuart_recorder.h). Each source is parsed once as-is
+ * and then re-split many times at random points between IDLE flushes, with random non-IDLE reasons and random TX
+ * view segments. Since only IDLE carries meaning for the parser, every split must produce exactly the same commands
+ * (and for synthetic sources, the commands which were generated). Any difference is reported as a mis-parse.
+ *
+ * The fuzzing entry point (LLVMFuzzerTestOneInput()) drives the parser with arbitrary data and flush boundaries and
+ * checks invariants of the work ring. Build it with "make fuzz" (requires clang with libFuzzer) or run it without
+ * libFuzzer using -z (given inputs) or -Z (random inputs).
+ *
+ * Usage: ./pmu_bench [-n packets] [-i iterations] [-s seed] [-l line] [-r trace]... [-z fuzz_input]... [-Z fuzz_runs]
+ */
+#define pmu_trace_route(cmd, signature, sig_len) bench_trace_route(cmd, signature, sig_len)
+struct command_definition;
+static void bench_trace_route(const struct command_definition *cmd, const char *signature, unsigned int sig_len);
+
+#include "../../shim/pmu_shim.c"
+#include "../../internal/uart/vuart_recorder.h" //struct vuart_rec_event
+#include <getopt.h>
+
+#define BENCH_SIG_MAX 32 //bytes of every routed signature kept for comparison
+#define BENCH_PACKET_MAX 64 //max length of a synthetic packet
+#define BENCH_FUZZ_INPUT_MAX 4096
+
+unsigned long kmock_lock_acquisitions = 0;
+unsigned long kmock_hrtimer_starts = 0;
+unsigned long kmock_work_runs = 0;
+bool kmock_quiet = false;
+
+static const struct hw_config bench_hw = { .name = "DS918+" };
+
+/**
+ * Commands routed by the parser in the order of routing
+ */
+struct bench_route {
+    const command_definition *cmd; //NULL if unknown
+    unsigned int len;
+    char sig[BENCH_SIG_MAX];
+};
+
+struct bench_routes {
+    struct bench_route *items;
+    size_t cnt;
+    size_t cap;
+};
+
+struct bench_flush {
+    size_t off;
+    unsigned int len;
+    vuart_flush_reason reason;
+};
+
+struct bench_stream {
+    char *data;
+    size_t len;
+    size_t cap;
+    struct bench_flush *flushes;
+    size_t nflushes;
+    size_t flushes_cap;
+};
+
+static struct bench_routes *routes_out = NULL; //where bench_trace_route() records to; NULL to not record
+static unsigned long routed_cnt = 0;
+static unsigned long unknown_cnt = 0;
+static unsigned long responses_cnt = 0;
+
+static void *grow(void *ptr, size_t *cap, size_t need, size_t elem)
+{
+    if (need <= *cap)
+        return ptr;
+
+    size_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need)
+        new_cap *= 2;
+
+    ptr = realloc(ptr, new_cap * elem);
+    if (!ptr) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    *cap = new_cap;
+
+    return ptr;
+}
+
+static void routes_add(struct bench_routes *routes, const command_definition *cmd, const char *sig, unsigned int len)
+{
+    routes->items = grow(routes->items, &routes->cap, routes->cnt + 1, sizeof(*routes->items));
+    struct bench_route *route = &routes->items[routes->cnt++];
+    route->cmd = cmd;
+    route->len = len;
+    memcpy(route->sig, sig, min_t(unsigned int, len, BENCH_SIG_MAX));
+}
+
+static bool route_equal(const struct bench_route *a, const struct bench_route *b)
+{
+    return a->cmd == b->cmd && a->len == b->len && memcmp(a->sig, b->sig, min(a->len, BENCH_SIG_MAX)) == 0;
+}
+
+/**
+ * Counts commands which differ between the two lists (including missing & extra ones)
+ */
+static size_t routes_diff(const struct bench_routes *expected, const struct bench_routes *got)
+{
+    size_t diff = 0;
+    size_t common = min(expected->cnt, got->cnt);
+    for (size_t i = 0; i < common; ++i) {
+        if (!route_equal(&expected->items[i], &got->items[i]))
+            ++diff;
+    }
+
+    return diff + (expected->cnt > got->cnt ? expected->cnt - got->cnt : got->cnt - expected->cnt);
+}
+
+static void stream_add(struct bench_stream *stream, const char *data, unsigned int len, vuart_flush_reason reason)
+{
+    stream->data = grow(stream->data, &stream->cap, stream->len + len, 1);
+    stream->flushes = grow(stream->flushes, &stream->flushes_cap, stream->nflushes + 1, sizeof(*stream->flushes));
+
+    memcpy(stream->data + stream->len, data, len);
+    stream->flushes[stream->nflushes++] = (struct bench_flush){ .off = stream->len, .len = len, .reason = reason };
+    stream->len += len;
+}
+
+static void stream_free(struct bench_stream *stream)
+{
+    free(stream->data);
+    free(stream->flushes);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/***************************************************** Mocked APIs ****************************************************/
+int vuart_add_device_model(int line, vuart_chip_model model)
+{
+    return 0;
+}
+
+int vuart_remove_device(int line)
+{
+    return 0;
+}
+
+int vuart_set_tx_drain_callback(int line, vuart_drain_callback_t *cb, int threshold)
+{
+    return 0;
+}
+
+int vuart_inject_rx(int line, const char *buffer, int length)
+{
+    ++responses_cnt;
+    return length;
+}
+
+void pmu_state_set(pmu_state_attr attr, const char *value, unsigned int len)
+{
+}
+
+int pmu_state_register(void)
+{
+    return 0;
+}
+
+int pmu_state_unregister(void)
+{
+    return 0;
+}
+
+static void bench_trace_route(const struct command_definition *cmd, const char *signature, unsigned int sig_len)
+{
+    if (unlikely(sig_len >= PMU_WORK_RING_LEN)) {
+        fprintf(stderr, "Routed %u bytes signature - it cannot come from the work ring\n", sig_len);
+        abort();
+    }
+
+    ++routed_cnt;
+    if (!cmd)
+        ++unknown_cnt;
+    if (routes_out)
+        routes_add(routes_out, cmd, signature, sig_len);
+}
+
+/*************************************************** Driving parser ***************************************************/
+static void reset_parser(void)
+{
+    kmock_run_work(cmd_wq);
+    vuart_ring_reset(&work_ring);
+    scan_pos = 0;
+    has_cmd = false;
+}
+
+/**
+ * Delivers one flush to the PMU callback, splitting it into two TX view segments at a given point
+ */
+static void deliver(const char *data, unsigned int len, unsigned int split, vuart_flush_reason reason)
+{
+    struct vuart_tx_view view = {
+        .seg = { { .buffer = data, .len = split }, { .buffer = data + split, .len = len - split } },
+        .len = len,
+    };
+
+    unsigned int out = pmu_rx_callback(PMU_TTYS_LINE, &view, reason);
+    if (unlikely(out != len)) {
+        fprintf(stderr, "PMU callback consumed %u of %u bytes\n", out, len);
+        abort();
+    }
+}
+
+/**
+ * Parses the whole stream (the workqueue runs after every flush, like it would on an idle system)
+ */
+static void feed(const struct bench_stream *stream, struct bench_routes *routes, unsigned int *seed)
+{
+    reset_parser();
+    routes_out = routes;
+    for (size_t i = 0; i < stream->nflushes; ++i) {
+        const struct bench_flush *flush = &stream->flushes[i];
+        unsigned int split = (seed && flush->len) ? 1 + rand_r(seed) % flush->len : flush->len;
+        deliver(stream->data + flush->off, flush->len, split, flush->reason);
+        kmock_run_work(cmd_wq);
+    }
+    routes_out = NULL;
+}
+
+/**
+ * Creates a copy of the stream with non-IDLE flushes split at random points (IDLE ones are preserved as-is)
+ */
+static void resplit(const struct bench_stream *src, struct bench_stream *dst, unsigned int *seed)
+{
+    dst->len = 0;
+    dst->nflushes = 0;
+
+    size_t pkt_start = 0;
+    for (size_t i = 0; i < src->nflushes; ++i) {
+        const struct bench_flush *flush = &src->flushes[i];
+        bool last = (i + 1 == src->nflushes);
+        if (flush->reason != VUART_FLUSH_IDLE && !last)
+            continue;
+
+        size_t pkt_end = flush->off + flush->len;
+        size_t pos = pkt_start;
+        while (pos < pkt_end) {
+            unsigned int len = 1 + rand_r(seed) % VUART_FIFO_LEN_MAX;
+            if (len >= pkt_end - pos) {
+                stream_add(dst, src->data + pos, pkt_end - pos, flush->reason);
+                break;
+            }
+
+            stream_add(dst, src->data + pos, len, (rand_r(seed) & 1) ? VUART_FLUSH_FULL : VUART_FLUSH_THRESHOLD);
+            pos += len;
+        }
+        if (pkt_start == pkt_end) //preserve empty IDLE flushes
+            stream_add(dst, src->data + pos, 0, flush->reason);
+
+        pkt_start = pkt_end;
+    }
+}
+
+/*************************************************** Sources ****************************************************/
+struct bench_cmd {
+    const command_definition *cmd;
+    char sig[4];
+    unsigned int len;
+};
+
+static struct bench_cmd bench_cmds[128];
+static unsigned int bench_cmds_cnt = 0;
+static const char *const bench_unknown[] = { "Z", "S", "LA9", "SWX", "\x01" };
+
+/**
+ * Collects all commands from the command trie
+ */
+static void collect_cmds(const command_definition *level, unsigned int first, unsigned int cnt, char *sig,
+                         unsigned int depth)
+{
+    for (unsigned int i = 0; i < cnt; ++i) {
+        const command_definition *node = &level[i];
+        sig[depth] = (char)(first + i);
+
+        if (node->fn && bench_cmds_cnt < ARRAY_SIZE(bench_cmds) && depth < sizeof(bench_cmds[0].sig)) {
+            struct bench_cmd *bc = &bench_cmds[bench_cmds_cnt++];
+            bc->cmd = node;
+            bc->len = depth + 1;
+            memcpy(bc->sig, sig, bc->len);
+        }
+
+        if (node->next)
+            collect_cmds(node->next, node->next_min, node->next_cnt, sig, depth + 1);
+    }
+}
+
+/**
+ * Generates a synthetic mfgBIOS session with a list of commands the parser is expected to route
+ */
+static void gen_synthetic(struct bench_stream *stream, struct bench_routes *expected, size_t packets,
+                          unsigned int *seed)
+{
+    for (size_t p = 0; p < packets; ++p) {
+        char pkt[BENCH_PACKET_MAX];
+        unsigned int len = 0;
+        unsigned int ncmds = 1 + rand_r(seed) % 3;
+
+        for (unsigned int c = 0; c < ncmds; ++c) {
+            unsigned int start = len;
+            const command_definition *cmd = NULL;
+            pkt[len++] = PMU_CMD_HEAD;
+
+            if (rand_r(seed) % 16 == 0) {
+                const char *unknown = bench_unknown[rand_r(seed) % ARRAY_SIZE(bench_unknown)];
+                memcpy(&pkt[len], unknown, strlen(unknown));
+                len += strlen(unknown);
+            } else {
+                const struct bench_cmd *bc = &bench_cmds[rand_r(seed) % bench_cmds_cnt];
+                cmd = bc->cmd;
+                memcpy(&pkt[len], bc->sig, bc->len);
+                len += bc->len;
+                for (unsigned int i = cmd->has_args ? 1 + rand_r(seed) % 3 : 0; i > 0; --i)
+                    pkt[len++] = '0' + rand_r(seed) % 10;
+            }
+
+            if (rand_r(seed) % 4 == 0) {
+                pkt[len++] = 0x0d;
+                pkt[len++] = 0x0a;
+            }
+
+            routes_add(expected, cmd, &pkt[start + 1], len - start - 1);
+        }
+
+        //Some versions of the mfgBIOS send the head and then the command in a separate packet
+        if (ncmds == 1 && rand_r(seed) % 8 == 0) {
+            stream_add(stream, pkt, 1, VUART_FLUSH_IDLE);
+            stream_add(stream, pkt + 1, len - 1, VUART_FLUSH_IDLE);
+        } else {
+            stream_add(stream, pkt, len, VUART_FLUSH_IDLE);
+        }
+    }
+}
+
+struct bench_event {
+    struct vuart_rec_event ev;
+    size_t idx; //to keep the sort stable
+};
+
+static int event_cmp(const void *a, const void *b)
+{
+    const struct bench_event *ea = a, *eb = b;
+    if (ea->ev.ts_ns != eb->ev.ts_ns)
+        return ea->ev.ts_ns < eb->ev.ts_ns ? -1 : 1;
+
+    return ea->idx < eb->idx ? -1 : 1;
+}
+
+/**
+ * Loads TX data of a line from vUART recorder captures (e.g. /sys/kernel/debug/vuart/traceN)
+ */
+static int load_traces(struct bench_stream *stream, char **paths, int npaths, int line)
+{
+    struct bench_event *events = NULL;
+    size_t nevents = 0, cap = 0;
+
+    for (int i = 0; i < npaths; ++i) {
+        FILE *fp = fopen(paths[i], "rb");
+        if (!fp) {
+            fprintf(stderr, "Failed to open %s: %s\n", paths[i], strerror(errno));
+            free(events);
+            return -ENOENT;
+        }
+
+        struct vuart_rec_event ev;
+        while (fread(&ev, sizeof(ev), 1, fp) == 1) {
+            if (ev.type != VUART_REC_TX || ev.line != line || ev.len > VUART_REC_DATA_LEN)
+                continue;
+
+            events = grow(events, &cap, nevents + 1, sizeof(*events));
+            events[nevents].ev = ev;
+            events[nevents].idx = nevents;
+            ++nevents;
+        }
+        fclose(fp);
+    }
+
+    //Events from different CPUs are merged by time. Chunks of a single flush share the timestamp & reason, and all
+    // but the last one are full, so they're glued back together.
+    qsort(events, nevents, sizeof(*events), event_cmp);
+    for (size_t i = 0; i < nevents; ++i) {
+        const struct vuart_rec_event *ev = &events[i].ev;
+        const struct vuart_rec_event *prev = i ? &events[i - 1].ev : NULL;
+        if (prev && prev->len == VUART_REC_DATA_LEN && prev->ts_ns == ev->ts_ns && prev->aux == ev->aux) {
+            stream_add(stream, (const char *)ev->data, ev->len, ev->aux);
+            stream->flushes[stream->nflushes - 2].len += ev->len; //merge with previous
+            --stream->nflushes;
+        } else {
+            stream_add(stream, (const char *)ev->data, ev->len, ev->aux);
+        }
+    }
+
+    free(events);
+    return nevents ? 0 : -ENODATA;
+}
+
+/****************************************************** Benchmark *****************************************************/
+/**
+ * Parses the source as-is and then re-split iterations times, comparing every result to the expected one
+ *
+ * @param expected commands the source is known to contain; NULL to use the as-is parse as a reference
+ */
+static size_t bench_source(const char *name, const struct bench_stream *src, const struct bench_routes *expected,
+                           unsigned int iterations, unsigned int seed)
+{
+    struct bench_routes reference = { 0 }, got = { 0 };
+    struct bench_stream split = { 0 };
+    size_t misparses = 0;
+
+    feed(src, &reference, NULL);
+    if (expected)
+        misparses += routes_diff(expected, &reference);
+    else
+        expected = &reference;
+
+    u64 elapsed = 0;
+    size_t flushes = 0;
+    unsigned long routed_start = routed_cnt, unknown_start = unknown_cnt;
+    for (unsigned int i = 0; i < iterations; ++i) {
+        resplit(src, &split, &seed);
+        flushes += split.nflushes;
+        got.cnt = 0;
+
+        u64 start = now_ns();
+        feed(&split, &got, &seed);
+        elapsed += now_ns() - start;
+
+        misparses += routes_diff(expected, &got);
+    }
+
+    unsigned long routed = routed_cnt - routed_start;
+    printf("%-10s %12zu %10zu %10lu %8lu %12.0f %8.1f %8zu\n", name, src->len * iterations, flushes, routed,
+           unknown_cnt - unknown_start, elapsed ? routed * 1e9 / elapsed : 0.0,
+           routed ? (double)elapsed / routed : 0.0, misparses);
+
+    free(reference.items);
+    free(got.items);
+    stream_free(&split);
+    return misparses;
+}
+
+/******************************************************* Fuzzing ******************************************************/
+static void check_invariants(void)
+{
+    unsigned int used = work_ring.head - work_ring.tail;
+    if (used > PMU_WORK_RING_LEN || scan_pos != work_ring.head ||
+        (has_cmd && work_ring.data[work_ring.tail & work_ring.mask] != PMU_CMD_HEAD) || (!has_cmd && used != 0)) {
+        fprintf(stderr, "Work ring broken: head=%u tail=%u scan=%u has_cmd=%d\n", work_ring.head, work_ring.tail,
+                scan_pos, has_cmd);
+        abort();
+    }
+}
+
+/**
+ * libFuzzer entry point: every flush is a control byte (bits 0-1: reason, bit 2: split the view in half, bits 3-7:
+ * length-1) followed by its data
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bool registered = false;
+    if (!registered) {
+        kmock_quiet = true;
+        if (register_pmu_shim(&bench_hw) != 0)
+            abort();
+        registered = true;
+    }
+
+    reset_parser();
+    size_t pos = 0;
+    while (pos < size) {
+        u8 ctrl = data[pos++];
+        unsigned int len = min_t(size_t, (ctrl >> 3) + 1, size - pos);
+        vuart_flush_reason reason = (ctrl & 3) % 3;
+
+        deliver((const char *)data + pos, len, (ctrl & 4) ? len / 2 : len, reason);
+        check_invariants();
+        kmock_run_work(cmd_wq);
+        pos += len;
+    }
+
+    return 0;
+}
+
+#ifndef PMU_BENCH_LIBFUZZER
+static int fuzz_file(const char *path)
+{
+    static u8 buf[BENCH_FUZZ_INPUT_MAX];
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -ENOENT;
+    }
+
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+
+    return LLVMFuzzerTestOneInput(buf, len);
+}
+
+/**
+ * Runs the fuzz target with random inputs, biased towards bytes which mean something to the parser
+ */
+static void fuzz_random(unsigned long runs, unsigned int seed)
+{
+    static const char alphabet[] = "-----456789:;=@ABCJKLMORSVWlrstuA012\r\n";
+    static u8 buf[BENCH_FUZZ_INPUT_MAX];
+
+    u64 start = now_ns();
+    for (unsigned long i = 0; i < runs; ++i) {
+        size_t len = rand_r(&seed) % sizeof(buf);
+        for (size_t j = 0; j < len; ++j) {
+            unsigned int r = rand_r(&seed);
+            buf[j] = (r & 0x300) ? alphabet[(r >> 10) % (sizeof(alphabet) - 1)] : (u8)r;
+        }
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+
+    printf("fuzz: %lu runs in %.2fs, %lu commands routed (%lu unknown), no invariant violations\n", runs,
+           (now_ns() - start) / 1e9, routed_cnt, unknown_cnt);
+}
+
+int main(int argc, char **argv)
+{
+    size_t packets = 10000;
+    unsigned int iterations = 100;
+    unsigned int seed = 1;
+    int line = PMU_TTYS_LINE;
+    char *traces[64];
+    int ntraces = 0;
+    char *fuzz_inputs[64];
+    int nfuzz = 0;
+    unsigned long fuzz_runs = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:s:l:r:z:Z:h")) != -1) {
+        switch (opt) {
+            case 'n': packets = strtoull(optarg, NULL, 0); break;
+            case 'i': iterations = strtoul(optarg, NULL, 0); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'l': line = atoi(optarg); break;
+            case 'r': if (ntraces < ARRAY_SIZE(traces)) traces[ntraces++] = optarg; break;
+            case 'z': if (nfuzz < ARRAY_SIZE(fuzz_inputs)) fuzz_inputs[nfuzz++] = optarg; break;
+            case 'Z': fuzz_runs = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n packets] [-i iterations] [-s seed] [-l line] [-r trace]... "
+                                "[-z fuzz_input]... [-Z fuzz_runs]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (nfuzz || fuzz_runs) {
+        for (int i = 0; i < nfuzz; ++i) {
+            if (fuzz_file(fuzz_inputs[i]) != 0)
+                return 1;
+        }
+        if (fuzz_runs)
+            fuzz_random(fuzz_runs, seed);
+        else
+            printf("fuzz: %d inputs, no invariant violations\n", nfuzz);
+
+        return 0;
+    }
+
+    kmock_quiet = true; //unknown commands are generated on purpose
+    if (register_pmu_shim(&bench_hw) != 0) {
+        fprintf(stderr, "Failed to register PMU shim\n");
+        return 1;
+    }
+
+    char sig[8];
+    collect_cmds(single_byte_cmds, PMU_CMD__MIN_CODE, ARRAY_SIZE(single_byte_cmds), sig, 0);
+
+    printf("%-10s %12s %10s %10s %8s %12s %8s %8s\n", "source", "bytes", "flushes", "cmds", "unknown", "cmds/s",
+           "ns/cmd", "misparse");
+
+    size_t misparses = 0;
+    struct bench_stream stream = { 0 };
+    struct bench_routes expected = { 0 };
+    unsigned int gen_seed = seed;
+    gen_synthetic(&stream, &expected, packets, &gen_seed);
+    misparses += bench_source("synthetic", &stream, &expected, iterations, seed);
+    stream_free(&stream);
+    free(expected.items);
+
+    if (ntraces) {
+        if (load_traces(&stream, traces, ntraces, line) != 0) {
+            fprintf(stderr, "No TX data for ttyS%d found in traces\n", line);
+            misparses = 1;
+        } else {
+            misparses += bench_source("trace", &stream, NULL, iterations, seed);
+        }
+        stream_free(&stream);
+    }
+
+    unregister_pmu_shim();
+    return misparses ? 1 : 0;
+}
+#endif //PMU_BENCH_LIBFUZZER
@@ -0,0 +1,258 @@
+/**
+ * Minimal userspace stand-ins for kernel APIs used by internal/uart/virtual_uart.c
+ *
+ * Every linux/ and asm/ header the vUART includes is generated by the Makefile as a one-liner including this
+ * file (except linux/serial_reg.h which comes from the system UAPI headers). Only what's needed to run the chip state
+ * machine in a single thread is implemented. Things which matter for the benchmark (locks, timers) are counted instead
+ * of being just no-ops.
+ */
+#ifndef VUART_BENCH_KERNEL_MOCK_H
+#define VUART_BENCH_KERNEL_MOCK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h> //CLOCK_MONOTONIC
+#include <sys/types.h> //ssize_t
+
+/******************************************************* Basics *******************************************************/
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef unsigned int gfp_t;
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#ifndef LINUX_VERSION_CODE
+#define LINUX_VERSION_CODE KERNEL_VERSION(4,4,59)
+#endif
+#define KBUILD_MODNAME "vuart_bench"
+#ifndef CONFIG_SERIAL_8250_NR_UARTS
+#define CONFIG_SERIAL_8250_NR_UARTS 4
+#endif
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __must_check
+#define __packed __attribute__((packed))
+#define __user
+#define __init
+#define __exit
+
+//Everything runs on a single thread so compiler barriers are enough
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() barrier()
+#define smp_rmb() barrier()
+#define smp_wmb() barrier()
+#define smp_load_acquire(p) ({ __typeof__(*(p)) ___v = *(volatile __typeof__(*(p)) *)(p); barrier(); ___v; })
+#define smp_store_release(p, v) do { barrier(); *(volatile __typeof__(*(p)) *)(p) = (v); } while(0)
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#define ACCESS_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define BUILD_BUG_ON_NOT_POWER_OF_2(n) _Static_assert((n) != 0 && ((n) & ((n) - 1)) == 0, #n " is not a power of 2")
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+
+#define NSEC_PER_SEC 1000000000LL
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) unlikely((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)ptr); }
+static inline bool IS_ERR_OR_NULL(const void *ptr) { return !ptr || IS_ERR_VALUE((unsigned long)ptr); }
+
+/****************************************************** Logging *******************************************************/
+#define pr_fmt(fmt) fmt
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_crit(fmt, ...) fprintf(stderr, "CRIT " fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) fprintf(stderr, "ERR " fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, "WARN " fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, "INFO " fmt, ##__VA_ARGS__)
+#define WARN(cond, fmt, ...) ({ int __c = !!(cond); if (__c) fprintf(stderr, "WARNING: " fmt "\n", ##__VA_ARGS__); __c; })
+
+/******************************************************* Memory *******************************************************/
+#define GFP_KERNEL 0
+//These must be functions as common.h calls them as (kmalloc)(size, flags)
+static inline void *kmalloc(size_t size, gfp_t flags) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t flags) { return calloc(1, size); }
+static inline void kfree(const void *ptr) { free((void *)ptr); }
+
+/******************************************************* Locking ******************************************************/
+extern unsigned long kmock_lock_acquisitions; //number of spin_lock*() calls, defined by the benchmark
+
+typedef struct {
+    int depth;
+} spinlock_t;
+
+#define spin_lock_init(lock) ((lock)->depth = 0)
+#define spin_lock_irqsave(lock, flags) do { (flags) = 0; ++kmock_lock_acquisitions; ++(lock)->depth; } while(0)
+#define spin_unlock_irqrestore(lock, flags) do { (void)(flags); --(lock)->depth; } while(0)
+#define spin_lock(lock) do { ++kmock_lock_acquisitions; ++(lock)->depth; } while(0)
+#define spin_unlock(lock) do { --(lock)->depth; } while(0)
+
+struct mutex {
+    int depth;
+};
+#define DEFINE_MUTEX(name) struct mutex name = { 0 }
+#define mutex_lock(lock) (++(lock)->depth)
+#define mutex_unlock(lock) (--(lock)->depth)
+
+#define rcu_read_lock() do { } while(0)
+#define rcu_read_unlock() do { } while(0)
+#define synchronize_rcu() do { } while(0)
+
+/**************************************************** Wait queues *****************************************************/
+typedef struct {
+    int dummy;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) ((wq)->dummy = 0)
+#define waitqueue_active(wq) 0
+#define wake_up(wq) do { } while(0)
+#define wake_up_interruptible(wq) do { } while(0)
+#define wake_up_interruptible_all(wq) do { } while(0)
+#define msecs_to_jiffies(ms) ((long)(ms))
+#define wait_event_interruptible_timeout(wq, cond, timeout) ((cond) ? (timeout) : 0)
+
+/******************************************************* Lists ********************************************************/
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+#define INIT_HLIST_NODE(n) do { (n)->next = NULL; (n)->pprev = NULL; } while(0)
+#define hlist_empty(h) (!(h)->first)
+#define hlist_unhashed(n) (!(n)->pprev)
+
+static inline void hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h)
+{
+    n->next = h->first;
+    if (h->first)
+        h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del_init_rcu(struct hlist_node *n)
+{
+    if (hlist_unhashed(n))
+        return;
+
+    *n->pprev = n->next;
+    if (n->next)
+        n->next->pprev = n->pprev;
+    n->next = NULL;
+    n->pprev = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) ({ __typeof__(ptr) __p = (ptr); __p ? container_of(__p, type, member) : NULL; })
+#define hlist_for_each_entry(pos, head, member) \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos; \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+#define hlist_for_each_entry_rcu(pos, head, member) hlist_for_each_entry(pos, head, member)
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+         pos && ({ n = pos->member.next; 1; }); \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+/******************************************************* Timers *******************************************************/
+/*
+ * Timers never fire on their own - the benchmark fires them (see kmock_hrtimer_fire()) when it decides the simulated
+ * time has passed, i.e. when nothing else is happening on the line.
+ */
+extern unsigned long kmock_hrtimer_starts; //number of hrtimer_start() calls, defined by the benchmark
+
+typedef s64 ktime_t;
+enum hrtimer_restart { HRTIMER_NORESTART, HRTIMER_RESTART };
+enum hrtimer_mode { HRTIMER_MODE_ABS, HRTIMER_MODE_REL };
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    ktime_t expires;
+    bool armed;
+};
+
+#define ns_to_ktime(ns) ((ktime_t)(ns))
+#define hrtimer_init(timer, clock, mode) do { (timer)->armed = false; (timer)->function = NULL; } while(0)
+#define hrtimer_start(timer, tim, mode) do { (timer)->expires = (tim); (timer)->armed = true; ++kmock_hrtimer_starts; } while(0)
+#define hrtimer_active(timer) ((timer)->armed)
+static inline int hrtimer_cancel(struct hrtimer *timer)
+{
+    int was_armed = timer->armed;
+    timer->armed = false;
+    return was_armed;
+}
+
+static inline void kmock_hrtimer_fire(struct hrtimer *timer)
+{
+    timer->armed = false;
+    if (timer->function(timer) == HRTIMER_RESTART)
+        timer->armed = true;
+}
+
+/****************************************************** Devices *******************************************************/
+struct bus_type;
+struct device_driver {
+    const char *name;
+};
+#define THIS_MODULE NULL
+
+/************************************************ Serial & 8250 driver ************************************************/
+typedef unsigned long upf_t;
+#define UPF_SKIP_TEST ((upf_t)1 << 6)
+#define UPF_FIXED_TYPE ((upf_t)1 << 27)
+#define UPF_BOOT_AUTOCONF ((upf_t)1 << 28)
+#define STD_COMX_FLAGS (UPF_BOOT_AUTOCONF | UPF_SKIP_TEST)
+#define BASE_BAUD (1843200 / 16)
+
+#define PORT_16550A 4
+#define PORT_16750 8
+#define PORT_16C950 10
+
+struct uart_port {
+    unsigned int line;
+    unsigned long iobase;
+    unsigned char *membase;
+    unsigned int (*serial_in)(struct uart_port *, int);
+    void (*serial_out)(struct uart_port *, int, int);
+    unsigned int irq;
+    unsigned long irqflags;
+    unsigned int uartclk;
+    unsigned int fifosize;
+    unsigned char regshift;
+    unsigned char iotype;
+    unsigned char hub6;
+    upf_t flags;
+    unsigned int type;
+};
+
+struct uart_8250_port {
+    struct uart_port port;
+    unsigned char cur_iotype;
+};
+
+//Implemented by the benchmark
+int serial8250_register_8250_port(struct uart_8250_port *up);
+void serial8250_unregister_port(int line);
+
+#endif //VUART_BENCH_KERNEL_MOCK_H
@@ -0,0 +1,519 @@
+/**
+ * Userspace benchmark of the vUART chip emulation (internal/uart/virtual_uart.c)
+ *
+ * The whole virtual_uart.c is compiled here against mocked kernel APIs (see kernel_mock.h) and driven the same way the
+ * Linux 8250 driver drives a port: startup & termios register sequences, then interrupt-driven TX (write up to
+ * tx_loadsz bytes to THR on THRI, disable THRI when done) and RX (read RHR as long as LSR has DR). vIRQs are delivered
+ * synchronously by a dispatcher loop below instead of the vIRQ thread/timer, and the RX character timeout hrtimer is
+ * fired whenever the line would otherwise be idle.
+ *
+ * For every chip model it reports throughput and how much work each byte costs: vdev lock acquisitions, register
+ * accesses, handled interrupts and vIRQ wake-ups. This makes it possible to compare changes of the state machine
+ * without a DSM kernel at hand. Absolute numbers are meaningless (there's no real driver nor scheduling here), relative
+ * ones between runs are what matters.
+ *
+ * Usage: ./vuart_bench [-m 16550a|16750|16950] [-n bytes] [-c inject_chunk] [-t tx_threshold] [-s tx_subscribers]
+ */
+#include "../../internal/uart/virtual_uart.c"
+#include <getopt.h>
+
+#ifndef BENCH_LINE
+#define BENCH_LINE 0 //use e.g. 5 with -DCONFIG_SERIAL_8250_NR_UARTS=8 to benchmark an additional (non-COM) port
+#endif
+#define BENCH_XMIT_SIZE 4096 //UART_XMIT_SIZE - size of the circular buffer the tty layer keeps for TX
+#define BENCH_RX_MAX_COUNT 256 //max characters serial8250_rx_chars() reads in one go
+#define BENCH_MAX_SUBS 8
+#define BENCH_STALL_LIMIT 1000000 //dispatcher rounds without progress after which we consider the line stuck
+
+unsigned long kmock_lock_acquisitions = 0;
+unsigned long kmock_hrtimer_starts = 0;
+
+/**
+ * Parts of the 8250 driver uart_config[] table relevant to emulated models
+ */
+struct bench_chip {
+    const char *name;
+    vuart_chip_model model;
+    u8 fcr; //what the driver writes to FCR in set_termios()
+    unsigned int tx_loadsz; //max bytes written to THR per THRI
+};
+
+static const struct bench_chip bench_chips[] = {
+    { .name = "16550a", .model = VUART_CHIP_16550A, .fcr = UART_FCR_ENABLE_FIFO | UART_FCR_R_TRIG_10, .tx_loadsz = 16 },
+    { .name = "16750", .model = VUART_CHIP_16750,
+      .fcr = UART_FCR_ENABLE_FIFO | UART_FCR_R_TRIG_10 | UART_FCR7_64BYTE, .tx_loadsz = 64 },
+    { .name = "16950", .model = VUART_CHIP_16950, .fcr = UART_FCR_ENABLE_FIFO | UART_FCR_R_TRIG_10, .tx_loadsz = 128 },
+};
+
+/**
+ * State of the emulated "driver side" of the port
+ */
+static struct {
+    struct uart_8250_port up; //copy of what vUART registered (its serial_in/serial_out)
+    const struct bench_chip *chip;
+    bool registered;
+    bool virq_pending; //set by vuart_virq_trigger(), cleared by the dispatcher
+    u8 ier; //driver's shadow copy of IER
+
+    //TX: the tty layer circular buffer is simply a window into the source data
+    const u8 *tx_data;
+    size_t tx_pos;
+    size_t tx_end;
+
+    //RX: what the driver read from RHR
+    size_t rx_bytes;
+    size_t rx_errors;
+
+    //Stats
+    unsigned long reg_accesses;
+    unsigned long irqs; //handler invocations which found an interrupt pending
+    unsigned long virq_wakeups; //vuart_virq_trigger() calls
+    unsigned long rx_timeouts; //character timeout hrtimer expirations
+} port;
+
+static struct {
+    struct vuart_tx_subscriber sub;
+    size_t bytes;
+    size_t errors;
+} subs[BENCH_MAX_SUBS];
+
+/*************************************************** Mocked vIRQ layer ************************************************/
+void vuart_virq_trigger(struct serial8250_16550A_vdev *vdev)
+{
+    ++port.virq_wakeups;
+    port.virq_pending = true;
+}
+
+int vuart_virq_prepare(struct serial8250_16550A_vdev *vdev)
+{
+    return 0;
+}
+
+int vuart_virq_release(struct serial8250_16550A_vdev *vdev)
+{
+    return 0;
+}
+
+int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
+{
+    vdev->virq_active = true;
+    return 0;
+}
+
+int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
+{
+    vdev->virq_active = false;
+    return 0;
+}
+
+int vuart_virq_set_mode(vuart_irq_mode mode)
+{
+    return -EOPNOTSUPP;
+}
+
+/************************************************ Mocked driver plumbing **********************************************/
+int is_driver_registered(const char *name, struct bus_type *bus)
+{
+    return 1;
+}
+
+driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
+{
+    return ERR_PTR(-EOPNOTSUPP);
+}
+
+int unwatch_driver_register(driver_watcher_instance *instance)
+{
+    return 0;
+}
+
+int serial8250_register_8250_port(struct uart_8250_port *up)
+{
+    //Restoring the original port registers it without our accessors
+    port.registered = up->port.serial_in != NULL;
+    if (port.registered)
+        port.up = *up;
+
+    return up->port.line;
+}
+
+void serial8250_unregister_port(int line)
+{
+    port.registered = false;
+}
+
+/****************************************** 8250 driver register access patterns ****************************************/
+static inline unsigned int drv_in(int offset)
+{
+    ++port.reg_accesses;
+    return port.up.port.serial_in(&port.up.port, offset);
+}
+
+static inline void drv_out(int offset, int value)
+{
+    ++port.reg_accesses;
+    port.up.port.serial_out(&port.up.port, offset, value);
+}
+
+/**
+ * What serial8250_do_startup() does with the chip (minus probing quirks we don't trigger)
+ */
+static void drv_startup(void)
+{
+    if (port.chip->model == VUART_CHIP_16950) { //wake up & enable enhanced mode, then soft reset via ICR
+        drv_out(UART_LCR, UART_LCR_CONF_MODE_B);
+        drv_out(UART_EFR, UART_EFR_ECB);
+        drv_out(UART_LCR, 0);
+        drv_out(UART_SCR, UART_CSR);
+        drv_out(UART_ICR, 0);
+    }
+
+    //serial8250_clear_fifos()
+    drv_out(UART_FCR, UART_FCR_ENABLE_FIFO);
+    drv_out(UART_FCR, UART_FCR_ENABLE_FIFO | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    drv_out(UART_FCR, 0);
+
+    //Clear the interrupt registers
+    drv_in(UART_LSR);
+    drv_in(UART_RX);
+    drv_in(UART_IIR);
+    drv_in(UART_MSR);
+
+    drv_out(UART_LCR, UART_LCR_WLEN8);
+    drv_out(UART_MCR, UART_MCR_DTR | UART_MCR_RTS | UART_MCR_OUT2);
+
+    //UART_BUG_THRE detection
+    drv_out(UART_IER, UART_IER_THRI);
+    drv_in(UART_IIR);
+    drv_out(UART_IER, 0);
+
+    drv_in(UART_LSR);
+    drv_in(UART_RX);
+    drv_in(UART_IIR);
+    drv_in(UART_MSR);
+
+    port.ier = UART_IER_RLSI | UART_IER_RDI;
+    drv_out(UART_IER, port.ier);
+}
+
+/**
+ * What serial8250_do_set_termios() does for 115200n8
+ */
+static void drv_set_termios(void)
+{
+    drv_out(UART_LCR, UART_LCR_WLEN8 | UART_LCR_DLAB);
+    drv_out(UART_DLL, 1);
+    drv_out(UART_DLM, 0);
+    if (port.chip->model == VUART_CHIP_16750) //64 bytes mode can only be enabled with DLAB set
+        drv_out(UART_FCR, port.chip->fcr);
+    drv_out(UART_LCR, UART_LCR_WLEN8);
+
+    if (port.chip->model != VUART_CHIP_16750) {
+        drv_out(UART_FCR, UART_FCR_ENABLE_FIFO);
+        drv_out(UART_FCR, port.chip->fcr);
+    }
+}
+
+static void drv_stop_tx(void)
+{
+    if (port.ier & UART_IER_THRI) {
+        port.ier &= ~UART_IER_THRI;
+        drv_out(UART_IER, port.ier);
+    }
+}
+
+static void drv_start_tx(void)
+{
+    if (!(port.ier & UART_IER_THRI)) {
+        port.ier |= UART_IER_THRI;
+        drv_out(UART_IER, port.ier);
+    }
+}
+
+/**
+ * serial8250_rx_chars()
+ */
+static unsigned int drv_rx_chars(unsigned int lsr)
+{
+    int max_count = BENCH_RX_MAX_COUNT;
+
+    do {
+        u8 ch = drv_in(UART_RX);
+        if (unlikely(ch != (u8)port.rx_bytes))
+            ++port.rx_errors;
+        ++port.rx_bytes;
+        lsr = drv_in(UART_LSR);
+    } while ((lsr & (UART_LSR_DR | UART_LSR_BI)) && (--max_count > 0));
+
+    return lsr;
+}
+
+/**
+ * serial8250_tx_chars()
+ */
+static void drv_tx_chars(void)
+{
+    if (port.tx_pos == port.tx_end) {
+        drv_stop_tx();
+        return;
+    }
+
+    unsigned int count = port.chip->tx_loadsz;
+    do {
+        drv_out(UART_TX, port.tx_data[port.tx_pos++]);
+        if (port.tx_pos == port.tx_end)
+            break;
+    } while (--count > 0);
+
+    if (port.tx_pos == port.tx_end)
+        drv_stop_tx();
+}
+
+/**
+ * serial8250_handle_irq()
+ *
+ * @return 1 if an interrupt was handled, 0 if there was nothing pending
+ */
+static int drv_handle_irq(void)
+{
+    unsigned int iir = drv_in(UART_IIR);
+    if (iir & UART_IIR_NO_INT)
+        return 0;
+
+    ++port.irqs;
+    unsigned int lsr = drv_in(UART_LSR);
+    if (lsr & (UART_LSR_DR | UART_LSR_BI))
+        lsr = drv_rx_chars(lsr);
+    drv_in(UART_MSR); //serial8250_modem_status()
+    if ((lsr & UART_LSR_THRE) && (port.ier & UART_IER_THRI))
+        drv_tx_chars();
+
+    return 1;
+}
+
+/**
+ * Delivers vIRQs until the line goes quiet; if it went quiet with RX data below the trigger level the character timeout
+ * "passes" and the whole thing repeats.
+ */
+static void dispatch(void)
+{
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(BENCH_LINE);
+
+    while (true) {
+        while (port.virq_pending) {
+            port.virq_pending = false;
+            drv_handle_irq();
+        }
+
+        if (!hrtimer_active(&vdev->rx_timer) || !(vdev->lsr & UART_LSR_DR))
+            return;
+
+        ++port.rx_timeouts;
+        kmock_hrtimer_fire(&vdev->rx_timer);
+    }
+}
+
+/****************************************************** Benchmark *****************************************************/
+/**
+ * Drain callback of a TX subscriber; it verifies the data & consumes everything
+ *
+ * Drain callbacks don't get the subscriber so every subscriber gets its own tiny wrapper (see SUB_DRAIN()).
+ */
+static unsigned int sub_drain(int idx, const struct vuart_tx_view *view)
+{
+    for (int s = 0; s < ARRAY_SIZE(view->seg); ++s) {
+        for (unsigned int i = 0; i < view->seg[s].len; ++i) {
+            if (unlikely((u8)view->seg[s].buffer[i] != (u8)subs[idx].bytes))
+                ++subs[idx].errors;
+            ++subs[idx].bytes;
+        }
+    }
+
+    return view->len;
+}
+
+#define SUB_DRAIN(idx) \
+    static unsigned int sub_drain_##idx(int line, const struct vuart_tx_view *view, vuart_flush_reason reason) \
+    { return sub_drain(idx, view); }
+SUB_DRAIN(0) SUB_DRAIN(1) SUB_DRAIN(2) SUB_DRAIN(3) SUB_DRAIN(4) SUB_DRAIN(5) SUB_DRAIN(6) SUB_DRAIN(7)
+
+static vuart_drain_callback_t *const sub_drains[BENCH_MAX_SUBS] = {
+    sub_drain_0, sub_drain_1, sub_drain_2, sub_drain_3, sub_drain_4, sub_drain_5, sub_drain_6, sub_drain_7,
+};
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void reset_stats(void)
+{
+    kmock_lock_acquisitions = 0;
+    kmock_hrtimer_starts = 0;
+    port.reg_accesses = 0;
+    port.irqs = 0;
+    port.virq_wakeups = 0;
+    port.rx_timeouts = 0;
+}
+
+static void print_stats(const char *dir, size_t bytes, u64 elapsed_ns, size_t errors)
+{
+    double b = bytes ? (double)bytes : 1;
+    printf("%-7s %-3s %10zu %9.2f %8.1f %8.2f %8.2f %8.4f %8.4f %8lu %6zu\n", port.chip->name, dir, bytes,
+           elapsed_ns ? bytes * 1e3 / elapsed_ns : 0.0, elapsed_ns / b, kmock_lock_acquisitions / b,
+           port.reg_accesses / b, port.irqs / b, port.virq_wakeups / b, port.rx_timeouts, errors);
+}
+
+/**
+ * Application writes the data to /dev/ttyS in BENCH_XMIT_SIZE chunks; every write starts TX and waits for it to drain
+ */
+static int bench_tx(const u8 *data, size_t len, int nsubs)
+{
+    reset_stats();
+    port.tx_data = data;
+    port.tx_pos = port.tx_end = 0;
+
+    u64 start = now_ns();
+    while (port.tx_pos < len) {
+        port.tx_end = min(len, port.tx_pos + BENCH_XMIT_SIZE);
+        drv_start_tx();
+        dispatch();
+
+        if (unlikely(port.tx_pos != port.tx_end)) {
+            fprintf(stderr, "TX stalled on %s at byte %zu - no THRI raised\n", port.chip->name, port.tx_pos);
+            return -EIO;
+        }
+    }
+    u64 elapsed = now_ns() - start;
+
+    size_t errors = 0;
+    for (int i = 0; i < nsubs; ++i) {
+        errors += subs[i].errors;
+        if (subs[i].bytes != len) {
+            fprintf(stderr, "Subscriber %d got %zu of %zu bytes on %s\n", i, subs[i].bytes, len, port.chip->name);
+            ++errors;
+        }
+    }
+    print_stats("tx", len, elapsed, errors);
+
+    return 0;
+}
+
+/**
+ * Remote end injects data in chunks as fast as vUART accepts it; the driver picks it up on interrupts
+ */
+static int bench_rx(const u8 *data, size_t len, unsigned int chunk)
+{
+    reset_stats();
+    port.rx_bytes = 0;
+    port.rx_errors = 0;
+
+    size_t done = 0;
+    unsigned long idle_rounds = 0;
+    u64 start = now_ns();
+    while (done < len) {
+        int out = vuart_inject_rx(BENCH_LINE, (const char *)data + done, min(chunk, len - done));
+        if (out < 0)
+            return out;
+
+        done += out;
+        dispatch();
+        if (unlikely(out == 0 && ++idle_rounds > BENCH_STALL_LIMIT)) {
+            fprintf(stderr, "RX stalled on %s at byte %zu\n", port.chip->name, done);
+            return -EIO;
+        }
+    }
+    dispatch();
+    u64 elapsed = now_ns() - start;
+
+    size_t errors = port.rx_errors + (port.rx_bytes != len ? 1 : 0);
+    print_stats("rx", port.rx_bytes, elapsed, errors);
+
+    return 0;
+}
+
+static int bench_chip(const struct bench_chip *chip, const u8 *data, size_t len, unsigned int chunk,
+                      unsigned int threshold, int nsubs)
+{
+    int out;
+
+    memset(&port, 0, sizeof(port));
+    port.chip = chip;
+    if ((out = vuart_add_device_model(BENCH_LINE, chip->model)) != 0) {
+        fprintf(stderr, "Failed to add %s vUART: %d\n", chip->name, out);
+        return out;
+    }
+
+    drv_startup();
+    drv_set_termios();
+
+    memset(subs, 0, sizeof(subs));
+    for (int i = 0; i < nsubs; ++i) {
+        subs[i].sub.drain_fn = sub_drains[i];
+        subs[i].sub.threshold = threshold;
+        if ((out = vuart_subscribe_tx(BENCH_LINE, &subs[i].sub)) != 0) {
+            fprintf(stderr, "Failed to subscribe to %s TX: %d\n", chip->name, out);
+            goto out_remove;
+        }
+    }
+
+    if ((out = bench_tx(data, len, nsubs)) == 0)
+        out = bench_rx(data, len, chunk);
+
+    out_remove:
+    vuart_remove_device(BENCH_LINE);
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = 16 * 1024 * 1024;
+    unsigned int chunk = 64;
+    unsigned int threshold = VUART_FIFO_LEN;
+    int nsubs = 1;
+    const char *model = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:c:t:s:h")) != -1) {
+        switch (opt) {
+            case 'm': model = optarg; break;
+            case 'n': len = strtoull(optarg, NULL, 0); break;
+            case 'c': chunk = strtoul(optarg, NULL, 0); break;
+            case 't': threshold = strtoul(optarg, NULL, 0); break;
+            case 's': nsubs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-m 16550a|16750|16950] [-n bytes] [-c inject_chunk] [-t tx_threshold] "
+                                "[-s tx_subscribers]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (chunk == 0 || threshold == 0 || nsubs < 0 || nsubs > BENCH_MAX_SUBS) {
+        fprintf(stderr, "Invalid parameters (chunk & threshold must be >0, up to %d subscribers)\n", BENCH_MAX_SUBS);
+        return 1;
+    }
+
+    u8 *data = malloc(len);
+    if (!data) {
+        fprintf(stderr, "Failed to allocate %zu bytes\n", len);
+        return 1;
+    }
+    for (size_t i = 0; i < len; ++i) //a simple sequence makes it easy to verify data on the other side
+        data[i] = (u8)i;
+
+    printf("%-7s %-3s %10s %9s %8s %8s %8s %8s %8s %8s %6s\n", "chip", "dir", "bytes", "MB/s", "ns/B", "locks/B",
+           "regs/B", "irqs/B", "wakes/B", "rx_tmo", "errors");
+
+    int out = 0;
+    for (int i = 0; i < ARRAY_SIZE(bench_chips); ++i) {
+        if (model && strcmp(model, bench_chips[i].name) != 0)
+            continue;
+        if ((out = bench_chip(&bench_chips[i], data, len, chunk, threshold, nsubs)) != 0)
+            break;
+    }
+
+    free(data);
+    return out ? 1 : 0;
+}